@@ -8,12 +8,14 @@ Heavily inspired by the FSL base class
 """
 
 import json
+import shlex
 from copy import deepcopy
-from os import path, getcwd
+from os import environ, path, getcwd
 from nipype import logging
 from nipype.utils.filemanip import fname_presuffix
 from nipype.interfaces.base import traits, isdefined, CommandLine, CommandLineInputSpec, TraitedSpec, DynamicTraitedSpec, File, PackageInfo
 from nipype.external.due import BibTeX
+from .serve import submit
 
 ################################# Input Specs ##################################
 
@@ -54,6 +56,16 @@ class FitInputSpec(InputSpec):
         decsc='Write out parameter covar images', argstr='--covar')
     residuals = traits.Bool(
         desc='Write out residuals for each data-point', argstr='--resids')
+    chunk = traits.Int(
+        desc='Fit voxels inside the mask in chunks of N', argstr='--chunk=%d')
+    checkpoint = traits.String(
+        desc='Save each slice to this file once fitted', argstr='--checkpoint=%s')
+    resume = traits.Bool(
+        desc='Skip slices already saved in the checkpoint file', argstr='--resume')
+    single = traits.Bool(
+        desc='Write all outputs to one image with a JSON index', argstr='--single')
+    slab = traits.Int(
+        desc='Stream images through the fit N slices at a time', argstr='--slab=%d')
 
 
 class SimInputBaseSpec(DynamicTraitedSpec):
@@ -180,6 +192,20 @@ class BaseCommand(CommandLine):
             basename, prefix=prefix, suffix=suffix, use_ext=True, newpath=cwd)
         return fname
 
+    def _run_interface(self, runtime, correct_return_codes=(0,)):
+        # If a qi server is running, send it the command instead of starting a new process
+        server = environ.get('QUIT_SERVER')
+        if not server:
+            return super()._run_interface(runtime, correct_return_codes)
+        result = submit(shlex.split(self.cmdline)[1:], cwd=runtime.cwd, server=server)
+        runtime.returncode = result['status']
+        runtime.stdout = result['output']
+        runtime.stderr = ''
+        runtime.merged = result['output']
+        if runtime.returncode not in correct_return_codes:
+            self.raise_exception(runtime)
+        return runtime
+
     def _parse_inputs(self, skip=None):
         # Make sequence dictionary into a .json file for input to interface
         if hasattr(self, '_json') and not isdefined(self.inputs.json):
@@ -193,8 +193,7 @@ class DESPOT2InputSpec(QI.FitInputSpec):
 
     # Options
     b1_map = File(desc='B1 map (ratio) file', argstr='--B1=%s')
-    algo = traits.Enum("LLS", "WLS", "NLS",
-                       desc="Choose algorithm", argstr="--algo=%d")
+    algo = traits.String(desc="Choose algorithm (l/w/n)", argstr="--algo=%s")
     ellipse = traits.Bool(
         desc="Data is ellipse geometric solution", argstr='--gs')
     iterations = traits.Int(
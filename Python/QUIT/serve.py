@@ -0,0 +1,64 @@
+# -*- coding: utf-8 -*-
+# emacs: -*- mode: python; py-indent-offset: 4; indent-tabs-mode: nil -*-
+# vi: set ft=python sts=4 ts=4 sw=4 et:
+"""Client for a running `qi serve` process.
+
+Start a server with ``qi serve /path/to/socket`` and set the environment variable
+``QUIT_SERVER=/path/to/socket``. The QUIT nipype interfaces then send their commands to the server
+instead of starting a new ``qi`` process for each one.
+"""
+
+import json
+import socket
+from os import environ, getcwd
+
+
+def submit(args, cwd=None, stdin=None, server=None):
+    """
+    Run a command on a qi server and wait for it to finish.
+
+    Parameters
+    ----------
+    args : list of str
+        The command line without the leading qi, e.g. ['despot1', 'spgr.nii.gz']
+    cwd : str
+        Directory to run the command in (default is the current directory)
+    stdin : str
+        Text to pass to the command as standard input, e.g. the sequence JSON
+    server : str
+        Path of the server socket (default is $QUIT_SERVER)
+
+    Returns
+    -------
+    result : dict
+        'status' is the exit status of the command, 'output' everything it printed
+    """
+    if server is None:
+        server = environ['QUIT_SERVER']
+    request = {'args': list(args), 'cwd': cwd or getcwd()}
+    if stdin is not None:
+        request['stdin'] = stdin
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(server)
+        s.sendall(json.dumps(request).encode())
+        s.shutdown(socket.SHUT_WR)
+        chunks = []
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            chunks.append(chunk)
+    return json.loads(b''.join(chunks).decode())
+
+
+def shutdown(server=None):
+    """
+    Stop a qi server
+    """
+    if server is None:
+        server = environ['QUIT_SERVER']
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(server)
+        s.sendall(json.dumps({'shutdown': True}).encode())
+        s.shutdown(socket.SHUT_WR)
+        s.recv(65536)
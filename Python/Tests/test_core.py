@@ -0,0 +1,166 @@
+import gzip
+import json
+import os
+import unittest
+import numpy as np
+import nibabel as nib
+from nipype.interfaces.base import CommandLine
+from QUIT.interfaces.core import NewImage, Diff
+from QUIT.interfaces.relax import DESPOT1, DESPOT1Sim, Ellipse, EllipseSim
+
+vb = True
+CommandLine.terminal_output = 'allatonce'
+
+seq = {'SPGR': {'TR': 10e-3, 'FA': [3, 18]}}
+spgr_file = 'sim_spgr.nii.gz'
+
+
+def simulate(img_sz=[32, 32, 32]):
+    NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.8, 1.0),
+             out_file='PD.nii.gz', verbose=vb).run()
+    NewImage(img_size=img_sz, grad_dim=1, grad_vals=(0.8, 1.3),
+             out_file='T1.nii.gz', verbose=vb).run()
+    DESPOT1Sim(sequence=seq, in_file=spgr_file, noise=0.001, verbose=vb,
+               PD='PD.nii.gz', T1='T1.nii.gz').run()
+
+
+def load(filename):
+    return np.asanyarray(nib.load(filename).dataobj)
+
+
+def load_mhd(filename):
+    """
+    Minimal MetaImage reader, returns the data with x first as nibabel does
+    """
+    with open(filename) as f:
+        header = dict(line.split(' = ', 1) for line in f.read().splitlines())
+    dtypes = {'MET_FLOAT': np.float32, 'MET_DOUBLE': np.float64}
+    dims = [int(d) for d in header['DimSize'].split()]
+    raw = os.path.join(os.path.dirname(filename), header['ElementDataFile'])
+    return np.fromfile(raw, dtype=dtypes[header['ElementType']]).reshape(dims[::-1]).T
+
+
+def bgzf_blocks(filename):
+    """
+    Returns the uncompressed size of each BGZF block, failing if the file is not BGZF
+    """
+    with open(filename, 'rb') as f:
+        data = f.read()
+    sizes = []
+    pos = 0
+    while pos < len(data):
+        assert data[pos:pos + 4] == bytes([31, 139, 8, 4]), 'Not a gzip member with extra field'
+        assert data[pos + 12:pos + 14] == b'BC', 'No BGZF block size field'
+        block_size = int.from_bytes(data[pos + 16:pos + 18], 'little') + 1
+        sizes.append(int.from_bytes(data[pos + block_size - 4:pos + block_size], 'little'))
+        pos += block_size
+    return sizes
+
+
+class Core(unittest.TestCase):
+    def test_checkpoint(self, subregion=None):
+        simulate()
+        options = {'sequence': seq, 'in_file': spgr_file, 'verbose': vb}
+        if subregion:
+            options['subregion'] = subregion
+        DESPOT1(prefix='full_', **options).run()
+
+        # Fit every slice but fail to write the outputs, which leaves the checkpoint behind
+        checkpoint = 'D1.checkpoint'
+        with self.assertRaises(Exception):
+            DESPOT1(prefix='no_such_dir/', checkpoint=checkpoint, **options).run()
+        self.assertTrue(os.path.exists(checkpoint))
+        # Cut the file off part-way through a slice, as if the fit had been killed
+        os.truncate(checkpoint, os.path.getsize(checkpoint) * 3 // 5)
+
+        DESPOT1(prefix='resumed_', checkpoint=checkpoint, resume=True, **options).run()
+        self.assertFalse(os.path.exists(checkpoint))
+        for output in ['D1_PD.nii.gz', 'D1_T1.nii.gz', 'D1_rmse.nii.gz']:
+            np.testing.assert_allclose(load('resumed_' + output), load('full_' + output),
+                                       rtol=1e-6)
+
+    def test_checkpoint_subregion(self):
+        self.test_checkpoint('4,4,4,16,16,16')
+
+    def test_single(self):
+        seq = {'SSFP': {'FA': [15, 15, 15, 15, 15, 15],
+                        'PhaseInc': [180, 240, 300, 0, 60, 120],
+                        'TR': 0.01}}
+        ellipse_file = 'single_ellipse.nii'  # Uncompressed so that it can be streamed
+        img_sz = [16, 16, 16]
+        NewImage(out_file='G.nii.gz', img_size=img_sz, grad_dim=0,
+                 grad_vals=(0.05, 0.1), verbose=vb).run()
+        NewImage(out_file='a.nii.gz', img_size=img_sz, grad_dim=1,
+                 grad_vals=(0.7, 0.8), verbose=vb).run()
+        NewImage(out_file='b.nii.gz', img_size=img_sz, grad_dim=2,
+                 grad_vals=(0.3, 0.4), verbose=vb).run()
+        NewImage(out_file='zero.nii.gz', img_size=img_sz, fill=0, verbose=vb).run()
+        EllipseSim(sequence=seq, in_file=ellipse_file, noise=0.001, verbose=vb,
+                   G='G.nii.gz', a='a.nii.gz', b='b.nii.gz',
+                   theta_0='zero.nii.gz', phi_rf='zero.nii.gz').run()
+
+        options = {'sequence': seq, 'in_file': ellipse_file, 'residuals': True, 'verbose': vb}
+        Ellipse(prefix='files_', **options).run()
+        Ellipse(prefix='single_', single=True, **options).run()
+        # Streamed writes need a format that can be written in parts
+        Ellipse(prefix='slab_', single=True, slab=5, environ={'QUIT_EXT': '.mhd'},
+                **options).run()
+
+        names = ['G', 'a', 'b', 'theta_0', 'phi_rf', 'rmse', 'iterations', 'residuals_0']
+        sizes = [1, 1, 1, 1, 1, 1, 1, 12]  # The complex residuals are split into real and imaginary
+        for prefix, load_single in [('single_', load), ('slab_', load_mhd)]:
+            with open(prefix + 'ES_outputs.json') as f:
+                index = json.load(f)
+            self.assertEqual([o['name'] for o in index['outputs']], names)
+            self.assertEqual([o['size'] for o in index['outputs']], sizes)
+            self.assertEqual([o['start'] for o in index['outputs']],
+                             list(np.cumsum([0] + sizes[:-1])))
+            self.assertEqual(index['volumes'], sum(sizes))
+            self.assertTrue(index['outputs'][-1]['complex'])
+
+            ext = '.nii.gz' if prefix == 'single_' else '.mhd'
+            single = load_single(prefix + 'ES_outputs' + ext)
+            self.assertEqual(single.shape, (*img_sz, sum(sizes)))
+            for output in index['outputs']:
+                expected = load('files_ES_' + output['name'] + '.nii.gz')
+                expected = expected.reshape(*img_sz, -1)
+                volumes = single[..., output['start']:output['start'] + output['size']]
+                if output.get('complex', False):
+                    np.testing.assert_allclose(volumes[..., 0::2], expected.real, rtol=1e-6)
+                    np.testing.assert_allclose(volumes[..., 1::2], expected.imag, rtol=1e-6)
+                else:
+                    np.testing.assert_allclose(volumes, expected, rtol=1e-6)
+
+    def test_bgzf(self):
+        # 348 byte NIfTI header plus 4 bytes of extension flags
+        nii_header = 352
+        block_size = 0xff00
+        batch_size = 1024 * block_size
+        # 4 x 2 x 2088949 floats plus the header is exactly one batch of blocks
+        for name, img_sz in [('small', [16, 16, 16]), ('batch', [4, 2, 2088949])]:
+            nii = 'bgzf_' + name + '.nii'
+            NewImage(img_size=img_sz, grad_dim=2, grad_vals=(0.0, 1.0),
+                     out_file=nii, verbose=vb).run()
+            NewImage(img_size=img_sz, grad_dim=2, grad_vals=(0.0, 1.0),
+                     out_file=nii + '.gz', verbose=vb).run()
+            nii_size = os.path.getsize(nii)
+            self.assertEqual(nii_size, nii_header + 4 * int(np.prod(img_sz)))
+            if name == 'batch':
+                self.assertEqual(nii_size, batch_size)
+
+            # Full blocks, then the remainder, then the empty end-of-file block
+            blocks = bgzf_blocks(nii + '.gz')
+            n_full, remainder = divmod(nii_size, block_size)
+            self.assertEqual(blocks, [block_size] * n_full + [remainder] * (remainder > 0) + [0])
+
+            # A plain gzip reader sees one stream of concatenated members
+            with gzip.open(nii + '.gz', 'rb') as gz, open(nii, 'rb') as f:
+                self.assertEqual(gz.read(), f.read())
+
+            # Reading the .nii.gz back goes through the parallel block inflate
+            diff = Diff(baseline=nii, in_file=nii + '.gz', abs_diff=True, verbose=vb).run()
+            self.assertEqual(diff.outputs.out_diff, 0.0)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -64,7 +64,7 @@ class DESPOT_SC(unittest.TestCase):
         self.assertLessEqual(diff_PD.outputs.out_diff, 35)
         self.assertLessEqual(diff_B1.outputs.out_diff, 60)
 
-    def test_despot2(self, gs=False, tol=20):
+    def test_despot2(self, gs=False, tol=20, algo='l', chunk=0):
         seq = {'SSFP': {'TR': 10e-3,
                         'FA': [15, 30, 45, 60],
                         'PhaseInc': [180, 180, 180, 180]}}
@@ -82,8 +82,8 @@ class DESPOT_SC(unittest.TestCase):
         DESPOT2Sim(sequence=seq, in_file=ssfp_file,
                    t1_file='T1.nii.gz', ellipse=gs, noise=noise, verbose=vb,
                    PD='PD.nii.gz', T2='T2.nii.gz').run()
-        DESPOT2(sequence=seq, in_file=ssfp_file,
-                t1_file='T1.nii.gz', ellipse=gs, verbose=vb, residuals=True).run()
+        DESPOT2(sequence=seq, in_file=ssfp_file, t1_file='T1.nii.gz', ellipse=gs,
+                algo=algo, chunk=chunk, verbose=vb, residuals=True).run()
 
         diff_T2 = Diff(in_file='D2_T2.nii.gz', baseline='T2.nii.gz',
                        noise=noise, verbose=vb).run()
@@ -95,6 +95,12 @@ class DESPOT_SC(unittest.TestCase):
     def test_despot2gs(self):
         self.test_despot2(True, 30)
 
+    def test_despot2_wlls(self):
+        self.test_despot2(algo='w')
+
+    def test_despot2_wlls_chunked(self):
+        self.test_despot2(algo='w', chunk=100)
+
     def test_fm(self):
         seq = {'SSFP': {'TR': 5e-3,
                         'FA': [15, 15, 60, 60],
@@ -0,0 +1,117 @@
+import unittest
+import numpy as np
+import nibabel as nib
+from nipype.interfaces.base import CommandLine
+from QUIT.interfaces.core import NewImage
+from QUIT.interfaces.relax import DESPOT1, DESPOT1Sim
+from QUIT.interfaces.rufis import MUPA, MUPAB1Sim
+
+try:
+    import qipy
+except ImportError:
+    qipy = None
+
+vb = True
+CommandLine.terminal_output = 'allatonce'
+
+
+def load(filename):
+    return np.asanyarray(nib.load(filename).dataobj)
+
+
+def voxels(filename):
+    """
+    Loads a 4D image as voxels x volumes, in the same voxel order as load(map).ravel()
+    """
+    img = load(filename)
+    return img.reshape(-1, img.shape[-1])
+
+
+@unittest.skipIf(qipy is None, 'qipy was not built (configure with -DBUILD_PYTHON=ON)')
+class QIPy(unittest.TestCase):
+    def test_despot1(self):
+        seq = {'SPGR': {'TR': 10e-3, 'FA': [3, 18]}}
+        img_sz = [16, 16, 16]
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.8, 1.0),
+                 out_file='qipy_PD.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=1, grad_vals=(0.8, 1.3),
+                 out_file='qipy_T1.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=2, grad_vals=(0.8, 1.2),
+                 out_file='qipy_B1.nii.gz', verbose=vb).run()
+        PD = load('qipy_PD.nii.gz').ravel()
+        T1 = load('qipy_T1.nii.gz').ravel()
+        B1 = load('qipy_B1.nii.gz').ravel()
+
+        model = qipy.DESPOT1(seq['SPGR'])
+        self.assertEqual(model.varying_names, ['PD', 'T1'])
+        self.assertEqual(model.fixed_names, ['B1'])
+        varying = np.stack([PD, T1], axis=1)
+        for b1_map, fixed, suffix in [(None, None, ''), ('qipy_B1.nii.gz', B1, '_b1')]:
+            spgr_file = 'qipy_spgr' + suffix + '.nii.gz'
+            sim_args = {'b1_map': b1_map} if b1_map else {}
+            DESPOT1Sim(sequence=seq, in_file=spgr_file, PD='qipy_PD.nii.gz',
+                       T1='qipy_T1.nii.gz', verbose=vb, **sim_args).run()
+            signal = model.signal(varying, None if fixed is None else fixed[:, np.newaxis])
+            np.testing.assert_allclose(signal, voxels(spgr_file), rtol=1e-5)
+
+            # Fit noisy data so that the RMSE is not zero
+            DESPOT1Sim(sequence=seq, in_file=spgr_file, PD='qipy_PD.nii.gz',
+                       T1='qipy_T1.nii.gz', noise=0.001, verbose=vb, **sim_args).run()
+            data = voxels(spgr_file)
+            for algo in ['l', 'w', 'n']:
+                prefix = 'qipy_' + algo + suffix + '_'
+                DESPOT1(sequence=seq, in_file=spgr_file, algo=algo, prefix=prefix,
+                        verbose=vb, **sim_args).run()
+                fit = model.fit(data, None if fixed is None else {'B1': fixed}, algo)
+                for p in ['PD', 'T1', 'rmse']:
+                    np.testing.assert_allclose(fit[p], load(prefix + 'D1_' + p + '.nii.gz').ravel(),
+                                               rtol=1e-5, atol=1e-7)
+
+    def test_mupa(self):
+        prep_pulses = {
+            'inv': {'FAeff': 175.3, 'T_long': 0.0365, 'T_trans': 0.004, 'int_b1_sq': 53390.0},
+            't2-40': {'FAeff': 0.07, 'T_long': 0.0055, 'T_trans': 0.040, 'int_b1_sq': 279600.0},
+            't2-80': {'FAeff': 0.07, 'T_long': 0.0055, 'T_trans': 0.080, 'int_b1_sq': 279600.0},
+            'null': {'FAeff': 0.0, 'T_long': 0.0, 'T_trans': 0.0, 'int_b1_sq': 0.0}
+        }
+        seq = {'MUPA': {'TR': 2.34e-3,
+                        'Tramp': 10e-3,
+                        'spokes_per_seg': 256,
+                        'groups_per_seg': [1, 1, 1, 1],
+                        'FA': [2, 2, 2, 2],
+                        'Trf': [24, 24, 24, 24],
+                        'prep': ['inv', 'null', 't2-40', 't2-80'],
+                        'prep_pulses': prep_pulses}}
+        img_sz = [8, 8, 4]
+        NewImage(img_size=img_sz, grad_dim=0, grad_vals=(0.8, 1.0),
+                 out_file='qipy_M0.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=1, grad_vals=(0.8, 1.3),
+                 out_file='qipy_T1.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, grad_dim=2, grad_vals=(0.05, 0.1),
+                 out_file='qipy_T2.nii.gz', verbose=vb).run()
+        NewImage(img_size=img_sz, fill=0.9, out_file='qipy_mupa_B1.nii.gz', verbose=vb).run()
+        params = ['M0', 'T1', 'T2', 'B1']
+        files = {'M0': 'qipy_M0.nii.gz', 'T1': 'qipy_T1.nii.gz', 'T2': 'qipy_T2.nii.gz',
+                 'B1': 'qipy_mupa_B1.nii.gz'}
+
+        model = qipy.MUPA(seq['MUPA'])
+        self.assertEqual(model.varying_names, params)
+        varying = np.stack([load(files[p]).ravel() for p in params], axis=1)
+        MUPAB1Sim(sequence=seq, in_file='qipy_mupa.nii.gz', verbose=vb, **files).run()
+        signal = model.signal(varying)
+        expected = voxels('qipy_mupa.nii.gz')
+        np.testing.assert_allclose(signal, expected, rtol=1e-5,
+                                   atol=1e-5 * np.abs(expected).max())
+
+        MUPAB1Sim(sequence=seq, in_file='qipy_mupa.nii.gz', noise=0.0005, verbose=vb,
+                  **files).run()
+        # qi mupa fits the B1 model and names its outputs MUPAB1_
+        MUPA(sequence=seq, in_file='qipy_mupa.nii.gz', prefix='qipy_', verbose=vb).run()
+        fit = model.fit(voxels('qipy_mupa.nii.gz'))
+        for p in params + ['rmse']:
+            np.testing.assert_allclose(fit[p], load('qipy_MUPAB1_' + p + '.nii.gz').ravel(),
+                                       rtol=1e-5, atol=1e-7)
+
+
+if __name__ == '__main__':
+    unittest.main()
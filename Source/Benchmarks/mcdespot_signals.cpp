@@ -0,0 +1,247 @@
+/*
+ *  mcdespot_signals.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/*
+ *  Signal evaluations per second of the mcDESPOT models, comparing the allocation-free kernels
+ *  with the general 6x6 solve they replaced. Both are run on the same random parameters, and the
+ *  largest relative difference between them is reported as a check.
+ *
+ *  Usage: mcdespot_signals [samples]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <random>
+
+#include <Eigen/Dense>
+#include <unsupported/Eigen/MatrixFunctions>
+
+#include "Helpers.h"
+#include "JSON.h"
+#include "Log.h"
+#include "OnePoolSignals.h"
+#include "ThreePoolModel.h"
+#include "TwoPoolModel.h"
+
+namespace {
+
+/*
+ *  The previous implementation, with a 6x6 LU per SSFP flip-angle, a matrix exponential for SPGR
+ *  and new arrays for every signal
+ */
+namespace Reference {
+Eigen::MatrixXd SSFP2(Eigen::ArrayXd const &varying,
+                      QI_ARRAYN(double, 2) const &fixed,
+                      QI::SSFPSequence const &ssfp) {
+    double const &PD    = varying[0];
+    double const &T1_a  = varying[1];
+    double const &T2_a  = varying[2];
+    double const &T1_b  = varying[3];
+    double const &T2_b  = varying[4];
+    double const &tau_a = varying[5];
+    double const &f_a   = varying[6];
+    double const &f0    = fixed[0];
+    double const &B1    = fixed[1];
+    double const &TR    = ssfp.TR;
+    double const  E1_a  = exp(-TR / T1_a);
+    double const  E1_b  = exp(-TR / T1_b);
+    double const  E2_a  = exp(-TR / T2_a);
+    double const  E2_b  = exp(-TR / T2_b);
+    double        f_b, k_ab, k_ba;
+    QI::CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
+    double const         E_ab  = exp(-TR * k_ab / f_b);
+    double const         K1    = E_ab * f_b + f_a;
+    double const         K2    = E_ab * f_a + f_b;
+    double const         K3    = f_a * (1 - E_ab);
+    double const         K4    = f_b * (1 - E_ab);
+    Eigen::ArrayXd const alpha = B1 * ssfp.FA;
+    Eigen::ArrayXd const theta = ssfp.PhaseInc + 2. * M_PI * f0 * TR;
+
+    Eigen::MatrixXd M(4, ssfp.size());
+    Eigen::Matrix6d LHS;
+    Eigen::Vector6d RHS;
+    RHS << 0, 0, 0, 0, -E1_b * K3 * f_b + f_a * (-E1_a * K1 + 1),
+        -E1_a * K4 * f_a + f_b * (-E1_b * K2 + 1);
+    for (int i = 0; i < ssfp.size(); i++) {
+        double const ca = cos(alpha[i]);
+        double const sa = sin(alpha[i]);
+        double const ct = cos(theta[i]);
+        double const st = sin(theta[i]);
+
+        LHS << -E2_a * K1 * ct + ca, -E2_b * K3 * ct, E2_a * K1 * st, E2_b * K3 * st, sa, 0,
+            -E2_a * K4 * ct, -E2_b * K2 * ct + ca, E2_a * K4 * st, E2_b * K2 * st, 0, sa,
+            -E2_a * K1 * st, -E2_b * K3 * st, -E2_a * K1 * ct + 1, -E2_b * K3 * ct, 0, 0,
+            -E2_a * K4 * st, -E2_b * K2 * st, -E2_a * K4 * ct, -E2_b * K2 * ct + 1, 0, 0, -sa, 0,
+            0, 0, -E1_a * K1 + ca, -E1_b * K3, 0, -sa, 0, 0, -E1_a * K4, -E1_b * K2 + ca;
+        M.col(i).noalias() = PD * (LHS.partialPivLu().solve(RHS)).head(4);
+    }
+    return M;
+}
+
+Eigen::ArrayXd SPGR2(Eigen::ArrayXd const &varying,
+                     QI_ARRAYN(double, 2) const &fixed,
+                     QI::SPGRSequence const &spgr) {
+    double const &  PD    = varying[0];
+    double const &  T1_a  = varying[1];
+    double const &  T1_b  = varying[3];
+    double const &  tau_a = varying[5];
+    double const &  f_a   = varying[6];
+    double const &  B1    = fixed[1];
+    Eigen::Matrix2d A, eATR;
+    Eigen::Vector2d M0, Mobs;
+    Eigen::ArrayXd  signal(spgr.size());
+    double          k_ab, k_ba, f_b;
+    QI::CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
+    M0 << f_a, f_b;
+    A << ((1. / T1_a) + k_ab), -k_ba, -k_ab, ((1. / T1_b) + k_ba);
+    eATR                      = (-spgr.TR * A).exp();
+    Eigen::Vector2d const RHS = (Eigen::Matrix2d::Identity() - eATR) * M0;
+    for (int i = 0; i < spgr.size(); i++) {
+        double const a = spgr.FA[i] * B1;
+        Mobs = (Eigen::Matrix2d::Identity() - eATR * cos(a)).partialPivLu().solve(RHS * sin(a));
+        signal(i) = PD * Mobs.sum();
+    }
+    return signal;
+}
+
+Eigen::ArrayXd SSFP1(double const            PD,
+                     double const            T1,
+                     double const            T2,
+                     double const            f0,
+                     double const            B1,
+                     QI::SSFPSequence const &s) {
+    double const         E1      = exp(-s.TR / T1);
+    double const         E2      = exp(-s.TR / T2);
+    Eigen::ArrayXd const d       = (1 - E1 * cos(B1 * s.FA) - (E2 * E2) * (E1 - cos(B1 * s.FA)));
+    Eigen::ArrayXd const G       = sin(B1 * s.FA) * (1 - E1) / d;
+    Eigen::ArrayXd const b       = E2 * (1 - E1) * (1 + cos(B1 * s.FA)) / d;
+    double const         theta0  = 2.0 * M_PI * f0;
+    Eigen::ArrayXd const theta   = theta0 - s.PhaseInc;
+    double const         psi     = theta0 / 2.0;
+    Eigen::ArrayXd const cos_th  = cos(theta);
+    Eigen::ArrayXd const sin_th  = sin(theta);
+    double const         cos_psi = cos(psi);
+    double const         sin_psi = sin(psi);
+    Eigen::ArrayXd const re_m =
+        (cos_psi - E2 * (cos_th * cos_psi - sin_th * sin_psi)) * G / (1.0 - b * cos_th);
+    Eigen::ArrayXd const im_m =
+        (sin_psi - E2 * (cos_th * sin_psi + sin_th * cos_psi)) * G / (1.0 - b * cos_th);
+    return PD * sqrt(re_m.square() + im_m.square());
+}
+
+Eigen::ArrayXd TwoPool(QI::TwoPoolModel const &    model,
+                       Eigen::ArrayXd const &      v,
+                       QI_ARRAYN(double, 2) const &f) {
+    Eigen::ArrayXd sig(model.spgr.size() + model.ssfp.size());
+    sig.head(model.spgr.size()) = SPGR2(v, f, model.spgr);
+    sig.tail(model.ssfp.size()) = SSFP2(v, f, model.ssfp).array().square().colwise().sum().sqrt();
+    return sig;
+}
+
+Eigen::ArrayXd ThreePool(QI::ThreePoolModel const &  model,
+                         Eigen::ArrayXd const &      v,
+                         QI_ARRAYN(double, 2) const &f) {
+    double const f_ab = 1. - v[9];
+    QI_ARRAYN(double, 7) tpv;
+    tpv << v[0] * f_ab, v[1], v[2], v[3], v[4], v[7], v[8] / f_ab;
+    Eigen::ArrayXd sig = TwoPool(model.two_pool, tpv, f);
+    sig.head(model.spgr.size()) += QI::SPGRSignal(v[0] * v[9], v[5], f[1], model.spgr);
+    sig.tail(model.ssfp.size()) += SSFP1(v[0] * v[9], v[5], v[6], f[0], f[1], model.ssfp);
+    return sig;
+}
+} // namespace Reference
+
+/*
+ *  Evaluates every sample with the reference and the kernels and prints the rates
+ */
+template <typename Model, typename RefFunc>
+void Compare(std::string const &          name,
+             Model const &                model,
+             QI_ARRAYN(double, 2) const & fixed,
+             Eigen::ArrayXXd const &      samples,
+             RefFunc &&                   reference) {
+    using clock        = std::chrono::steady_clock;
+    auto const n       = samples.cols();
+    auto const m       = model.spgr.size() + model.ssfp.size();
+    auto const seconds = [](clock::duration const d) {
+        return std::chrono::duration<double>(d).count();
+    };
+
+    Eigen::ArrayXXd ref_signals(m, n);
+    auto const      ref_start = clock::now();
+    for (Eigen::Index s = 0; s < n; s++) {
+        ref_signals.col(s) = reference(model, samples.col(s), fixed);
+    }
+    double const ref_time = seconds(clock::now() - ref_start);
+
+    Eigen::ArrayXXd              new_signals(m, n);
+    typename Model::VaryingArray varying;
+    auto const                   new_start = clock::now();
+    auto const                   angles    = model.angles(fixed); // Once per voxel
+    for (Eigen::Index s = 0; s < n; s++) {
+        varying = samples.col(s);
+        model.signal(varying, angles, new_signals.col(s));
+    }
+    double const new_time = seconds(clock::now() - new_start);
+
+    double const max_diff = ((new_signals - ref_signals).abs() / ref_signals.abs()).maxCoeff();
+    fmt::print("{}: reference {:.3g} signals/s, kernels {:.3g} signals/s, speed-up {:.1f}x\n",
+               name,
+               n / ref_time,
+               n / new_time,
+               ref_time / new_time);
+    fmt::print("{}: largest relative difference {:.3g}\n", name, max_diff);
+}
+
+/*
+ *  Uniform random parameters between the default bounds of the model that meet its constraints,
+ *  as in region contraction
+ */
+template <typename Model> Eigen::ArrayXXd Samples(Model const &model, Eigen::Index const n) {
+    std::mt19937_64                        rng(0);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    Eigen::ArrayXXd                        samples(Model::NV, n);
+    typename Model::VaryingArray           varying;
+    for (Eigen::Index s = 0; s < n; s++) {
+        do {
+            for (int p = 0; p < Model::NV; p++) {
+                varying[p] =
+                    model.bounds_lo[p] + uniform(rng) * (model.bounds_hi[p] - model.bounds_lo[p]);
+            }
+        } while (!model.valid(varying));
+        samples.col(s) = varying;
+    }
+    return samples;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Eigen::Index const n = (argc > 1) ? std::atol(argv[1]) : 250000;
+    if (n <= 0) {
+        QI::Fail("Number of samples must be positive");
+    }
+    json const input = json::parse(R"({
+        "SPGR": { "TR": 0.0065, "FA": [3, 4, 5, 6, 7, 9, 13, 18] },
+        "SSFP": { "TR": 0.005,
+                  "FA": [12, 16, 21, 27, 33, 40, 51, 68, 12, 16, 21, 27, 33, 40, 51, 68],
+                  "PhaseInc": [180, 180, 180, 180, 180, 180, 180, 180, 0, 0, 0, 0, 0, 0, 0, 0] }
+    })");
+    auto const spgr = input.at("SPGR").get<QI::SPGRSequence>();
+    auto const ssfp = input.at("SSFP").get<QI::SSFPSequence>();
+    QI_ARRAYN(double, 2) const fixed{12.5, 0.93}; // f0, B1
+
+    QI::TwoPoolModel const two_pool{spgr, ssfp, false};
+    Compare("Two pool", two_pool, fixed, Samples(two_pool, n), Reference::TwoPool);
+    QI::ThreePoolModel const three_pool{spgr, ssfp, false};
+    Compare("Three pool", three_pool, fixed, Samples(three_pool, n), Reference::ThreePool);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,43 @@
+/*
+ *  AllocationCounter.cpp
+ *
+ *  Copyright (c) 2019 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "AllocationCounter.h"
+
+namespace QI {
+
+namespace detail {
+thread_local int    counting_allocations = 0;
+thread_local size_t thread_allocations   = 0;
+std::atomic<bool>   allocation_hooks{false};
+} // namespace detail
+
+AllocationCounter::AllocationCounter(bool const enable) :
+    m_enabled{enable}, m_start{detail::thread_allocations} {
+    if (m_enabled) {
+        detail::counting_allocations++;
+    }
+}
+
+AllocationCounter::~AllocationCounter() {
+    if (m_enabled) {
+        detail::counting_allocations--;
+    }
+}
+
+size_t AllocationCounter::count() const {
+    return m_enabled ? detail::thread_allocations - m_start : 0;
+}
+
+bool AllocationCounter::Available() {
+    return detail::allocation_hooks;
+}
+
+} // namespace QI
@@ -0,0 +1,51 @@
+/*
+ *  AllocationCounter.h
+ *
+ *  Copyright (c) 2019 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_ALLOCATIONCOUNTER_H
+#define QI_ALLOCATIONCOUNTER_H
+
+#include <atomic>
+#include <cstddef>
+
+namespace QI {
+
+/*
+ *  Counts the heap allocations made by the calling thread while the counter is alive, to check
+ *  that loops which should not touch the heap really do not. The counting is done by replacement
+ *  allocation functions that are only linked into the qi executable (see qi_allocations.cpp),
+ *  and only on glibc. Everywhere else, e.g. in the Python module, Available() is false and the
+ *  count stays at zero. A counter that was not enabled costs nothing.
+ */
+class AllocationCounter {
+  public:
+    explicit AllocationCounter(bool const enable);
+    ~AllocationCounter();
+    AllocationCounter(AllocationCounter const &) = delete;
+    void operator=(AllocationCounter const &) = delete;
+
+    size_t      count() const;
+    static bool Available();
+
+  private:
+    bool   m_enabled;
+    size_t m_start;
+};
+
+namespace detail {
+// Used by the replacement allocation functions
+extern thread_local int    counting_allocations;
+extern thread_local size_t thread_allocations;
+extern std::atomic<bool>   allocation_hooks;
+} // namespace detail
+
+} // namespace QI
+
+#endif // QI_ALLOCATIONCOUNTER_H
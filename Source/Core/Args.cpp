@@ -107,7 +107,7 @@ void ParseArgs(args::ArgumentParser &parser, int argc, char **argv, const args::
         QI::Info(verbose, "Starting {} {}", argv[0], QI::GetVersion());
     } catch (args::Help) {
         fmt::print("{}\n", parser);
-        exit(EXIT_SUCCESS);
+        QI::Exit(EXIT_SUCCESS);
     } catch (args::ParseError e) {
         QI::Fail("{}\n{}", parser, e.what());
     } catch (args::ValidationError e) {
@@ -127,7 +127,7 @@ void ParseArgs(args::ArgumentParser &parser,
         itk::MultiThreaderBase::SetGlobalMaximumNumberOfThreads(threads.Get());
     } catch (args::Help) {
         fmt::print("{}\n", parser);
-        exit(EXIT_SUCCESS);
+        QI::Exit(EXIT_SUCCESS);
     } catch (args::ParseError e) {
         QI::Fail("{}\n{}", parser, e.what());
     } catch (args::ValidationError e) {
@@ -81,6 +81,16 @@ template <typename TArray, const int size> void ArrayArgF(const std::string &a,
     args::Flag     resids(parser, "RESIDS", "Write point residuals", {'r', "resids"});         \
     args::Flag     covar(                                                                      \
         parser, "COVAR", "Write out covariance matrix (CoV and Corr) images", {"covar"});  \
+    args::Flag     fit_time(                                                                   \
+        parser, "FIT TIME", "Write out the time taken to fit each voxel", {"fit-time"});       \
+    args::Flag     warm_start(                                                                 \
+        parser, "WARM", "Start each fit from an already fitted neighbour", {"warm"});          \
+    args::ValueFlag<int> coarse(                                                               \
+        parser,                                                                                \
+        "COARSE",                                                                              \
+        "Fit a copy downsampled by N first, and start from those fits (default 0 = off)",      \
+        {"coarse"},                                                                            \
+        0);                                                                                    \
                                                                                                \
     args::ValueFlag<int>   threads(parser,                                                     \
                                  "THREADS",                                                  \
@@ -99,6 +109,48 @@ template <typename TArray, const int size> void ArrayArgF(const std::string &a,
     args::ValueFlag<std::string> prefix(                                                       \
         parser, "PREFIX", "Add a prefix to output filenames", {'o', "out"});                   \
     args::ValueFlag<std::string> json_file(                                                    \
-        parser, "JSON", "Read JSON from file instead of stdin", {"json"});
+        parser, "JSON", "Read JSON from file instead of stdin", {"json"});                     \
+    args::ValueFlag<int> chunk(                                                                \
+        parser,                                                                                \
+        "CHUNK",                                                                               \
+        "Fit voxels inside the mask in dynamically scheduled chunks of N (default 0 = off)",   \
+        {"chunk"},                                                                             \
+        0);                                                                                    \
+    args::ValueFlag<std::string> checkpoint(                                                   \
+        parser, "CHECKPOINT", "Save each slice to this file once fitted", {"checkpoint"});     \
+    args::Flag resume(                                                                         \
+        parser, "RESUME", "Skip slices already saved in the checkpoint file", {"resume"});     \
+    args::ValueFlag<int> slab(                                                                 \
+        parser,                                                                                \
+        "SLAB",                                                                                \
+        "Stream images through the fit N slices at a time (default 0 = off)",                  \
+        {"slab"},                                                                              \
+        0);                                                                                    \
+    args::Flag single_output(                                                                  \
+        parser,                                                                                \
+        "SINGLE",                                                                              \
+        "Write all outputs to one image, indexed in outputs.json",                             \
+        {"single"});                                                                           \
+    args::ValueFlag<std::string> precision(                                                    \
+        parser,                                                                                \
+        "PRECISION",                                                                           \
+        "Write real images as FLOAT, HALF or INT16 (default $QUIT_PRECISION or FLOAT)",        \
+        {"precision"});
+
+/*
+ * Pass the options from QI_COMMON_ARGS that control the ModelFitFilter itself to a filter, and
+ * the output precision, which is used by every image written afterwards
+ */
+#define QI_FIT_FILTER_ARGS(filter)                   \
+    filter->SetChunkSize(std::max(chunk.Get(), 0));  \
+    filter->SetCheckpoint(checkpoint.Get(), resume); \
+    filter->SetSlabSize(std::max(slab.Get(), 0));    \
+    filter->SetOutputFitTime(fit_time);              \
+    filter->SetWarmStart(warm_start);                \
+    filter->SetCoarseFactor(coarse.Get());           \
+    filter->SetSingleOutput(single_output);          \
+    if (precision) {                                 \
+        QI::SetOutPrecision(precision.Get());        \
+    }
 
 #endif // QI_ARGS_H
\ No newline at end of file
@@ -0,0 +1,141 @@
+/*
+ *  Checkpoint.cpp
+ *
+ *  Copyright (c) 2019 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+
+#include "Checkpoint.h"
+#include "Log.h"
+
+namespace QI {
+
+namespace {
+struct CheckpointHeader {
+    char     magic[4]    = {'Q', 'I', 'C', 'K'};
+    uint32_t version     = 1;
+    uint64_t size[3]     = {0, 0, 0};
+    uint64_t slice_bytes = 0;
+};
+} // namespace
+
+SliceCheckpoint::SliceCheckpoint(std::string const &          path,
+                                 std::array<size_t, 3> const &size,
+                                 BufferFunc                   f) :
+    m_path{path},
+    m_size{size}, m_buffers{f} {
+    for (auto const &b : m_buffers(0)) {
+        m_sliceBytes += b.second;
+    }
+}
+
+SliceCheckpoint::~SliceCheckpoint() {
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+std::vector<bool> SliceCheckpoint::Start() {
+    m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0) {
+        QI::Fail("Could not create checkpoint file {}", m_path);
+    }
+    CheckpointHeader header;
+    for (int i = 0; i < 3; i++) {
+        header.size[i] = m_size[i];
+    }
+    header.slice_bytes = m_sliceBytes;
+    Write(reinterpret_cast<char const *>(&header), sizeof(header));
+    Sync();
+    return std::vector<bool>(m_size[2], false);
+}
+
+std::vector<bool> SliceCheckpoint::Resume() {
+    std::ifstream in(m_path, std::ios::binary);
+    if (!in) {
+        QI::Warn("Checkpoint file {} not found, starting from the beginning", m_path);
+        return Start();
+    }
+    CheckpointHeader header, expected;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in) {
+        QI::Warn("Checkpoint file {} is incomplete, starting from the beginning", m_path);
+        return Start();
+    }
+    for (int i = 0; i < 3; i++) {
+        expected.size[i] = m_size[i];
+    }
+    expected.slice_bytes = m_sliceBytes;
+    if (std::memcmp(&header, &expected, sizeof(header)) != 0) {
+        QI::Fail("Checkpoint file {} does not match this image or these options", m_path);
+    }
+
+    std::vector<bool> done(m_size[2], false);
+    std::vector<char> record(m_sliceBytes);
+    int32_t           slice;
+    off_t             complete = sizeof(header);
+    while (in.read(reinterpret_cast<char *>(&slice), sizeof(slice)) &&
+           in.read(record.data(), record.size())) {
+        if (slice < 0 || static_cast<size_t>(slice) >= m_size[2]) {
+            QI::Fail("Checkpoint file {} contains invalid slice {}", m_path, slice);
+        }
+        char const *src = record.data();
+        for (auto const &b : m_buffers(slice)) {
+            std::memcpy(b.first, src, b.second);
+            src += b.second;
+        }
+        done[slice] = true;
+        complete += sizeof(slice) + m_sliceBytes;
+    }
+    in.close();
+
+    // Cut off any partial record at the end, then carry on appending after the complete ones
+    m_fd = ::open(m_path.c_str(), O_WRONLY | O_APPEND);
+    if (m_fd < 0 || ::ftruncate(m_fd, complete) != 0) {
+        QI::Fail("Could not re-open checkpoint file {}", m_path);
+    }
+    Sync();
+    return done;
+}
+
+void SliceCheckpoint::Write(char const *data, size_t const bytes) {
+    size_t written = 0;
+    while (written < bytes) {
+        ssize_t const n = ::write(m_fd, data + written, bytes - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            QI::Fail("Failed to write to checkpoint file {}: {}", m_path, std::strerror(errno));
+        }
+        written += n;
+    }
+}
+
+void SliceCheckpoint::Sync() {
+    if (::fsync(m_fd) != 0) {
+        QI::Fail("Failed to sync checkpoint file {}: {}", m_path, std::strerror(errno));
+    }
+}
+
+void SliceCheckpoint::Save(int const slice) {
+    int32_t const s = slice;
+    Write(reinterpret_cast<char const *>(&s), sizeof(s));
+    for (auto const &b : m_buffers(slice)) {
+        Write(b.first, b.second);
+    }
+    Sync();
+}
+
+} // End namespace QI
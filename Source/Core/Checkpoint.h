@@ -0,0 +1,62 @@
+/*
+ *  Checkpoint.h
+ *
+ *  Copyright (c) 2019 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_CHECKPOINT_H
+#define QI_CHECKPOINT_H
+
+#include <array>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace QI {
+
+/*
+ *  Saves completed slices of a long-running fit to a sidecar file, so that an interrupted run can
+ *  be resumed. The file is a small header followed by one record per slice, each containing the
+ *  slice number and the raw output buffers for that slice. Each record is synced to disk before
+ *  Save() returns. On resume the file is only ever appended to, after cutting off a record that
+ *  was only partly written when the process died, so a second interruption cannot lose slices
+ *  that were already saved.
+ *
+ *  The buffers for a slice are supplied by a callback, as a list of (pointer, bytes) pairs in a
+ *  fixed order. Only the sizes are checked on resume, so the inputs, mask and options must be the
+ *  same as for the original run.
+ */
+class SliceCheckpoint {
+  public:
+    using Buffers    = std::vector<std::pair<char *, size_t>>;
+    using BufferFunc = std::function<Buffers(int const slice)>;
+
+    SliceCheckpoint(std::string const &path, std::array<size_t, 3> const &size, BufferFunc f);
+    ~SliceCheckpoint();
+    SliceCheckpoint(SliceCheckpoint const &) = delete;
+    void operator=(SliceCheckpoint const &) = delete;
+
+    std::vector<bool> Start();  // Create a new, empty checkpoint file
+    std::vector<bool> Resume(); // Read back completed slices, or Start() if there is no file
+    void              Save(int const slice);
+
+  private:
+    std::string           m_path;
+    std::array<size_t, 3> m_size;
+    BufferFunc            m_buffers;
+    size_t                m_sliceBytes = 0;
+    int                   m_fd         = -1;
+
+    void Write(char const *data, size_t const bytes);
+    void Sync();
+};
+
+} // End namespace QI
+
+#endif // QI_CHECKPOINT_H
@@ -0,0 +1,161 @@
+/*
+ *  FitContext.h
+ *
+ *  Copyright (c) 2019 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include "Macro.h"
+#include "ceres/ceres.h"
+
+namespace QI {
+
+/*
+ *  Building a Ceres problem (cost functors, auto-diff wrappers, parameter blocks and bounds) is
+ *  a noticeable fraction of the time taken to fit a cheap model. A FitContext keeps one problem
+ *  alive between voxels. The data, fixed and varying parameters live inside the context and the
+ *  cost functions refer to them, so each voxel only has to copy in new values and call Solve.
+ *
+ *  Contexts are per-thread, see ThreadFitContext() below. A context is rebuilt whenever it is
+ *  used by a different fit function object, or after InvalidateFitContexts().
+ */
+inline std::atomic<long> &FitContextGeneration() {
+    static std::atomic<long> generation{0};
+    return generation;
+}
+
+/*
+ *  Fit function objects are often temporaries, so a later fit can be created at the same address
+ *  with a different sequence. This makes every thread rebuild its contexts. ModelFitFilter calls
+ *  it at the start of every run, anything else that calls fit() directly more than once with
+ *  different fit objects (e.g. the Python module) must call it first.
+ */
+inline void InvalidateFitContexts() { FitContextGeneration()++; }
+
+template <typename ModelType, int NInputs = 1> struct FitContext {
+    using DataArray    = QI_ARRAY(typename ModelType::DataType);
+    using FixedArray   = typename ModelType::FixedArray;
+    using VaryingArray = typename ModelType::VaryingArray;
+
+    std::array<DataArray, NInputs>  data;
+    FixedArray                      fixed;
+    VaryingArray                    varying;
+    std::unique_ptr<ceres::Problem> problem;
+    void const *                    owner      = nullptr;
+    long                            generation = -1;
+
+    FitContext()                   = default;
+    FitContext(FitContext const &) = delete; // The problem holds pointers into this object
+    void operator=(FitContext const &) = delete;
+
+    /*
+     *  Returns the problem for this owner. The build function is only called if the context was
+     *  last used by a different owner, and should size the data arrays and add the residual
+     *  blocks.
+     */
+    template <typename BuildFunc>
+    ceres::Problem &Prepare(void const *const new_owner, BuildFunc &&build) {
+        long const current = FitContextGeneration();
+        if (!problem || owner != new_owner || generation != current) {
+            problem    = std::make_unique<ceres::Problem>();
+            owner      = new_owner;
+            generation = current;
+            build(*this);
+        }
+        return *problem;
+    }
+
+    /*
+     *  Bounds are cheap to update, and are re-applied for every voxel in case they depend on the
+     *  fixed parameters.
+     */
+    template <typename Lo, typename Hi> void SetBounds(Lo const &lo, Hi const &hi) {
+        for (int i = 0; i < ModelType::NV; i++) {
+            problem->SetParameterLowerBound(varying.data(), i, lo[i]);
+            problem->SetParameterUpperBound(varying.data(), i, hi[i]);
+        }
+    }
+};
+
+/*
+ *  One context per thread for each fit type. The Tag is normally the fit function type, so that
+ *  fits sharing a model do not keep rebuilding each other's problems.
+ */
+template <typename Tag, typename ModelType, int NInputs = 1>
+FitContext<ModelType, NInputs> &ThreadFitContext() {
+    static thread_local FitContext<ModelType, NInputs> context;
+    return context;
+}
+
+/*
+ *  Lets a fit start from the solution of a neighbouring voxel instead of the default start. The
+ *  values are in whatever units the fit function uses internally, e.g. with PD scaled by the
+ *  data, so the caller treats them as opaque. Fit functions that support this call Apply() on
+ *  their start point and Save() on their solution. ModelFitFilter decides when to use them.
+ */
+template <typename ModelType> struct WarmStart {
+    using VaryingArray = typename ModelType::VaryingArray;
+
+    VaryingArray start;    // Set by the caller
+    VaryingArray solution; // Set by the fit function
+    bool         use   = false;
+    bool         saved = false;
+
+    void Apply(VaryingArray &v) const {
+        if (use) {
+            v = start;
+        }
+    }
+
+    /*
+     *  For fits that search inside the bounds instead of from a start point, e.g. region
+     *  contraction. Narrows the bounds to the given fraction of their width around the start.
+     */
+    void Narrow(VaryingArray &lo, VaryingArray &hi, double const fraction) const {
+        if (use) {
+            VaryingArray const width = fraction * (hi - lo);
+            lo                       = lo.max(start - width);
+            hi                       = hi.min(start + width);
+        }
+    }
+
+    void Save(VaryingArray const &v) {
+        solution = v;
+        saved    = true;
+    }
+};
+
+template <typename ModelType> WarmStart<ModelType> &ThreadWarmStart() {
+    static thread_local WarmStart<ModelType> warm;
+    return warm;
+}
+
+/*
+ *  Equivalent to ModelCost, but refers to data and fixed parameters held in a FitContext
+ */
+template <typename Model> struct ContextCost {
+    using FixedArray = typename Model::FixedArray;
+    using DataArray  = QI_ARRAY(typename Model::DataType);
+    const Model &     model;
+    const FixedArray &fixed;
+    const DataArray & data;
+
+    template <typename T> bool operator()(const T *const vin, T *rin) const {
+        Eigen::Map<QI_ARRAYN(T, Model::NV) const> const v(vin);
+        Eigen::Map<QI_ARRAY(T)>                         residual(rin, data.rows());
+        residual = data - model.signal(v, fixed);
+        return true;
+    }
+};
+
+} // namespace QI
@@ -0,0 +1,397 @@
+/*
+ *  FitDictionary.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "itkMultiThreaderBase.h"
+
+#include "FitScaledNumeric.h"
+#include "JSON.h"
+#include "Log.h"
+#include "ReplacementFile.h"
+
+namespace QI {
+
+/*
+ *  Dictionaries are normally dropped along with their fit. Long-running processes (qi serve) set
+ *  this to keep them for later commands with the same model, sequence and grid.
+ */
+inline bool &KeepDictionaries() {
+    static bool keep = false;
+    return keep;
+}
+
+/*
+ *  Fits by matching each voxel against a precomputed dictionary of model signals, with an
+ *  optional non-linear polish starting from the best match.
+ *
+ *  The dictionary covers a regular grid of the varying parameters. The first NScale (0 or 1)
+ *  parameters must scale the signal linearly (e.g. M0), and are found by projecting the data
+ *  onto the matched entry instead of being part of the grid. A separate dictionary is built for
+ *  each combination of fixed parameter bins, and each voxel uses the nearest bin.
+ *
+ *  Entries are normalised and stored as floats, one per column, so matching is a single
+ *  matrix-vector product that Eigen vectorises. Building the dictionary can take a while, so it
+ *  can be cached in a file and re-used for any data acquired with the same sequence.
+ *
+ *  The polish uses ScaledNumericDiffFit, so the model needs lo, hi and start in the same units as
+ *  for that fit.
+ */
+template <typename ModelType, int NScale = 1>
+struct DictionaryFit : FitFunction<ModelType, int> {
+    static_assert(NScale == 0 || NScale == 1, "Dictionary matching can only find one scale");
+    static_assert(ModelType::NI == 1, "Dictionary matching only supports one input");
+
+    using Super = FitFunction<ModelType, int>;
+    using typename Super::RMSErrorType;
+    using InputType    = typename ModelType::DataType;
+    using OutputType   = typename ModelType::ParameterType;
+    using VaryingArray = typename ModelType::VaryingArray;
+    using FixedArray   = typename ModelType::FixedArray;
+    using Entries      = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic>;
+
+    std::vector<Eigen::ArrayXd> grid;       // Values of each varying parameter
+    std::vector<Eigen::ArrayXd> fixed_bins; // Bin centres of each fixed parameter
+    bool                        polish = false;
+
+    struct Tables {
+        std::vector<Entries>        entries; // Normalised signals for each fixed bin
+        std::vector<Eigen::ArrayXf> norms;
+    };
+
+    Eigen::ArrayXXd               params; // Varying parameters of each entry, one per row
+    std::shared_ptr<Tables const> tables;
+    ScaledNumericDiffFit<ModelType, NScale> polisher;
+
+    /*
+     *  The grid is read from JSON, with each parameter given as [low, high, steps], e.g.
+     *  {"T1": [0.5, 5.0, 46], "B1": [0.7, 1.3, 7]}. Varying parameters that are not listed are
+     *  held at their start value, and fixed parameters at their default.
+     */
+    DictionaryFit(ModelType &        m,
+                  json const &       spec,
+                  bool const         polish_,
+                  std::string const &cache,
+                  bool const         verbose) :
+        Super{m},
+        polish{polish_}, polisher{m} {
+        auto const steps = [&](std::string const &name, double const def) -> Eigen::ArrayXd {
+            if (spec.find(name) != spec.end()) {
+                auto const s = ArrayFromJSON<double>(spec, name, 1.0, 3);
+                return Eigen::ArrayXd::LinSpaced(static_cast<Eigen::Index>(s[2]), s[0], s[1]);
+            }
+            return Eigen::ArrayXd::Constant(1, def);
+        };
+        for (int i = 0; i < ModelType::NV; i++) {
+            grid.push_back(i < NScale ? Eigen::ArrayXd::Ones(1) :
+                                        steps(m.varying_names[i], m.start[i]));
+        }
+        if constexpr (ModelType::NF > 0) {
+            for (int f = 0; f < ModelType::NF; f++) {
+                fixed_bins.push_back(steps(m.fixed_names[f], m.fixed_defaults[f]));
+            }
+        }
+        BuildParams();
+        std::string const key  = KeepDictionaries() ? Key() : "";
+        auto &            kept = Kept();
+        if (!key.empty() && kept.find(key) != kept.end()) {
+            QI::Log(verbose, "Using dictionary kept in memory");
+            tables = kept[key];
+            return;
+        }
+        auto built = std::make_shared<Tables>();
+        if (cache.empty() || !Load(cache, *built, verbose)) {
+            BuildEntries(*built, verbose);
+            if (!cache.empty()) {
+                Save(cache, *built, verbose);
+            }
+        }
+        tables = built;
+        if (!key.empty()) {
+            kept[key] = tables;
+        }
+    }
+
+    Eigen::Index n_entries() const { return params.rows(); }
+
+    FitReturnType fit(std::vector<Eigen::ArrayXd> const &inputs,
+                      FixedArray const &                 fixed,
+                      VaryingArray &                     varying,
+                      typename ModelType::CovarArray *   cov,
+                      RMSErrorType &                     rmse,
+                      std::vector<Eigen::ArrayXd> &      residuals,
+                      int &                              iterations) const override {
+        auto const &          entries = tables->entries;
+        auto const &          norms   = tables->norms;
+        auto const &          data    = inputs[0];
+        Eigen::VectorXf const d       = data.matrix().template cast<float>();
+        auto const            bin     = Bin(fixed);
+        Eigen::VectorXf const score   = entries[bin].transpose() * d;
+        Eigen::Index          best;
+        score.maxCoeff(&best);
+        varying = params.row(best).transpose();
+        if constexpr (NScale > 0) {
+            if (norms[bin][best] <= 0) {
+                return {false, "No valid dictionary entry matched"};
+            }
+            varying[0] = score[best] / norms[bin][best];
+        }
+        iterations = 0;
+
+        if (polish) {
+            // Start the polish from the match, in the polisher's scaled units
+            double const scale = data.maxCoeff();
+            if (scale < std::numeric_limits<double>::epsilon()) {
+                return {false, "Maximum data value was zero or less"};
+            }
+            auto &             warm        = ThreadWarmStart<ModelType>();
+            bool const         outer_use   = warm.use;
+            VaryingArray const outer_start = warm.start;
+            warm.use                       = true;
+            warm.start                     = varying;
+            warm.start.template head<NScale>() /= scale;
+            warm.start = warm.start.max(this->model.lo).min(this->model.hi);
+            auto const status =
+                polisher.fit(inputs, fixed, varying, cov, rmse, residuals, iterations);
+            warm.use   = outer_use;
+            warm.start = outer_start;
+            return status;
+        }
+
+        Eigen::ArrayXd const rs = data - this->model.signal(varying, fixed);
+        rmse                    = sqrt(rs.square().mean());
+        if (residuals.size() > 0) {
+            residuals[0] = rs;
+        }
+        return {true, ""};
+    }
+
+  private:
+    /*
+     *  Index of the nearest fixed parameter bin. Bins are numbered with the first fixed
+     *  parameter varying fastest.
+     */
+    size_t Bin(FixedArray const &fixed) const {
+        size_t bin = 0, stride = 1;
+        for (size_t f = 0; f < fixed_bins.size(); f++) {
+            Eigen::Index nearest;
+            (fixed_bins[f] - fixed[f]).abs().minCoeff(&nearest);
+            bin += nearest * stride;
+            stride *= fixed_bins[f].size();
+        }
+        return bin;
+    }
+
+    FixedArray BinValues(size_t bin) const {
+        FixedArray fixed;
+        for (size_t f = 0; f < fixed_bins.size(); f++) {
+            fixed[f] = fixed_bins[f][bin % fixed_bins[f].size()];
+            bin /= fixed_bins[f].size();
+        }
+        return fixed;
+    }
+
+    size_t n_bins() const {
+        size_t n = 1;
+        for (auto const &b : fixed_bins) {
+            n *= b.size();
+        }
+        return n;
+    }
+
+    void BuildParams() {
+        Eigen::Index n = 1;
+        for (auto const &g : grid) {
+            n *= g.size();
+        }
+        params.resize(n, ModelType::NV);
+        for (Eigen::Index e = 0; e < n; e++) {
+            Eigen::Index index = e;
+            for (int i = 0; i < ModelType::NV; i++) {
+                params(e, i) = grid[i][index % grid[i].size()];
+                index /= grid[i].size();
+            }
+        }
+    }
+
+    void BuildEntries(Tables &t, bool const verbose) {
+        auto const n      = n_entries();
+        auto const n_data = this->model.input_size(0);
+        QI::Log(verbose,
+                "Building dictionary with {} entries of {} points for {} fixed bins",
+                n,
+                n_data,
+                n_bins());
+        auto &entries = t.entries;
+        auto &norms   = t.norms;
+        entries.assign(n_bins(), Entries(n_data, n));
+        norms.assign(n_bins(), Eigen::ArrayXf(n));
+        auto threader = itk::MultiThreaderBase::New();
+        for (size_t bin = 0; bin < n_bins(); bin++) {
+            FixedArray const fixed = BinValues(bin);
+            threader->ParallelizeArray(
+                0,
+                n,
+                [&](itk::SizeValueType const e) {
+                    VaryingArray const   v      = params.row(e).transpose();
+                    Eigen::ArrayXd const signal = this->model.signal(v, fixed);
+                    double const         norm   = signal.matrix().norm();
+                    if (signal.allFinite() && norm > 0) {
+                        entries[bin].col(e) = (signal / norm).matrix().template cast<float>();
+                        norms[bin][e]       = norm;
+                    } else {
+                        entries[bin].col(e).setZero(); // Will never be the best match
+                        norms[bin][e] = 0;
+                    }
+                },
+                nullptr);
+        }
+    }
+
+    /*
+     *  The cache starts with a header and the signal for the start point and default fixed
+     *  parameters. If these or the grid do not match then the dictionary is re-built.
+     */
+    struct CacheHeader {
+        char     magic[4] = {'Q', 'I', 'D', 'C'};
+        uint32_t version  = 1;
+        uint32_t nv       = ModelType::NV;
+        uint32_t nf       = ModelType::NF;
+        uint32_t nscale   = NScale;
+        uint32_t n_data   = 0;
+    };
+
+    Eigen::ArrayXd Fingerprint() const {
+        FixedArray fixed;
+        if constexpr (ModelType::NF > 0) {
+            fixed = this->model.fixed_defaults;
+        }
+        return this->model.signal(this->model.start, fixed);
+    }
+
+    /*
+     *  Everything that the cache file is checked against, so dictionaries kept in memory are only
+     *  re-used for exactly the same model, sequence and grid
+     */
+    std::string Key() const {
+        CacheHeader header;
+        header.n_data = this->model.input_size(0);
+        std::string key(reinterpret_cast<char const *>(&header), sizeof(header));
+        auto const  append = [&](Eigen::ArrayXd const &a) {
+            key.append(reinterpret_cast<char const *>(a.data()), a.size() * sizeof(double));
+            key.push_back('|');
+        };
+        append(Fingerprint());
+        for (auto const &g : grid) {
+            append(g);
+        }
+        for (auto const &b : fixed_bins) {
+            append(b);
+        }
+        return key;
+    }
+
+    static std::map<std::string, std::shared_ptr<Tables const>> &Kept() {
+        static std::map<std::string, std::shared_ptr<Tables const>> kept;
+        return kept;
+    }
+
+    template <typename Array> static void Write(std::ofstream &file, Array const &a) {
+        uint64_t const size = a.size();
+        file.write(reinterpret_cast<char const *>(&size), sizeof(size));
+        file.write(reinterpret_cast<char const *>(a.data()), size * sizeof(*a.data()));
+    }
+
+    template <typename Array> static bool Read(std::ifstream &file, Array &a) {
+        uint64_t size = 0;
+        file.read(reinterpret_cast<char *>(&size), sizeof(size));
+        if (!file || size != static_cast<uint64_t>(a.size())) {
+            return false;
+        }
+        file.read(reinterpret_cast<char *>(a.data()), size * sizeof(*a.data()));
+        return static_cast<bool>(file);
+    }
+
+    /*
+     *  Written to a temporary file and renamed into place, so a run that is interrupted, or
+     *  another run reading the cache at the same time, never sees a partial dictionary
+     */
+    void Save(std::string const &path, Tables const &t, bool const verbose) const {
+        QI::Log(verbose, "Saving dictionary to {}", path);
+        ReplacementFile replacement(path);
+        std::ofstream & file = replacement.stream();
+        CacheHeader     header;
+        header.n_data = this->model.input_size(0);
+        file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        Write(file, Fingerprint());
+        for (auto const &g : grid) {
+            Write(file, g);
+        }
+        for (auto const &b : fixed_bins) {
+            Write(file, b);
+        }
+        for (size_t bin = 0; bin < n_bins(); bin++) {
+            Write(file, t.norms[bin]);
+            Write(file, t.entries[bin]);
+        }
+        if (!file) {
+            QI::Fail("Failed to write dictionary to {}", path);
+        }
+        replacement.Commit();
+    }
+
+    bool Load(std::string const &path, Tables &t, bool const verbose) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        CacheHeader header, expected;
+        expected.n_data = this->model.input_size(0);
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        Eigen::ArrayXd fingerprint = Fingerprint();
+        Eigen::ArrayXd const expected_fingerprint = fingerprint;
+        bool ok = file && std::memcmp(&header, &expected, sizeof(header)) == 0 &&
+                  Read(file, fingerprint) && fingerprint.isApprox(expected_fingerprint);
+        for (size_t i = 0; ok && i < grid.size(); i++) {
+            Eigen::ArrayXd g(grid[i].size());
+            ok = Read(file, g) && g.isApprox(grid[i]);
+        }
+        for (size_t f = 0; ok && f < fixed_bins.size(); f++) {
+            Eigen::ArrayXd b(fixed_bins[f].size());
+            ok = Read(file, b) && b.isApprox(fixed_bins[f]);
+        }
+        if (!ok) {
+            QI::Warn("Dictionary cache {} does not match the model or grid, re-building", path);
+            return false;
+        }
+        t.entries.assign(n_bins(), Entries(expected.n_data, n_entries()));
+        t.norms.assign(n_bins(), Eigen::ArrayXf(n_entries()));
+        for (size_t bin = 0; ok && bin < n_bins(); bin++) {
+            ok = Read(file, t.norms[bin]) && Read(file, t.entries[bin]);
+        }
+        if (!ok) {
+            QI::Warn("Dictionary cache {} was truncated, re-building", path);
+            return false;
+        }
+        QI::Log(verbose, "Read dictionary from {}", path);
+        return true;
+    }
+};
+
+} // namespace QI
@@ -11,12 +11,15 @@
 
 #pragma once
 
+#include "FitContext.h"
 #include "Macro.h"
 #include "Model.h"
 #include <Eigen/Core>
 #include <itkIndex.h>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#include <vector>
 
 namespace QI {
 
@@ -29,6 +32,49 @@ struct FitReturnType {
     std::string message;
 };
 
+/*
+ *  A block of voxels for fit functions that can process several at once. Storage is
+ *  structure-of-arrays, i.e. each row is one voxel and each column is one volume or parameter,
+ *  so closed-form fits can be written as column-wise Eigen expressions over the whole block.
+ *  The block always has the full capacity, rows past count are padding and can be ignored.
+ */
+template <typename ModelType, typename FlagType = int> struct FitBatch {
+    using DataType      = typename ModelType::DataType;
+    using ParameterType = typename ModelType::ParameterType;
+    using DataBlock     = Eigen::Array<DataType, Eigen::Dynamic, Eigen::Dynamic>;
+    using FixedBlock    = Eigen::Array<ParameterType, Eigen::Dynamic, ModelType::NF>;
+    using VaryingBlock  = Eigen::Array<ParameterType, Eigen::Dynamic, ModelType::NV>;
+
+    std::vector<DataBlock>                    inputs;
+    FixedBlock                                fixed;
+    VaryingBlock                              varying;
+    Eigen::ArrayXd                            rmse;
+    std::vector<DataBlock>                    residuals; // Left empty if not requested
+    Eigen::Array<FlagType, Eigen::Dynamic, 1> flags;
+    Eigen::Index                              count = 0;
+
+    template <typename FitType>
+    FitBatch(FitType const &fit, Eigen::Index const capacity, bool const with_residuals) :
+        fixed(capacity, ModelType::NF), varying(capacity, ModelType::NV), rmse(capacity),
+        flags(capacity) {
+        for (int i = 0; i < ModelType::NI; i++) {
+            inputs.emplace_back(capacity, fit.input_size(i));
+            if (with_residuals) {
+                residuals.emplace_back(capacity, fit.input_size(i));
+            }
+        }
+    }
+
+    Eigen::Index capacity() const { return varying.rows(); }
+};
+
+/*
+ *  Detect at compile time whether a fit function provides fit_batch()
+ */
+template <typename FitType, typename = void> struct HasFitBatch : std::false_type {};
+template <typename FitType>
+struct HasFitBatch<FitType, std::void_t<decltype(&FitType::fit_batch)>> : std::true_type {};
+
 template <typename Model_, bool Blocked_ = false, bool Indexed_ = false> struct FitFunctionBase {
     using ModelType           = Model_;
     using RMSErrorType        = double;
@@ -79,17 +125,21 @@ struct NLLSFitFunction : FitFunction<ModelType> {
                       RMSErrorType &                          rmse,
                       std::vector<QI_ARRAY(InputType)> &      residuals,
                       FlagType &                              iterations) const {
-        auto const &   data = inputs[0];
-        ceres::Problem problem;
-        using Cost      = ModelCost<ModelType>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, ModelType::NV>;
-        auto *cost      = new Cost{this->model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, this->model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(p.data(), i, this->model.bounds_lo[i]);
-            problem.SetParameterUpperBound(p.data(), i, this->model.bounds_hi[i]);
-        }
+        auto &ctx     = ThreadFitContext<NLLSFitFunction, ModelType>();
+        auto &problem = ctx.Prepare(this, [&](auto &c) {
+            using Cost     = ContextCost<ModelType>;
+            using AutoCost = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, ModelType::NV>;
+            c.data[0].resize(this->model.sequence.size());
+            auto *cost = new Cost{this->model, c.fixed, c.data[0]};
+            c.problem->AddResidualBlock(
+                new AutoCost(cost, this->model.sequence.size()), NULL, c.varying.data());
+        });
+        ctx.data[0]      = inputs[0];
+        ctx.fixed        = fixed;
+        ctx.varying      = this->model.start;
+        auto const &data = ctx.data[0];
+        ctx.SetBounds(this->model.bounds_lo, this->model.bounds_hi);
+        ThreadWarmStart<ModelType>().Apply(ctx.varying);
         ceres::Solver::Options options;
         ceres::Solver::Summary summary;
         options.max_num_iterations  = 15;
@@ -97,12 +147,13 @@ struct NLLSFitFunction : FitFunction<ModelType> {
         options.gradient_tolerance  = 1e-7;
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
-        p << this->model.start;
         ceres::Solve(options, &problem, &summary);
+        p = ctx.varying;
         if (!summary.IsSolutionUsable()) {
             return {false, summary.FullReport()};
         }
         iterations = summary.iterations.size();
+        ThreadWarmStart<ModelType>().Save(ctx.varying);
 
         Eigen::ArrayXd const rs  = (data - this->model.signal(p, fixed));
         double const         var = rs.square().sum();
@@ -111,7 +162,8 @@ struct NLLSFitFunction : FitFunction<ModelType> {
             residuals[0] = rs;
         }
         if (cov) {
-            QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
+            QI::GetModelCovariance<ModelType>(
+                problem, ctx.varying, var / (data.rows() - ModelType::NV), cov);
         }
 
         return {true, ""};
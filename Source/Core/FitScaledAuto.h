@@ -28,17 +28,21 @@ struct ScaledAutoDiffFit : FitFunction<ModelType, FlagType_> {
             rmse = 0;
             return {false, "Maximum data value was not positive"};
         }
-        const Eigen::ArrayXd data = inputs[0] / scale;
-        ceres::Problem       problem;
-        using Cost      = ModelCost<ModelType>;
-        using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, ModelType::NV>;
-        auto *cost      = new Cost{this->model, fixed, data};
-        auto *auto_cost = new AutoCost(cost, this->model.sequence.size());
-        problem.AddResidualBlock(auto_cost, NULL, p.data());
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(p.data(), i, this->model.bounds_lo[i]);
-            problem.SetParameterUpperBound(p.data(), i, this->model.bounds_hi[i]);
-        }
+        auto &ctx     = ThreadFitContext<ScaledAutoDiffFit, ModelType>();
+        auto &problem = ctx.Prepare(this, [&](auto &c) {
+            using Cost     = ContextCost<ModelType>;
+            using AutoCost = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, ModelType::NV>;
+            c.data[0].resize(this->model.sequence.size());
+            auto *cost = new Cost{this->model, c.fixed, c.data[0]};
+            c.problem->AddResidualBlock(
+                new AutoCost(cost, this->model.sequence.size()), NULL, c.varying.data());
+        });
+        ctx.data[0]      = inputs[0] / scale;
+        ctx.fixed        = fixed;
+        ctx.varying      = this->model.start;
+        auto const &data = ctx.data[0];
+        ctx.SetBounds(this->model.bounds_lo, this->model.bounds_hi);
+        ThreadWarmStart<ModelType>().Apply(ctx.varying);
         ceres::Solver::Options options;
         ceres::Solver::Summary summary;
         options.max_num_iterations  = 30;
@@ -46,12 +50,13 @@ struct ScaledAutoDiffFit : FitFunction<ModelType, FlagType_> {
         options.gradient_tolerance  = 1e-7;
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
-        p << this->model.start;
         ceres::Solve(options, &problem, &summary);
+        p = ctx.varying;
         if (!summary.IsSolutionUsable()) {
             return {false, summary.FullReport()};
         }
-        iterations               = summary.iterations.size();
+        iterations = summary.iterations.size();
+        ThreadWarmStart<ModelType>().Save(ctx.varying);
         Eigen::ArrayXd const rs  = (data - this->model.signal(p, fixed));
         double const         var = rs.square().sum();
         rmse                     = sqrt(var / data.rows()) * scale;
@@ -59,7 +64,8 @@ struct ScaledAutoDiffFit : FitFunction<ModelType, FlagType_> {
             residuals[0] = rs * scale;
         }
         if (cov) {
-            QI::GetModelCovariance<ModelType>(problem, p, var / (data.rows() - ModelType::NV), cov);
+            QI::GetModelCovariance<ModelType>(
+                problem, ctx.varying, var / (data.rows() - ModelType::NV), cov);
         }
         p[0] = p[0] * scale;
         return {true, ""};
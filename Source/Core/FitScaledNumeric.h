@@ -33,27 +33,26 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
             rmse    = 0.0;
             return {false, "Maximum data value was zero or less"};
         }
-        Eigen::ArrayXd const data = inputs[0] / scale;
-
-        // Setup Ceres
-        ceres::Problem problem;
-        using Diff = ceres::NumericDiffCostFunction<QI::ModelCost<ModelType>,
-                                                    ceres::CENTRAL,
-                                                    ceres::DYNAMIC,
-                                                    ModelType::NV>;
-        auto *cost = new Diff(new QI::ModelCost<ModelType>{this->model, fixed, data},
-                              ceres::TAKE_OWNERSHIP,
-                              this->model.sequence.size());
-        auto *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
-
-        // This is where the parameters and cost functions actually get added to Ceres
-        problem.AddResidualBlock(cost, loss, varying.data());
-
-        // Set up parameter bounds
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(varying.data(), i, this->model.lo[i]);
-            problem.SetParameterUpperBound(varying.data(), i, this->model.hi[i]);
-        }
+        // Setup Ceres. The problem is kept between voxels, so only the values need updating
+        auto &ctx     = ThreadFitContext<ScaledNumericDiffFit, ModelType>();
+        auto &problem = ctx.Prepare(this, [&](auto &c) {
+            using Cost = ContextCost<ModelType>;
+            using Diff =
+                ceres::NumericDiffCostFunction<Cost, ceres::CENTRAL, ceres::DYNAMIC, ModelType::NV>;
+            c.data[0].resize(this->model.sequence.size());
+            auto *cost = new Diff(new Cost{this->model, c.fixed, c.data[0]},
+                                  ceres::TAKE_OWNERSHIP,
+                                  this->model.sequence.size());
+            auto *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
+            // This is where the parameters and cost functions actually get added to Ceres
+            c.problem->AddResidualBlock(cost, loss, c.varying.data());
+        });
+        ctx.data[0]      = inputs[0] / scale;
+        ctx.fixed        = fixed;
+        ctx.varying      = this->model.start;
+        auto const &data = ctx.data[0];
+        ctx.SetBounds(this->model.lo, this->model.hi);
+        ThreadWarmStart<ModelType>().Apply(ctx.varying);
 
         ceres::Solver::Options options;
         ceres::Solver::Summary summary;
@@ -63,12 +62,13 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
 
-        varying = this->model.start;
         ceres::Solve(options, &problem, &summary);
+        varying = ctx.varying;
         if (!summary.IsSolutionUsable()) {
             return {false, summary.FullReport()};
         }
         iterations = summary.iterations.size();
+        ThreadWarmStart<ModelType>().Save(ctx.varying);
         double              var;
         std::vector<double> rs(data.size());
         problem.Evaluate(ceres::Problem::EvaluateOptions(), &var, &rs, nullptr, nullptr);
@@ -80,7 +80,7 @@ struct ScaledNumericDiffFit : FitFunction<ModelType, int> {
         }
         if (cov) {
             QI::GetModelCovariance<ModelType>(
-                problem, varying, var / (data.rows() - ModelType::NV), cov);
+                problem, ctx.varying, var / (data.rows() - ModelType::NV), cov);
         }
         varying.template head<NScale>() *= scale; // Multiply signals/proton density back up
 
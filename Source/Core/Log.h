@@ -47,12 +47,32 @@ template <typename S, typename... Args> inline void Warn(const S &fmt_str, const
     fmt::print(stderr, "\n");
 }
 
+/*
+ * Commands normally end the process when they fail. qi serve runs many commands in one process,
+ * so there they throw this instead, and the server reports the status to the client.
+ */
+struct CommandExit {
+    int status;
+};
+
+inline bool &ThrowOnExit() {
+    static bool throw_on_exit = false;
+    return throw_on_exit;
+}
+
+[[noreturn]] inline void Exit(const int status) {
+    if (ThrowOnExit()) {
+        throw CommandExit{status};
+    }
+    exit(status);
+}
+
 template <typename S, typename... Args>
 [[noreturn]] inline void Fail(const S &fmt_str, const Args &... args) {
     fmt::print(stderr, fmt::fg(fmt::terminal_color::bright_red), "Error ");
     fmt::print(stderr, fmt_str, args...);
     fmt::print(stderr, "\n");
-    exit(EXIT_FAILURE);
+    QI::Exit(EXIT_FAILURE);
 }
 
 } // End namespace QI
@@ -13,29 +13,51 @@
 #define QI_MODELFITFILTER_H
 
 #include <Eigen/Core>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
 #include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
+#include "itkBinShrinkImageFilter.h"
 #include "itkCommand.h"
 #include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageScanlineConstIterator.h"
 #include "itkImageToImageFilter.h"
 #include "itkTimeProbe.h"
 #include "itkTotalProgressReporter.h"
 #include "itkVariableLengthVector.h"
 #include "itkVectorImage.h"
 
+#include "AllocationCounter.h"
+#include "Checkpoint.h"
 #include "FitFunction.h"
+#include "JSON.h"
 #include "Log.h"
 #include "Model.h"
 #include "Monitor.h"
+#include "ParallelIO.h"
 #include "Util.h"
 
 namespace QI {
 
+template <typename T> struct IsComplex : std::false_type {};
+template <typename T> struct IsComplex<std::complex<T>> : std::true_type {};
+
 template <typename FitType>
 class ModelFitFilter
     : public itk::ImageToImageFilter<
@@ -73,6 +95,9 @@ class ModelFitFilter
     using TFlagImage     = typename BlockTypes<Blocked, ImageDim, typename FitType::FlagType>::Type;
     using TRMSErrorImage = typename BlockTypes<Blocked, ImageDim, RMSErrorPixelType>::Type;
     using TResidualsImage = TInputImage;
+    using TFitTimeImage   = itk::Image<float, ImageDim>;
+    using TSeedImage      = itk::VectorImage<double, ImageDim>;
+    using TSingleImage    = itk::VectorImage<float, ImageDim>;
 
     using TRegion = typename TInputImage::RegionType;
     using TIndex  = typename TRegion::IndexType;
@@ -83,6 +108,10 @@ class ModelFitFilter
 
     static constexpr bool Indexed    = FitType::Indexed;
     static constexpr bool HasDerived = ModelType::ND > 0;
+    static constexpr bool Batched    = HasFitBatch<FitType>::value;
+    static_assert(!(Batched && Indexed), "Batched fit functions cannot also be indexed");
+
+    using BatchType = FitBatch<ModelType, typename FitType::FlagType>;
 
     QI_ForwardNewMacro(Self);
     itkTypeMacro(ModelFitFilter,
@@ -98,7 +127,8 @@ class ModelFitFilter
     static constexpr int RMSErrorOffset  = FlagOffset + 1;
     static constexpr int CovarOffset     = RMSErrorOffset + 1;
     static constexpr int ResidualsOffset = CovarOffset + ModelType::NCov;
-    static constexpr int TotalOutputs    = ResidualsOffset + ModelType::NI;
+    static constexpr int FitTimeOffset   = ResidualsOffset + ModelType::NI;
+    static constexpr int TotalOutputs    = FitTimeOffset + 1;
 
     ModelFitFilter(FitType const *    f,
                    const bool         verbose,
@@ -176,6 +206,53 @@ class ModelFitFilter
     void SetOutputAllResiduals(const bool r) { m_allResiduals = r; }
     void SetOutputCovar(const bool covar) { m_covar = covar; }
 
+    /*
+     * Write out the wall time taken to fit each voxel, in microseconds, and print a summary of
+     * the distribution and the slowest voxels once fitting is finished
+     */
+    void SetOutputFitTime(const bool t) { m_fitTime = t; }
+
+    /*
+     * Write all the outputs as volumes of one image, "outputs", instead of one file each. A JSON
+     * index ("outputs.json") gives the first volume and number of volumes of each output.
+     */
+    void SetSingleOutput(const bool s) { m_single = s; }
+
+    /*
+     * Start each fit from the solution at the previous voxel, which is always an immediate
+     * neighbour, if that fit succeeded and its RMSE was not much worse than average. Otherwise
+     * the default start is used, and a warm-started fit is repeated from the default start if it
+     * fails or its own RMSE is much worse than average. Only fit functions that use WarmStart
+     * (see FitContext.h) are affected.
+     */
+    void SetWarmStart(const bool w) {
+        if constexpr (Batched) {
+            if (w) {
+                QI::Warn("Warm starts have no effect on batched fits");
+            }
+        }
+        m_warmStart = w;
+    }
+
+    /*
+     * Fit a copy of the inputs downsampled by this factor first. The coarse solutions are then
+     * used as the starting points for the full resolution fits, in the same way as the warm
+     * starts above. Zero or one (the default) turns this off.
+     */
+    void SetCoarseFactor(const int factor) {
+        if constexpr (Blocked) {
+            if (factor > 1) {
+                QI::Fail("Multi-resolution fitting is not supported for blocked fits");
+            }
+        }
+        if constexpr (Batched) {
+            if (factor > 1) {
+                QI::Warn("Multi-resolution fitting has no effect on batched fits");
+            }
+        }
+        m_coarse = factor;
+    }
+
     void SetSubregion(const TRegion &sr) {
         m_subregion    = sr;
         m_hasSubregion = true;
@@ -189,6 +266,31 @@ class ModelFitFilter
         }
     }
 
+    /*
+     * Fit the voxels inside the mask in chunks of this size, handed out dynamically to the
+     * threads. Zero (the default) splits the image region between the threads instead.
+     */
+    void SetChunkSize(const size_t cs) { m_chunkSize = cs; }
+
+    /*
+     * Save each slice to a sidecar file as soon as it has been fitted. If resume is set, slices
+     * already in the file are read back and skipped. The file is removed by WriteOutputs().
+     */
+    void SetCheckpoint(std::string const &path, const bool resume) {
+        if (resume && path.empty()) {
+            QI::Fail("Cannot resume without a checkpoint file");
+        }
+        m_checkpointPath = path;
+        m_resume         = resume;
+    }
+
+    /*
+     * Stream the images through the filter in slabs of this many slices, instead of reading them
+     * into memory whole. The inputs must be set with ReadInputs(), and the fitting then happens
+     * inside WriteOutputs(). Zero (the default) turns streaming off.
+     */
+    void SetSlabSize(const int slab) { m_slab = slab; }
+
     TOutputImage *GetOutput(const int i) {
         if (i < ModelType::NV) {
             return dynamic_cast<TOutputImage *>(this->itk::ProcessObject::GetOutput(i));
@@ -209,6 +311,10 @@ class ModelFitFilter
             this->itk::ProcessObject::GetOutput(ResidualsOffset + i));
     }
 
+    TFitTimeImage *GetFitTimeOutput() {
+        return dynamic_cast<TFitTimeImage *>(this->itk::ProcessObject::GetOutput(FitTimeOffset));
+    }
+
     TOutputImage *GetCovarOutput(const int i) {
         if (i < ModelType::NCov) {
             return dynamic_cast<TOutputImage *>(
@@ -252,54 +358,84 @@ class ModelFitFilter
             QI::Fail("Number of input file paths did not match number of inputs for model");
         }
 
+        if (m_slab > 0) {
+            if (!m_checkpointPath.empty()) {
+                QI::Fail("Checkpoints cannot be used when streaming");
+            }
+            if (m_coarse > 1) {
+                QI::Fail("Multi-resolution fitting cannot be used when streaming");
+            }
+            // ITK would read the whole of any other file for every slab
+            auto const check_stream = [](std::string const &path) {
+                if (path != "" && !QI::CanStreamRead(path)) {
+                    QI::Fail("Streaming requires inputs that can be read in parts, e.g. .nii or "
+                             ".mhd, not compressed files. Cannot stream: {}",
+                             path);
+                }
+            };
+            for (auto const &path : inputs) {
+                check_stream(path);
+            }
+            for (auto const &path : fixed) {
+                check_stream(path);
+            }
+            check_stream(mask);
+            // Read only the headers for now, the data is read one slab at a time later
+            for (int i = 0; i < ModelType::NI; i++) {
+                m_inputPaths[i] = inputs[i];
+                SetInput(i, QI::ReadImageInformation<TInputImage>(inputs[i], m_verbose));
+            }
+            for (int f = 0; f < ModelType::NF; f++) {
+                m_fixedPaths[f] = fixed[f];
+            }
+            m_maskPath = mask;
+            return;
+        }
+
+        InputImages images;
+        QI::IOTasks io;
         for (int i = 0; i < ModelType::NI; i++) {
-            SetInput(i, QI::ReadImage<TInputImage>(inputs[i], m_verbose));
+            io.Add([&, i] { images.inputs[i] = ReadInput<TInputImage>(inputs[i]); });
         }
         for (int f = 0; f < ModelType::NF; f++) {
             if (fixed[f] != "")
-                SetFixed(f, QI::ReadImage<TFixedImage>(fixed[f], m_verbose));
+                io.Add([&, f] { images.fixed[f] = ReadInput<TFixedImage>(fixed[f]); });
         }
         if (mask != "")
-            SetMask(QI::ReadImage<TMaskImage>(mask, m_verbose));
+            io.Add([&] { images.mask = ReadInput<TMaskImage>(mask); });
+        io.Run();
+        SetInputImages(images);
     }
 
     void WriteOutputs(std::string const &prefix) {
-        for (int i = 0; i < ModelType::NV; i++) {
-            QI::WriteImage(
-                GetOutput(i), prefix + m_fit->model.varying_names.at(i) + QI::OutExt(), m_verbose);
+        if (m_slab > 0) {
+            StreamOutputs(prefix);
+            return;
         }
-        if constexpr (ModelType::ND > 0) {
-            for (int i = 0; i < ModelType::ND; i++) {
-                QI::WriteImage(GetDerivedOutput(i),
-                               prefix + m_fit->model.derived_names.at(i) + QI::OutExt(),
-                               m_verbose);
+        if (m_single) {
+            WriteSingleIndex(prefix);
+            // One int16 scaling would have to cover the range of every output, so those with a
+            // small range would lose nearly all their precision
+            auto const precision = QI::OutPrecision();
+            if (precision == QI::Precision::Int16) {
+                QI::Warn("Int16 precision cannot be used for a single output, writing half");
+                QI::SetOutPrecision(QI::Precision::Half);
             }
+            QI::WriteImage(
+                SingleOutput().GetPointer(), prefix + "outputs" + QI::OutExt(), m_verbose);
+            QI::SetOutPrecision(precision);
+        } else {
+            QI::IOTasks io;
+            ForEachOutput([&](auto *image, std::string const &name, int) {
+                io.Add([this, copy = Detached(image), path = prefix + name + QI::OutExt()] {
+                    QI::WriteImage(copy.GetPointer(), path, m_verbose);
+                });
+            });
+            io.Run();
         }
-        QI::WriteImage(GetRMSErrorOutput(), prefix + "rmse" + QI::OutExt(), m_verbose);
-        QI::WriteImage(GetFlagOutput(), prefix + "iterations" + QI::OutExt(), m_verbose);
-        if (m_covar) {
-            for (int ii = 0; ii < ModelType::NV; ii++) {
-                auto const &name = m_fit->model.varying_names.at(ii);
-                QI::WriteImage(
-                    GetCovarOutput(ii), prefix + "CoV_" + name + QI::OutExt(), m_verbose);
-            }
-            int index = ModelType::NV;
-            for (int ii = 0; ii < ModelType::NV; ii++) {
-                auto const &name1 = m_fit->model.varying_names.at(ii);
-                for (int jj = ii + 1; jj < ModelType::NV; jj++) {
-                    auto const &name2 = m_fit->model.varying_names.at(jj);
-                    QI::WriteImage(GetCovarOutput(index++),
-                                   prefix + "Corr_" + name1 + "_" + name2 + QI::OutExt(),
-                                   m_verbose);
-                }
-            }
-        }
-        if (m_allResiduals) {
-            for (int i = 0; i < ModelType::NI; i++) {
-                QI::WriteImage(GetResidualsOutput(i),
-                               prefix + "residuals_" + std::to_string(i) + QI::OutExt(),
-                               m_verbose);
-            }
+        if (!m_checkpointPath.empty()) {
+            Log(m_verbose, "Removing checkpoint file {}", m_checkpointPath);
+            std::remove(m_checkpointPath.c_str());
         }
     }
 
@@ -308,6 +444,14 @@ class ModelFitFilter
     void operator=(const Self &); // purposely not implemented
 
   protected:
+    /*
+     * With a subregion only that part of the file is read, and the outputs will cover just it
+     */
+    template <typename TImage> typename TImage::Pointer ReadInput(std::string const &path) const {
+        return m_hasSubregion ? QI::ReadImageSubregion<TImage>(path, m_subregion, m_verbose) :
+                                QI::ReadImage<TImage>(path, m_verbose);
+    }
+
     itk::DataObject::Pointer
     MakeOutput(itk::ProcessObject::DataObjectPointerArraySizeType idx) override {
         using itype = itk::ProcessObject::DataObjectPointerArraySizeType; // Stop unsigned long
@@ -324,6 +468,8 @@ class ModelFitFilter
             return TOutputImage::New().GetPointer();
         } else if (idx < static_cast<itype>(ResidualsOffset + ModelType::NI)) {
             return TResidualsImage::New().GetPointer();
+        } else if (idx == static_cast<itype>(FitTimeOffset)) {
+            return TFitTimeImage::New().GetPointer();
         } else {
             QI::Fail("Attempted to create output {} but {} has {}",
                      idx,
@@ -336,7 +482,166 @@ class ModelFitFilter
     const bool     m_verbose, m_allResiduals, m_covar;
     bool           m_hasSubregion = false;
     TRegion        m_subregion;
-    int            m_blocks = 1;
+    int            m_blocks    = 1;
+    size_t         m_chunkSize = 0;
+    size_t         m_regionVoxels = 0;
+    std::string    m_checkpointPath;
+    bool           m_resume    = false;
+    int            m_slab      = 0;
+    bool           m_fitTime   = false;
+    bool           m_warmStart = false;
+    int            m_coarse    = 0;
+    bool           m_single    = false;
+
+    // Starting points for each voxel, and where to record the solutions for a finer fit. These
+    // are in the fit function's internal units, with NaN for no solution.
+    typename TSeedImage::Pointer m_seeds, m_seedOutput;
+    bool                         m_recordSeeds = false;
+
+    // A neighbour's solution is only used if its RMSE was within this factor of the mean so far
+    static constexpr double WarmTolerance = 2.0;
+
+    // Number of fits and total iterations (flag values) for default and warm starts
+    std::array<size_t, 2> m_startFits{};
+    std::array<double, 2> m_startIterations{};
+
+    // Fit times of all voxels fitted so far, and the slowest few, for the fit time summary
+    static constexpr size_t               NSlowest = 10;
+    std::vector<float>                    m_fitTimes;
+    std::vector<std::pair<float, TIndex>> m_slowest;
+
+    // File paths to read slabs from when streaming
+    std::array<std::string, ModelType::NI> m_inputPaths;
+    std::array<std::string, ModelType::NF> m_fixedPaths;
+    std::string                            m_maskPath;
+
+    // Heap allocations made in the voxel loops, and the number of voxels fitted, for verbose
+    // output. Allocations are only counted if AllocationCounter is available.
+    std::atomic<size_t> m_allocations{0};
+    std::atomic<size_t> m_voxels{0};
+
+    // Busy time (seconds) and number of voxels fitted by each thread, for verbose output
+    std::mutex                                           m_busyMutex;
+    std::map<std::thread::id, std::pair<double, size_t>> m_busy;
+
+    /*
+     * Per work-unit state for the voxel loop. The image pointers are looked up once, and the
+     * buffers are sized once from input_size() and then re-used for every voxel and block, so the
+     * loop itself does not touch the heap. If a fit function resizes the residual buffers, the
+     * pointers are refreshed.
+     */
+    struct Scratch {
+        TMaskImage const *                             mask;
+        std::array<TInputImage const *, ModelType::NI> input_images;
+        std::array<TFixedImage const *, ModelType::NF> fixed_images;
+        std::array<TOutputImage *, ModelType::NV>      output_images;
+        std::array<TOutputImage *, ModelType::ND>      derived_images;
+        std::array<TOutputImage *, ModelType::NCov>    covar_images;
+        std::array<TResidualsImage *, ModelType::NI>   residual_images;
+        TFlagImage *                                   flag_image;
+        TRMSErrorImage *                               rmse_image;
+        TFitTimeImage *                                time_image;
+        TSeedImage const *                             seed_image;
+        TSeedImage *                                   seed_output;
+
+        std::vector<DataArray>     inputs;
+        std::vector<ResidualArray> residuals; // Left empty if the user doesn't want them
+        CovarArray                 covar;
+
+        size_t                                      allocations = 0;
+        size_t                                      voxels      = 0;
+        std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+
+        // Warm-start state, the solution for each block at the previous voxel and whether it
+        // can be used
+        std::vector<VaryingArray> warm;
+        std::vector<char>         warm_good;
+        TIndex                    warm_index;
+        double                    rmse_sum   = 0;
+        size_t                    rmse_count = 0;
+        std::array<size_t, 2>     start_fits{};
+        std::array<double, 2>     start_iterations{};
+
+        Scratch(Self *filter) {
+            FitType const &fit = *filter->m_fit;
+            mask               = filter->GetMask().GetPointer();
+            for (int i = 0; i < ModelType::NI; i++) {
+                input_images[i] = filter->GetInput(i).GetPointer();
+                residual_images[i] =
+                    filter->m_allResiduals ? filter->GetResidualsOutput(i) : nullptr;
+            }
+            for (int f = 0; f < ModelType::NF; f++) {
+                fixed_images[f] = filter->GetFixed(f).GetPointer();
+            }
+            for (int i = 0; i < ModelType::NV; i++) {
+                output_images[i] = filter->GetOutput(i);
+            }
+            if constexpr (HasDerived) {
+                for (int i = 0; i < ModelType::ND; i++) {
+                    derived_images[i] = filter->GetDerivedOutput(i);
+                }
+            }
+            for (int ii = 0; ii < ModelType::NCov; ii++) {
+                covar_images[ii] = filter->m_covar ? filter->GetCovarOutput(ii) : nullptr;
+            }
+            flag_image = filter->GetFlagOutput();
+            rmse_image = filter->GetRMSErrorOutput();
+            time_image  = filter->m_fitTime ? filter->GetFitTimeOutput() : nullptr;
+            seed_image  = filter->m_seeds.GetPointer();
+            seed_output = filter->m_seedOutput.GetPointer();
+
+            inputs.reserve(ModelType::NI);
+            for (int i = 0; i < ModelType::NI; i++) {
+                inputs.emplace_back(fit.input_size(i));
+            }
+            if (filter->m_allResiduals) {
+                residuals.reserve(ModelType::NI);
+                for (int i = 0; i < ModelType::NI; i++) {
+                    residuals.emplace_back(ResidualArray::Zero(fit.input_size(i)));
+                }
+            }
+            if (filter->m_warmStart) {
+                warm.resize(filter->m_blocks);
+                warm_good.assign(filter->m_blocks, false);
+            }
+        }
+
+        bool InMask(TIndex const &index) const { return !mask || mask->GetPixel(index); }
+
+        bool CanWarmStart(TIndex const &index, int const b) const {
+            if (!warm_good[b]) {
+                return false;
+            }
+            long distance = 0;
+            for (int d = 0; d < ImageDim; d++) {
+                distance += std::abs(index[d] - warm_index[d]);
+            }
+            return distance == 1;
+        }
+
+        // Whether an RMSE is within WarmTolerance of the mean of the successful fits so far
+        bool RMSEGood(double const rmse) const {
+            return (rmse_count == 0) || (rmse <= WarmTolerance * rmse_sum / rmse_count);
+        }
+
+        void AddRMSE(double const rmse) {
+            rmse_sum += rmse;
+            rmse_count++;
+        }
+
+        void UpdateWarmStart(int const b, bool const good, WarmStart<ModelType> const &ws) {
+            warm_good[b] = good && ws.saved;
+            if (ws.saved) {
+                warm[b] = ws.solution;
+            }
+        }
+
+        void ResetResiduals() {
+            for (auto &r : residuals) {
+                r.setZero();
+            }
+        }
+    };
 
     virtual void GenerateOutputInformation() override {
         Superclass::GenerateOutputInformation();
@@ -360,87 +665,225 @@ class ModelFitFilter
             }
         }
 
-        Log(m_verbose, "Allocating output image memory");
-        auto input     = this->GetInput(0);
-        auto region    = input->GetLargestPossibleRegion();
-        auto spacing   = input->GetSpacing();
-        auto origin    = input->GetOrigin();
-        auto direction = input->GetDirection();
+        if (m_slab > 0) {
+            Log(m_verbose, "Streaming, output memory will be allocated one slab at a time");
+        } else {
+            Log(m_verbose, "Allocating output image memory");
+            AllocateOutputImages(this->GetInput(0)->GetLargestPossibleRegion());
+        }
+        if (m_recordSeeds) {
+            m_seedOutput = NewSeedImage();
+        }
+    }
 
-        for (int i = 0; i < ModelType::NV; i++) {
-            auto op = this->GetOutput(i);
-            op->SetRegions(region);
-            op->SetSpacing(spacing);
-            op->SetOrigin(origin);
-            op->SetDirection(direction);
-            if constexpr (Blocked) {
-                op->SetNumberOfComponentsPerPixel(m_blocks);
+    typename TSeedImage::Pointer NewSeedImage() const {
+        auto seeds = TSeedImage::New();
+        seeds->CopyInformation(this->GetInput(0));
+        seeds->SetRegions(this->GetInput(0)->GetLargestPossibleRegion());
+        seeds->SetNumberOfComponentsPerPixel(ModelType::NV);
+        seeds->Allocate();
+        itk::VariableLengthVector<double> none(ModelType::NV);
+        none.Fill(std::numeric_limits<double>::quiet_NaN());
+        seeds->FillBuffer(none);
+        return seeds;
+    }
+
+    /*
+     * Fit a downsampled copy of the inputs with a second filter, and then upsample its solutions
+     * (nearest neighbour) to use as starting points. The inputs and fixed maps are averaged over
+     * each bin, so the coarse data is less noisy instead of a subsample of it.
+     */
+    void CoarsePass() {
+        Info(m_verbose, "Fitting at 1/{} resolution", m_coarse);
+        auto const shrink = [&](auto const *image) {
+            using TImage = std::remove_cv_t<std::remove_pointer_t<decltype(image)>>;
+            auto filter  = itk::BinShrinkImageFilter<TImage, TImage>::New();
+            filter->SetInput(image);
+            filter->SetShrinkFactors(m_coarse);
+            filter->Update();
+            typename TImage::Pointer shrunk = filter->GetOutput();
+            shrunk->DisconnectPipeline();
+            return shrunk;
+        };
+        auto coarse = Self::New(m_fit, false, false, false, std::string());
+        coarse->SetNumberOfWorkUnits(this->GetNumberOfWorkUnits());
+        coarse->SetChunkSize(m_chunkSize);
+        coarse->m_recordSeeds = true;
+        for (int i = 0; i < ModelType::NI; i++) {
+            coarse->SetInput(i, shrink(this->GetInput(i).GetPointer()));
+        }
+        for (int f = 0; f < ModelType::NF; f++) {
+            if (auto const fixed = this->GetFixed(f)) {
+                coarse->SetFixed(f, shrink(fixed.GetPointer()));
             }
-            op->Allocate(true);
         }
-
-        if constexpr (HasDerived) {
-            for (int i = 0; i < ModelType::ND; i++) {
-                auto op = this->GetDerivedOutput(i);
-                op->SetRegions(region);
-                op->SetSpacing(spacing);
-                op->SetOrigin(origin);
-                op->SetDirection(direction);
-                if constexpr (Blocked) {
-                    op->SetNumberOfComponentsPerPixel(m_blocks);
+        if (auto const mask = this->GetMask()) {
+            // Fit a bin if any of its voxels are in the mask, so every masked voxel gets a start
+            auto const *reference   = coarse->GetInput(0).GetPointer();
+            auto        coarse_mask = TMaskImage::New();
+            coarse_mask->CopyInformation(reference);
+            coarse_mask->SetRegions(reference->GetLargestPossibleRegion());
+            coarse_mask->Allocate(true);
+            itk::ImageRegionConstIteratorWithIndex<TMaskImage> it(
+                mask, mask->GetLargestPossibleRegion());
+            for (; !it.IsAtEnd(); ++it) {
+                if (it.Get()) {
+                    typename TMaskImage::PointType point;
+                    mask->TransformIndexToPhysicalPoint(it.GetIndex(), point);
+                    TIndex index;
+                    // Voxels in the partial bins at the far edges are dropped by the shrink
+                    if (coarse_mask->TransformPhysicalPointToIndex(point, index)) {
+                        coarse_mask->SetPixel(index, 1);
+                    }
                 }
-                op->Allocate(true);
             }
+            coarse->SetMask(coarse_mask);
         }
-
-        auto f = this->GetFlagOutput();
-        f->SetRegions(region);
-        f->SetSpacing(spacing);
-        f->SetOrigin(origin);
-        f->SetDirection(direction);
-        if constexpr (Blocked) {
-            f->SetNumberOfComponentsPerPixel(m_blocks);
+        coarse->Update();
+
+        auto const *coarse_seeds  = coarse->m_seedOutput.GetPointer();
+        auto const  coarse_region = coarse_seeds->GetLargestPossibleRegion();
+        m_seeds                   = NewSeedImage();
+        itk::ImageRegionIteratorWithIndex<TSeedImage> it(m_seeds,
+                                                         m_seeds->GetLargestPossibleRegion());
+        for (; !it.IsAtEnd(); ++it) {
+            typename TSeedImage::PointType point;
+            m_seeds->TransformIndexToPhysicalPoint(it.GetIndex(), point);
+            TIndex index;
+            coarse_seeds->TransformPhysicalPointToIndex(point, index);
+            for (int d = 0; d < ImageDim; d++) {
+                auto const last = coarse_region.GetIndex()[d] + coarse_region.GetSize()[d] - 1;
+                index[d] = std::clamp<long>(index[d], coarse_region.GetIndex()[d], last);
+            }
+            it.Set(coarse_seeds->GetPixel(index));
         }
-        f->Allocate(true);
+        Info(m_verbose, "Finished coarse fit, fitting at full resolution");
+    }
 
-        auto rms = this->GetRMSErrorOutput();
-        rms->SetRegions(region);
-        rms->SetSpacing(spacing);
-        rms->SetOrigin(origin);
-        rms->SetDirection(direction);
-        if constexpr (Blocked) {
-            rms->SetNumberOfComponentsPerPixel(m_blocks);
+    /*
+     * Call f(image, name, components) for every output that is being generated, in the order
+     * they are written
+     */
+    template <typename F> void ForEachOutput(F &&f) {
+        for (int i = 0; i < ModelType::NV; i++) {
+            f(GetOutput(i), m_fit->model.varying_names.at(i), m_blocks);
         }
-        rms->Allocate(true);
-
+        if constexpr (HasDerived) {
+            for (int i = 0; i < ModelType::ND; i++) {
+                f(GetDerivedOutput(i), m_fit->model.derived_names.at(i), m_blocks);
+            }
+        }
+        f(GetRMSErrorOutput(), "rmse", m_blocks);
+        f(GetFlagOutput(), "iterations", m_blocks);
         if (m_covar) {
-            for (int ii = 0; ii < ModelType::NCov; ii++) {
-                auto op = this->GetCovarOutput(ii);
-                op->SetRegions(region);
-                op->SetSpacing(spacing);
-                op->SetOrigin(origin);
-                op->SetDirection(direction);
-                if constexpr (Blocked) {
-                    op->SetNumberOfComponentsPerPixel(m_blocks);
+            for (int ii = 0; ii < ModelType::NV; ii++) {
+                auto const &name = m_fit->model.varying_names.at(ii);
+                f(GetCovarOutput(ii), "CoV_" + name, m_blocks);
+            }
+            int index = ModelType::NV;
+            for (int ii = 0; ii < ModelType::NV; ii++) {
+                auto const &name1 = m_fit->model.varying_names.at(ii);
+                for (int jj = ii + 1; jj < ModelType::NV; jj++) {
+                    auto const &name2 = m_fit->model.varying_names.at(jj);
+                    f(GetCovarOutput(index++), "Corr_" + name1 + "_" + name2, m_blocks);
                 }
-                op->Allocate(true);
             }
         }
-
         if (m_allResiduals) {
             for (int i = 0; i < ModelType::NI; i++) {
-                auto res = this->GetResidualsOutput(i);
-                res->SetRegions(region);
-                res->SetSpacing(spacing);
-                res->SetOrigin(origin);
-                res->SetDirection(direction);
-                res->SetNumberOfComponentsPerPixel(m_fit->input_size(i) * m_blocks);
-                res->Allocate(true);
+                f(GetResidualsOutput(i),
+                  "residuals_" + std::to_string(i),
+                  m_fit->input_size(i) * m_blocks);
             }
         }
+        if (m_fitTime) {
+            f(GetFitTimeOutput(), "fit_time", 1);
+        }
     }
 
-    virtual void GenerateData() override {
+    /*
+     * Number of volumes an output takes in the single output image, complex outputs are split into
+     * real and imaginary parts
+     */
+    template <typename TImage> static int SingleVolumes(TImage *image, int const components) {
+        using TElement = std::remove_pointer_t<decltype(image->GetBufferPointer())>;
+        return IsComplex<TElement>::value ? 2 * components : components;
+    }
+
+    void WriteSingleIndex(std::string const &prefix) {
+        json index;
+        int  start = 0;
+        ForEachOutput([&](auto *image, std::string const &name, int const components) {
+            int const size = SingleVolumes(image, components);
+            json      entry{{"name", name}, {"start", start}, {"size", size}};
+            if (size != components) {
+                entry["complex"] = true;
+            }
+            index["outputs"].push_back(entry);
+            start += size;
+        });
+        index["volumes"] = start;
+        QI::WriteJSON(prefix + "outputs.json", index);
+    }
+
+    /*
+     * Copies the buffered part of all the outputs into one vector image
+     */
+    TSingleImage::Pointer SingleOutput() {
+        int total = 0;
+        ForEachOutput([&](auto *image, std::string const &, int const components) {
+            total += SingleVolumes(image, components);
+        });
+        auto const *first  = GetOutput(0);
+        auto        single = TSingleImage::New();
+        single->CopyInformation(first);
+        single->SetBufferedRegion(first->GetBufferedRegion());
+        single->SetRequestedRegion(first->GetBufferedRegion());
+        single->SetNumberOfComponentsPerPixel(total);
+        single->Allocate();
+
+        auto *const  out   = single->GetBufferPointer();
+        size_t const nvox  = first->GetBufferedRegion().GetNumberOfPixels();
+        int          start = 0;
+        ForEachOutput([&](auto *image, std::string const &, int const components) {
+            auto const *in = image->GetBufferPointer();
+            using TElement = std::remove_cv_t<std::remove_pointer_t<decltype(in)>>;
+            for (size_t v = 0; v < nvox; v++) {
+                float *const voxel = out + v * total + start;
+                for (int c = 0; c < components; c++) {
+                    auto const value = in[v * components + c];
+                    if constexpr (IsComplex<TElement>::value) {
+                        voxel[2 * c]     = value.real();
+                        voxel[2 * c + 1] = value.imag();
+                    } else {
+                        voxel[c] = static_cast<float>(value);
+                    }
+                }
+            }
+            start += SingleVolumes(image, components);
+        });
+        return single;
+    }
+
+    /*
+     * The outputs always cover the whole image, but when streaming only the current slab is
+     * buffered
+     */
+    void AllocateOutputImages(TRegion const &buffered) {
+        auto const input = this->GetInput(0);
+        ForEachOutput([&](auto *op, std::string const &, int const components) {
+            op->SetLargestPossibleRegion(input->GetLargestPossibleRegion());
+            op->SetBufferedRegion(buffered);
+            op->SetRequestedRegion(buffered);
+            op->SetSpacing(input->GetSpacing());
+            op->SetOrigin(input->GetOrigin());
+            op->SetDirection(input->GetDirection());
+            op->SetNumberOfComponentsPerPixel(components);
+            op->Allocate(true);
+        });
+    }
+
+    TRegion FitRegion() const {
         auto region = this->GetInput(0)->GetLargestPossibleRegion();
         if (m_hasSubregion) {
             if (region.IsInside(m_subregion)) {
@@ -449,225 +892,687 @@ class ModelFitFilter
                 itkExceptionMacro("Specified subregion is not entirely inside image.");
             }
         }
+        return region;
+    }
 
+    void StartProcessing(TRegion const &region) {
         Info(m_verbose, "Processing...");
-        Self *processObjectForThreader = this->GetThreaderUpdateProgress() ? this : nullptr;
+        QI::InvalidateFitContexts(); // The fit object may sit where a previous one did
+        m_allocations  = 0;
+        m_voxels       = 0;
+        m_regionVoxels = region.GetNumberOfPixels();
+        m_busy.clear();
+        m_fitTimes.clear();
+        m_slowest.clear();
+        m_startFits       = {};
+        m_startIterations = {};
         this->GetMultiThreader()->SetNumberOfWorkUnits(this->GetNumberOfWorkUnits());
-        this->GetMultiThreader()->SetUpdateProgress(this->GetThreaderUpdateProgress());
-        this->GetMultiThreader()->template ParallelizeImageRegion<ImageDim>(
-            region,
-            [this](const typename TOutputImage::RegionType &outputRegion) {
-                this->DynamicThreadedGenerateData(outputRegion);
-            },
-            processObjectForThreader);
+    }
+
+    virtual void GenerateData() override {
+        if (m_slab > 0) {
+            Info(m_verbose, "Streaming, fitting will happen as the outputs are written");
+            return;
+        }
+        auto const region = FitRegion();
+        if (m_coarse > 1) {
+            CoarsePass();
+        }
+        StartProcessing(region);
+        if (m_checkpointPath.empty()) {
+            ProcessRegion(region);
+        } else {
+            // Process one slice at a time, saving each one as it is finished
+            auto const &largest = this->GetInput(0)->GetLargestPossibleRegion();
+            auto const &size    = largest.GetSize();
+            auto const  buffers = [this](int const z) { return OutputSliceBuffers(z); };
+            QI::SliceCheckpoint checkpoint(m_checkpointPath, {size[0], size[1], size[2]}, buffers);
+            std::vector<bool> const done = m_resume ? checkpoint.Resume() : checkpoint.Start();
+
+            itk::TotalProgressReporter progress(this, m_regionVoxels);
+            TRegion                    slice = region;
+            slice.SetSize(2, 1);
+            for (size_t k = 0; k < region.GetSize()[2]; k++) {
+                slice.SetIndex(2, region.GetIndex()[2] + static_cast<long>(k));
+                auto const z = slice.GetIndex()[2] - largest.GetIndex()[2];
+                if (done[z]) {
+                    Log(m_verbose, "Slice {} was already fitted", z);
+                    progress.Completed(slice.GetNumberOfPixels());
+                } else {
+                    ProcessRegion(slice);
+                    checkpoint.Save(z);
+                }
+            }
+        }
+        FinishProcessing();
+    }
+
+    void FinishProcessing() {
         Info(m_verbose, "Finished processing.");
+        if (m_voxels > 0 && QI::AllocationCounter::Available()) {
+            Info(m_verbose,
+                 "Heap allocations in voxel loop: {} ({:.3g} per voxel)",
+                 m_allocations.load(),
+                 static_cast<double>(m_allocations) / m_voxels);
+        }
+        if (m_verbose && !m_busy.empty()) {
+            double min_busy = std::numeric_limits<double>::infinity(), max_busy = 0, sum_busy = 0;
+            int    thread = 0;
+            for (auto const &kv : m_busy) {
+                auto const &busy = kv.second;
+                Log(m_verbose,
+                    "Thread {}: busy {:.2f} s, {} voxels",
+                    thread++,
+                    busy.first,
+                    busy.second);
+                min_busy = std::min(min_busy, busy.first);
+                max_busy = std::max(max_busy, busy.first);
+                sum_busy += busy.first;
+            }
+            Info(m_verbose,
+                 "Thread busy time min/mean/max: {:.2f}/{:.2f}/{:.2f} s",
+                 min_busy,
+                 sum_busy / m_busy.size(),
+                 max_busy);
+        }
+        if (m_fitTime && !m_fitTimes.empty()) {
+            ReportFitTimes();
+        }
+        if ((m_warmStart || m_seeds) && m_startFits[0] + m_startFits[1] > 0) {
+            ReportWarmStarts();
+        }
     }
 
-    virtual void DynamicThreadedGenerateData(const TRegion &region) override {
-        itk::ImageRegionConstIterator<TMaskImage> mask_iter;
-        const auto                                mask = this->GetMask();
-        if (mask) {
-            mask_iter = itk::ImageRegionConstIterator<TMaskImage>(mask, region);
+    void ReportWarmStarts() const {
+        auto const mean = [&](int const w) {
+            return m_startFits[w] ? m_startIterations[w] / m_startFits[w] : 0.0;
+        };
+        Info(true,
+             "Warm starts: {} fits, {:.2f} iterations per fit. Default starts: {} fits, {:.2f} "
+             "iterations per fit",
+             m_startFits[1],
+             mean(1),
+             m_startFits[0],
+             mean(0));
+        if (m_startFits[0] > 0 && mean(0) > 0) {
+            double const total = m_startIterations[0] + m_startIterations[1];
+            double const cold  = mean(0) * (m_startFits[0] + m_startFits[1]);
+            Info(true,
+                 "Iterations saved by warm starts: {:.0f} ({:.1f}%)",
+                 cold - total,
+                 100.0 * (cold - total) / cold);
         }
+    }
 
-        std::vector<itk::ImageRegionConstIterator<TInputImage>> input_iters(ModelType::NI);
-        std::vector<itk::ImageRegionIterator<TResidualsImage>>  residuals_iters(ModelType::NI);
-        for (int i = 0; i < ModelType::NI; i++) {
-            input_iters[i] = itk::ImageRegionConstIterator<TInputImage>(this->GetInput(i), region);
-            if (m_allResiduals) {
-                residuals_iters[i] =
-                    itk::ImageRegionIterator<TResidualsImage>(this->GetResidualsOutput(i), region);
+    /*
+     * Gather the fit times of the voxels in this region for the summary. Only the slowest few
+     * voxels are kept with their indices.
+     */
+    void CollectFitTimes(TRegion const &region) {
+        auto const faster = [](auto const &a, auto const &b) { return a.first > b.first; };
+        auto const mask   = this->GetMask();
+        itk::ImageRegionConstIteratorWithIndex<TFitTimeImage> it(GetFitTimeOutput(), region);
+        for (; !it.IsAtEnd(); ++it) {
+            if (!mask || mask->GetPixel(it.GetIndex())) {
+                m_fitTimes.push_back(it.Get());
+                if (m_slowest.size() < NSlowest || it.Get() > m_slowest.front().first) {
+                    m_slowest.emplace_back(it.Get(), it.GetIndex());
+                    std::push_heap(m_slowest.begin(), m_slowest.end(), faster);
+                    if (m_slowest.size() > NSlowest) {
+                        std::pop_heap(m_slowest.begin(), m_slowest.end(), faster);
+                        m_slowest.pop_back();
+                    }
+                }
             }
         }
-        std::array<itk::ImageRegionConstIterator<TFixedImage>, ModelType::NF> fixed_iters;
-        for (int i = 0; i < ModelType::NF; i++) {
-            typename TFixedImage::ConstPointer c = this->GetFixed(i);
-            if (c) {
-                fixed_iters[i] = itk::ImageRegionConstIterator<TFixedImage>(c, region);
+    }
+
+    void ReportFitTimes() {
+        auto const percentile = [&](double const p) {
+            auto const n = std::min(m_fitTimes.size() - 1,
+                                    static_cast<size_t>(p * m_fitTimes.size() / 100.0));
+            std::nth_element(m_fitTimes.begin(), m_fitTimes.begin() + n, m_fitTimes.end());
+            return m_fitTimes[n];
+        };
+        double total = 0;
+        for (auto const t : m_fitTimes) {
+            total += t;
+        }
+        Info(true,
+             "Fit time per voxel (us) mean {:.1f} p50 {:.1f} p95 {:.1f} p99 {:.1f} max {:.1f}",
+             total / m_fitTimes.size(),
+             percentile(50),
+             percentile(95),
+             percentile(99),
+             *std::max_element(m_fitTimes.begin(), m_fitTimes.end()));
+
+        // Decade histogram, from under 10 us to over 100 ms
+        std::array<size_t, 6> counts{};
+        for (auto const t : m_fitTimes) {
+            size_t bin = 0;
+            for (float edge = 10.f; bin < counts.size() - 1 && t >= edge; edge *= 10.f) {
+                bin++;
             }
+            counts[bin]++;
+        }
+        char const *labels[] = {"<10 us", "<100 us", "<1 ms", "<10 ms", "<100 ms", ">=100 ms"};
+        for (size_t bin = 0; bin < counts.size(); bin++) {
+            Log(true,
+                "{:>9}: {:>9} voxels ({:.1f}%)",
+                labels[bin],
+                counts[bin],
+                100.0 * counts[bin] / m_fitTimes.size());
         }
 
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::NV> output_iters;
-        for (int i = 0; i < ModelType::NV; i++) {
-            output_iters[i] = itk::ImageRegionIterator<TOutputImage>(this->GetOutput(i), region);
+        std::sort(m_slowest.begin(), m_slowest.end(), [](auto const &a, auto const &b) {
+            return a.first > b.first;
+        });
+        Log(true, "Slowest voxels:");
+        for (auto const &slow : m_slowest) {
+            Log(true, "  {} {:.1f} us", slow.second, slow.first);
         }
+    }
 
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::ND> derived_iters;
-        if constexpr (HasDerived) {
-            for (int i = 0; i < ModelType::ND; i++) {
-                derived_iters[i] =
-                    itk::ImageRegionIterator<TOutputImage>(this->GetDerivedOutput(i), region);
+    /*
+     * In streaming mode the fitting happens here. Each slab of the inputs is read, fitted, and
+     * written into the output files before moving on to the next, so the memory used depends on
+     * the slab size rather than the image size.
+     */
+    void StreamOutputs(std::string const &prefix) {
+        auto const largest = this->GetInput(0)->GetLargestPossibleRegion();
+        auto const region  = FitRegion();
+        if (m_single) {
+            WriteSingleIndex(prefix);
+        }
+        StartProcessing(region);
+        this->UpdateProgress(0);
+        long const z_end = largest.GetIndex()[2] + static_cast<long>(largest.GetSize()[2]);
+        for (long z = largest.GetIndex()[2]; z < z_end; z += m_slab) {
+            TRegion slab = largest;
+            slab.SetIndex(2, z);
+            slab.SetSize(2, std::min<long>(m_slab, z_end - z));
+            AllocateOutputImages(slab);
+            TRegion fit_region = slab;
+            if (fit_region.Crop(region)) { // Slabs outside the subregion are left as zeros
+                ReadSlab(slab);
+                ProcessRegion(fit_region);
+            }
+            if (m_single) {
+                QI::WriteImageRegion(
+                    SingleOutput().GetPointer(), prefix + "outputs" + QI::OutExt(), false);
+            } else {
+                QI::IOTasks io;
+                ForEachOutput([&](auto *image, std::string const &name, int) {
+                    io.Add([copy = Detached(image), path = prefix + name + QI::OutExt()] {
+                        QI::WriteImageRegion(copy.GetPointer(), path, false);
+                    });
+                });
+                io.Run();
             }
+            Log(m_verbose, "Wrote slices {}-{}", z, z + slab.GetSize()[2] - 1);
         }
+        FinishProcessing();
+    }
 
-        std::array<itk::ImageRegionIterator<TOutputImage>, ModelType::NCov> covar_iters;
-        if (m_covar) {
-            for (int ii = 0; ii < ModelType::NCov; ii++) {
-                covar_iters[ii] =
-                    itk::ImageRegionIterator<TOutputImage>(this->GetCovarOutput(ii), region);
+    void ReadSlab(TRegion const &slab) {
+        InputImages images;
+        QI::IOTasks io;
+        for (int i = 0; i < ModelType::NI; i++) {
+            io.Add([&, i] {
+                images.inputs[i] = QI::ReadImageRegion<TInputImage>(m_inputPaths[i], slab, false);
+            });
+        }
+        for (int f = 0; f < ModelType::NF; f++) {
+            if (!m_fixedPaths[f].empty()) {
+                io.Add([&, f] {
+                    images.fixed[f] =
+                        QI::ReadImageRegion<TFixedImage>(m_fixedPaths[f], slab, false);
+                });
             }
         }
+        if (!m_maskPath.empty()) {
+            io.Add([&] { images.mask = QI::ReadImageRegion<TMaskImage>(m_maskPath, slab, false); });
+        }
+        io.Run();
+        SetInputImages(images);
+    }
 
-        // Keep the index on this one to report voxel locations where algorithm fails.
-        itk::ImageRegionIteratorWithIndex<TRMSErrorImage> rmse_iter(this->GetRMSErrorOutput(),
-                                                                    region);
-        itk::ImageRegionIterator<TFlagImage>              flag_iter(this->GetFlagOutput(), region);
+    /*
+     * Images read by IOTasks are collected here, then set as inputs from the main thread
+     */
+    struct InputImages {
+        std::array<typename TInputImage::Pointer, ModelType::NI> inputs;
+        std::array<typename TFixedImage::Pointer, ModelType::NF> fixed;
+        typename TMaskImage::Pointer                             mask;
+    };
 
-        VaryingArray outputs;
-        FixedArray   fixed;
-        CovarArray * covar = m_covar ? new CovarArray : nullptr;
+    void SetInputImages(InputImages const &images) {
+        for (int i = 0; i < ModelType::NI; i++) {
+            SetInput(i, images.inputs[i]);
+        }
+        for (int f = 0; f < ModelType::NF; f++) {
+            if (images.fixed[f]) {
+                SetFixed(f, images.fixed[f]);
+            }
+        }
+        if (images.mask) {
+            SetMask(images.mask);
+        }
+    }
 
-        itk::TotalProgressReporter progress(
-            this,
-            m_hasSubregion ? m_subregion.GetNumberOfPixels() :
-                             this->GetOutput(0)->GetRequestedRegion().GetNumberOfPixels());
-        while (!input_iters[0].IsAtEnd()) {
-            if (!mask || mask_iter.Get()) {
-                for (int b = 0; b < m_blocks; b++) {
-                    std::vector<DataArray> inputs(ModelType::NI);
-                    for (int i = 0; i < ModelType::NI; i++) {
-                        auto input_data       = input_iters[i].Get();
-                        inputs[i]             = DataArray(m_fit->input_size(i));
-                        const int block_start = b * m_fit->input_size(i);
-                        for (Eigen::Index j = 0; j < m_fit->input_size(i); j++) {
-                            inputs[i][j] = input_data[j + block_start];
-                        }
-                    }
+    /*
+     * Shares the buffer of an output but not the pipeline, so that several outputs can be written
+     * at once without each writer trying to update this filter
+     */
+    template <typename TImage> static typename TImage::Pointer Detached(TImage const *image) {
+        auto copy = TImage::New();
+        copy->Graft(image);
+        return copy;
+    }
 
-                    outputs = VaryingArray::Zero();
-                    if constexpr (ModelType::NF > 0) {
-                        fixed = m_fit->model.fixed_defaults;
-                        for (size_t i = 0; i < fixed_iters.size(); i++) {
-                            if (this->GetFixed(i)) {
-                                fixed[i] = fixed_iters[i].Get();
-                            }
-                        }
-                    }
-                    if (m_covar) {
-                        *covar = CovarArray::Zero();
-                    }
+    void ProcessRegion(const TRegion &region) {
+        if (m_chunkSize > 0) {
+            ChunkedGenerateData(region);
+        } else {
+            Self *processObjectForThreader = this->GetThreaderUpdateProgress() ? this : nullptr;
+            this->GetMultiThreader()->SetUpdateProgress(this->GetThreaderUpdateProgress());
+            this->GetMultiThreader()->template ParallelizeImageRegion<ImageDim>(
+                region,
+                [this](const typename TOutputImage::RegionType &outputRegion) {
+                    this->DynamicThreadedGenerateData(outputRegion);
+                },
+                processObjectForThreader);
+        }
+        if (m_fitTime) {
+            CollectFitTimes(region);
+        }
+    }
 
-                    typename FitType::RMSErrorType rmse = 0;
-                    typename FitType::FlagType     flag = 0;
-                    std::vector<ResidualArray>     rs; // Leave size 0 if user doesn't want them
-                    if (m_allResiduals) {
-                        for (int i = 0; i < ModelType::NI; i++) {
-                            const int block_size = m_fit->input_size(i);
-                            rs.push_back(ResidualArray::Zero(block_size));
-                        }
+    /*
+     * The memory for one slice of every output that is being generated, for checkpointing. The
+     * outputs cover the whole image, and each slice is contiguous in memory.
+     */
+    QI::SliceCheckpoint::Buffers OutputSliceBuffers(int const z) {
+        QI::SliceCheckpoint::Buffers buffers;
+        ForEachOutput([&](auto *image, std::string const &, int) {
+            auto const & size  = image->GetLargestPossibleRegion().GetSize();
+            size_t const count = size[0] * size[1] * image->GetNumberOfComponentsPerPixel();
+            auto *const  data  = image->GetBufferPointer() + z * count;
+            buffers.emplace_back(reinterpret_cast<char *>(data), count * sizeof(*data));
+        });
+        return buffers;
+    }
+
+    void FinishWorkUnit(Scratch const &s) {
+        std::chrono::duration<double> const busy = std::chrono::steady_clock::now() - s.start;
+        m_allocations += s.allocations;
+        m_voxels += s.voxels;
+        std::lock_guard<std::mutex> lock(m_busyMutex);
+        auto &                      thread_busy = m_busy[std::this_thread::get_id()];
+        thread_busy.first += busy.count();
+        thread_busy.second += s.voxels;
+        for (int w = 0; w < 2; w++) {
+            m_startFits[w] += s.start_fits[w];
+            m_startIterations[w] += s.start_iterations[w];
+        }
+    }
+
+    virtual void DynamicThreadedGenerateData(const TRegion &region) override {
+        Scratch                    s(this);
+        itk::TotalProgressReporter progress(this, m_regionVoxels);
+        if constexpr (Batched) {
+            /*
+             * Process the region one scanline at a time. The voxels inside the mask on each line
+             * are gathered into a single batch, fitted with one call, and then scattered back to
+             * the outputs.
+             */
+            auto const          line = static_cast<Eigen::Index>(region.GetSize()[0]);
+            BatchType           batch(*m_fit, line, m_allResiduals);
+            std::vector<TIndex> indices;
+            indices.reserve(line);
+            QI::AllocationCounter                        counter(m_verbose);
+            itk::ImageScanlineConstIterator<TInputImage> line_iter(this->GetInput(0), region);
+            while (!line_iter.IsAtEnd()) {
+                indices.clear();
+                while (!line_iter.IsAtEndOfLine()) {
+                    auto const index = line_iter.GetIndex();
+                    if (s.InMask(index)) {
+                        indices.push_back(index);
                     }
+                    ++line_iter;
+                }
+                FitBatchOfVoxels(indices.data(), indices.size(), batch, s);
+                progress.Completed(line);
+                line_iter.NextLine();
+            }
+            s.allocations = counter.count();
+        } else {
+            // Voxels outside the mask are left at the zero they were allocated with
+            QI::AllocationCounter counter(m_verbose);
+            ForEachIndex(region, [&](TIndex const &index) {
+                if (s.InMask(index)) {
+                    FitVoxel(index, s);
+                }
+                progress.CompletedPixel();
+            });
+            s.allocations = counter.count();
+        }
+        FinishWorkUnit(s);
+    }
+
+    /*
+     * Visit every index in the region in raster order. For warm starts the direction is reversed
+     * on alternate lines, and the lines on alternate slices, so that each voxel is visited
+     * immediately after one of its neighbours.
+     */
+    template <typename F> void ForEachIndex(TRegion const &region, F &&f) const {
+        if (!m_warmStart) {
+            itk::ImageRegionConstIteratorWithIndex<TInputImage> iter(this->GetInput(0), region);
+            for (; !iter.IsAtEnd(); ++iter) {
+                f(iter.GetIndex());
+            }
+            return;
+        }
+        auto const &start   = region.GetIndex();
+        auto const &size    = region.GetSize();
+        bool        forward = true;
+        TIndex      index;
+        for (size_t k = 0; k < size[2]; k++) {
+            index[2] = start[2] + k;
+            for (size_t jj = 0; jj < size[1]; jj++) {
+                index[1] = start[1] + ((k % 2) ? size[1] - 1 - jj : jj);
+                for (size_t ii = 0; ii < size[0]; ii++) {
+                    index[0] = start[0] + (forward ? ii : size[0] - 1 - ii);
+                    f(index);
+                }
+                forward = !forward;
+            }
+        }
+    }
 
-                    QI::FitReturnType status;
-                    if constexpr (Blocked && Indexed) {
-                        status = m_fit->fit(
-                            inputs, fixed, outputs, covar, rmse, rs, flag, b, rmse_iter.GetIndex());
-                    } else if constexpr (Blocked) {
-                        status = m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag, b);
-                    } else if constexpr (Indexed) {
-                        status = m_fit->fit(
-                            inputs, fixed, outputs, covar, rmse, rs, flag, rmse_iter.GetIndex());
+    /*
+     * Compact the voxels inside the mask into a single list, and then hand them out to the
+     * threads in fixed-size chunks from a shared cursor. A thread that draws cheap voxels simply
+     * comes back for more, so all threads stay busy until the end even when the fit time varies
+     * greatly across the image.
+     */
+    void ChunkedGenerateData(const TRegion &region) {
+        std::vector<TIndex> work;
+        {
+            auto const mask = this->GetMask();
+            ForEachIndex(region, [&](TIndex const &index) {
+                if (!mask || mask->GetPixel(index)) {
+                    work.push_back(index);
+                }
+            });
+        }
+        Info(m_verbose, "{} voxels to fit in chunks of {}", work.size(), m_chunkSize);
+
+        std::atomic<size_t> cursor{0};
+        auto const          workers = this->GetMultiThreader()->GetNumberOfWorkUnits();
+        this->GetMultiThreader()->ParallelizeArray(
+            0,
+            workers,
+            [&](itk::SizeValueType) {
+                Scratch                    s(this);
+                itk::TotalProgressReporter progress(this, m_regionVoxels);
+                std::unique_ptr<BatchType> batch;
+                if constexpr (Batched) {
+                    batch = std::make_unique<BatchType>(*m_fit, m_chunkSize, m_allResiduals);
+                }
+                QI::AllocationCounter counter(m_verbose);
+                size_t                start;
+                while ((start = cursor.fetch_add(m_chunkSize)) < work.size()) {
+                    size_t const end = std::min(start + m_chunkSize, work.size());
+                    if constexpr (Batched) {
+                        FitBatchOfVoxels(&work[start], end - start, *batch, s);
                     } else {
-                        status = m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag);
+                        for (size_t v = start; v < end; v++) {
+                            FitVoxel(work[v], s);
+                        }
                     }
+                    progress.Completed(end - start);
+                }
+                s.allocations = counter.count();
+                FinishWorkUnit(s);
+            },
+            nullptr);
+        // Voxels outside the mask count towards progress too
+        itk::TotalProgressReporter progress(this, m_regionVoxels);
+        progress.Completed(region.GetNumberOfPixels() - work.size());
+    }
 
-                    if (!status.success && m_verbose) {
-                        QI::Warn(
-                            "Fit failed for voxel {}: {}", rmse_iter.GetIndex(), status.message);
-                    }
+    void FitVoxel(TIndex const &index, Scratch &s) {
+        auto const start = std::chrono::steady_clock::now();
+        FixedArray fixed;
+        if constexpr (ModelType::NF > 0) {
+            fixed = m_fit->model.fixed_defaults;
+            for (int f = 0; f < ModelType::NF; f++) {
+                if (s.fixed_images[f]) {
+                    fixed[f] = s.fixed_images[f]->GetPixel(index);
+                }
+            }
+        }
+        CovarArray *covar = m_covar ? &s.covar : nullptr;
+        for (int b = 0; b < m_blocks; b++) {
+            auto &inputs = s.inputs;
+            for (int i = 0; i < ModelType::NI; i++) {
+                auto const input_data  = s.input_images[i]->GetPixel(index);
+                const int  block_start = b * m_fit->input_size(i);
+                for (Eigen::Index j = 0; j < m_fit->input_size(i); j++) {
+                    inputs[i][j] = input_data[j + block_start];
+                }
+            }
 
+            VaryingArray                   outputs;
+            typename FitType::RMSErrorType rmse;
+            typename FitType::FlagType     flag;
+            auto &                         rs      = s.residuals;
+            auto const                     run_fit = [&]() {
+                outputs = VaryingArray::Zero();
+                if (m_covar) {
+                    s.covar = CovarArray::Zero();
+                }
+                rmse = 0;
+                flag = 0;
+                s.ResetResiduals();
+                if constexpr (Blocked && Indexed) {
+                    return m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag, b, index);
+                } else if constexpr (Blocked) {
+                    return m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag, b);
+                } else if constexpr (Indexed) {
+                    return m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag, index);
+                } else {
+                    return m_fit->fit(inputs, fixed, outputs, covar, rmse, rs, flag);
+                }
+            };
+
+            // Start from the coarse solution if there is one, otherwise from a neighbour
+            auto &warm = ThreadWarmStart<ModelType>();
+            warm.use   = false;
+            warm.saved = false;
+            if (s.seed_image) {
+                auto const seed = s.seed_image->GetPixel(index);
+                warm.use        = true;
+                for (int i = 0; i < ModelType::NV; i++) {
+                    warm.start[i] = seed[i];
+                    warm.use      = warm.use && !std::isnan(seed[i]);
+                }
+            }
+            if (!warm.use && m_warmStart && s.CanWarmStart(index, b)) {
+                warm.use   = true;
+                warm.start = s.warm[b];
+            }
+            QI::FitReturnType status = run_fit();
+            if (warm.use && !(status.success && s.RMSEGood(rmse))) {
+                // Try again from the default start. Fits that search inside the bounds only look
+                // close to a warm start, and can succeed with a poor fit if it was misleading.
+                warm.use = false;
+                status   = run_fit();
+            }
+            if (status.success) {
+                s.start_fits[warm.use]++;
+                s.start_iterations[warm.use] += flag;
+            }
+            if (m_warmStart) {
+                s.UpdateWarmStart(b, status.success && s.RMSEGood(rmse), warm);
+            }
+            if (status.success) {
+                s.AddRMSE(rmse);
+            }
+            if (s.seed_output && warm.saved) {
+                auto seed = s.seed_output->GetPixel(index);
+                for (int i = 0; i < ModelType::NV; i++) {
+                    seed[i] = warm.solution[i];
+                }
+            }
+            warm.use = false;
+            if (!status.success && m_verbose) {
+                QI::Warn("Fit failed for voxel {}: {}", index, status.message);
+            }
+
+            if constexpr (Blocked) {
+                s.flag_image->GetPixel(index)[b] = flag;
+                s.rmse_image->GetPixel(index)[b] = rmse;
+                for (int i = 0; i < ModelType::NV; i++) {
+                    s.output_images[i]->GetPixel(index)[b] = outputs[i];
+                }
+            } else {
+                s.flag_image->SetPixel(index, flag);
+                s.rmse_image->SetPixel(index, rmse);
+                for (int i = 0; i < ModelType::NV; i++) {
+                    s.output_images[i]->SetPixel(index, outputs[i]);
+                }
+                if (m_covar) {
+                    for (int ii = 0; ii < ModelType::NCov; ii++) {
+                        s.covar_images[ii]->SetPixel(index, s.covar[ii]);
+                    }
+                }
+            }
+            if constexpr (HasDerived) {
+                typename ModelType::DerivedArray derived;
+                m_fit->model.derived(outputs, fixed, derived);
+                for (int i = 0; i < ModelType::ND; i++) {
                     if constexpr (Blocked) {
-                        flag_iter.Get()[b] = flag;
-                        rmse_iter.Get()[b] = rmse;
-                        for (int i = 0; i < ModelType::NV; i++) {
-                            output_iters[i].Get()[b] = outputs[i];
-                        }
+                        s.derived_images[i]->GetPixel(index)[b] = derived[i];
                     } else {
-                        flag_iter.Set(flag);
-                        rmse_iter.Set(rmse);
-                        for (int i = 0; i < ModelType::NV; i++) {
-                            output_iters[i].Set(outputs[i]);
-                        }
-                        if (m_covar) {
-                            for (int ii = 0; ii < ModelType::NCov; ii++) {
-                                covar_iters[ii].Set((*covar)[ii]);
-                            }
-                        }
+                        s.derived_images[i]->SetPixel(index, derived[i]);
                     }
-                    if constexpr (HasDerived) {
-                        typename ModelType::DerivedArray derived;
-                        m_fit->model.derived(outputs, fixed, derived);
-                        for (int i = 0; i < ModelType::ND; i++) {
-                            derived_iters[i].Set(derived[i]);
-                        }
+                }
+            }
+            if (m_allResiduals) {
+                for (int i = 0; i < ModelType::NI; i++) {
+                    auto      residuals   = s.residual_images[i]->GetPixel(index);
+                    const int block_start = m_fit->input_size(i) * b;
+                    for (int j = 0; j < m_fit->input_size(i); j++) {
+                        residuals[j + block_start] = rs[i][j];
                     }
-                    if (m_allResiduals) {
-                        for (int i = 0; i < ModelType::NI; i++) {
-                            const int block_start = m_fit->input_size(i) * b;
-                            for (int j = 0; j < m_fit->input_size(i); j++) {
-                                residuals_iters[i].Get()[j + block_start] = rs[i][j];
-                            }
-                        }
+                }
+            }
+        }
+        if (s.time_image) {
+            std::chrono::duration<float, std::micro> const time =
+                std::chrono::steady_clock::now() - start;
+            s.time_image->SetPixel(index, time.count());
+        }
+        s.warm_index = index;
+        s.voxels++;
+    }
+
+    /*
+     * For fit functions that provide fit_batch(). The voxels are gathered into the batch, fitted
+     * with a single call, and then scattered back to the outputs.
+     */
+    void FitBatchOfVoxels(TIndex const *indices, size_t const count, BatchType &batch, Scratch &s) {
+        if (count == 0) {
+            return;
+        }
+        auto const start = std::chrono::steady_clock::now();
+        batch.count      = static_cast<Eigen::Index>(count);
+        for (int b = 0; b < m_blocks; b++) {
+            for (Eigen::Index v = 0; v < batch.count; v++) {
+                auto const &index = indices[v];
+                for (int i = 0; i < ModelType::NI; i++) {
+                    auto const input_data  = s.input_images[i]->GetPixel(index);
+                    const int  block_start = b * m_fit->input_size(i);
+                    for (Eigen::Index j = 0; j < m_fit->input_size(i); j++) {
+                        batch.inputs[i](v, j) = input_data[j + block_start];
                     }
                 }
+                for (int f = 0; f < ModelType::NF; f++) {
+                    batch.fixed(v, f) = s.fixed_images[f] ? s.fixed_images[f]->GetPixel(index) :
+                                                            m_fit->model.fixed_defaults[f];
+                }
+            }
+            // Pad the remainder of the batch with copies of the last voxel
+            for (Eigen::Index v = batch.count; v < batch.capacity(); v++) {
+                for (int i = 0; i < ModelType::NI; i++) {
+                    batch.inputs[i].row(v) = batch.inputs[i].row(batch.count - 1);
+                }
+                batch.fixed.row(v) = batch.fixed.row(batch.count - 1);
+            }
+
+            QI::FitReturnType status;
+            if constexpr (Blocked) {
+                status = m_fit->fit_batch(batch, b);
             } else {
+                status = m_fit->fit_batch(batch);
+            }
+            if (!status.success && m_verbose) {
+                QI::Warn("Fit failed for {} voxels starting at {}: {}",
+                         batch.count,
+                         indices[0],
+                         status.message);
+            }
+
+            for (Eigen::Index v = 0; v < batch.count; v++) {
+                auto const &index = indices[v];
                 if constexpr (Blocked) {
-                    flag_iter.Get().Fill(0);
-                    rmse_iter.Get().Fill(0);
-                    for (auto &o : output_iters) {
-                        o.Get().Fill(0);
+                    s.flag_image->GetPixel(index)[b] = batch.flags[v];
+                    s.rmse_image->GetPixel(index)[b] = batch.rmse[v];
+                    for (int i = 0; i < ModelType::NV; i++) {
+                        s.output_images[i]->GetPixel(index)[b] = batch.varying(v, i);
                     }
                 } else {
-                    flag_iter.Set(0);
-                    flag_iter.Set(0);
-                    for (auto &o : output_iters) {
-                        o.Set(0);
-                    }
-                    if (m_covar) {
-                        for (auto &c : covar_iters) {
-                            c.Set(0);
-                        }
+                    s.flag_image->SetPixel(index, batch.flags[v]);
+                    s.rmse_image->SetPixel(index, batch.rmse[v]);
+                    for (int i = 0; i < ModelType::NV; i++) {
+                        s.output_images[i]->SetPixel(index, batch.varying(v, i));
                     }
                 }
                 if constexpr (HasDerived) {
-                    for (auto &d : derived_iters) {
-                        d.Set(0);
+                    VaryingArray const varying_v = batch.varying.row(v).transpose();
+                    FixedArray const   fixed_v   = batch.fixed.row(v).transpose();
+                    typename ModelType::DerivedArray derived;
+                    m_fit->model.derived(varying_v, fixed_v, derived);
+                    for (int i = 0; i < ModelType::ND; i++) {
+                        if constexpr (Blocked) {
+                            s.derived_images[i]->GetPixel(index)[b] = derived[i];
+                        } else {
+                            s.derived_images[i]->SetPixel(index, derived[i]);
+                        }
                     }
                 }
                 if (m_allResiduals) {
-                    for (auto &r : residuals_iters) {
-                        r.Get().Fill(0);
+                    for (int i = 0; i < ModelType::NI; i++) {
+                        auto      residuals   = s.residual_images[i]->GetPixel(index);
+                        const int block_start = m_fit->input_size(i) * b;
+                        for (int j = 0; j < m_fit->input_size(i); j++) {
+                            residuals[j + block_start] = batch.residuals[i](v, j);
+                        }
                     }
                 }
             }
-
-            if (this->GetMask())
-                ++mask_iter;
-            for (int i = 0; i < ModelType::NI; i++) {
-                ++input_iters[i];
-                if (m_allResiduals)
-                    ++residuals_iters[i];
-            }
-            for (int i = 0; i < ModelType::NF; i++) {
-                if (this->GetFixed(i))
-                    ++fixed_iters[i];
-            }
-            for (int i = 0; i < ModelType::NV; i++) {
-                ++output_iters[i];
-            }
-            if constexpr (HasDerived) {
-                for (auto &d : derived_iters) {
-                    ++d;
-                }
-            }
-            if (m_covar) {
-                for (auto &c : covar_iters) {
-                    ++c;
-                }
+        }
+        if (s.time_image) {
+            // Individual voxels are not timed, so share the time for the batch out evenly
+            std::chrono::duration<float, std::micro> const time =
+                std::chrono::steady_clock::now() - start;
+            for (size_t v = 0; v < count; v++) {
+                s.time_image->SetPixel(indices[v], time.count() / count);
             }
-            ++flag_iter;
-            ++rmse_iter;
-            progress.CompletedPixel();
         }
+        s.voxels += count;
     }
 }; // namespace QI
 
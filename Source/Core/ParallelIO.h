@@ -0,0 +1,81 @@
+/*
+ *  ParallelIO.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace QI {
+
+/*
+ *  Commands with many inputs and outputs spend a long time reading and writing them one after
+ *  another, mostly in (de)compression. IOTasks collects the reads or writes and then runs them on
+ *  a small pool of threads, separate from the ITK pool used for fitting, so the total time tends
+ *  towards that of the largest file.
+ *
+ *  Tasks should store their results and leave handing them to ITK until Run() returns, as
+ *  setting inputs on a ProcessObject is not thread-safe. The first exception thrown by a task is
+ *  re-thrown from Run().
+ */
+class IOTasks {
+  public:
+    static constexpr unsigned MaxThreads = 8; // More than this will just contend for the disk
+
+    void Add(std::function<void()> task) { m_tasks.push_back(std::move(task)); }
+
+    void Run() {
+        unsigned const nthreads = std::min<unsigned>(
+            m_tasks.size(), std::clamp(std::thread::hardware_concurrency(), 1u, MaxThreads));
+        if (nthreads <= 1) {
+            for (auto &task : m_tasks) {
+                task();
+            }
+            m_tasks.clear();
+            return;
+        }
+        std::atomic<size_t>      next{0};
+        std::exception_ptr       error;
+        std::mutex               error_mutex;
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < nthreads; t++) {
+            threads.emplace_back([&] {
+                for (size_t i = next++; i < m_tasks.size(); i = next++) {
+                    try {
+                        m_tasks[i]();
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                    }
+                }
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        m_tasks.clear();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+  private:
+    std::vector<std::function<void()>> m_tasks;
+};
+
+} // namespace QI
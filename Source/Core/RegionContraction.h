@@ -14,10 +14,15 @@
 #define DESPOT_RegionContraction_h
 
 #include <random>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 
 #include <Eigen/Core>
 
@@ -27,10 +32,8 @@ namespace QI {
 
 typedef Eigen::Array<bool, Eigen::Dynamic, 1> ArrayXb;
 
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x,
-                                       Eigen::ArrayXd::Index             N);
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x,
-                                       Eigen::ArrayXd::Index             N) {
+inline std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x,
+                                              Eigen::ArrayXd::Index             N) {
     eigen_assert(x.size() >= N);
     std::vector<size_t> allIndices(x.size()), indices(N);
     for (size_t i = 0; i < allIndices.size(); i++) {
@@ -53,7 +56,7 @@ enum class RCStatus {
     ErrorResidual
 };
 
-std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
+inline std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
     switch (s) {
     case RCStatus::NotStarted:
         os << "Not Started";
@@ -77,6 +80,90 @@ std::ostream &operator<<(std::ostream &os, const RCStatus &s) {
     return os;
 }
 
+/*
+ *  Functors can provide costs(samples, first, last, out), which fills out[s] with the cost of
+ *  samples.col(s) for s in [first, last), to evaluate many samples per call instead of one
+ */
+template <typename F, typename = void> struct HasBatchCost : std::false_type {};
+template <typename F>
+struct HasBatchCost<F, std::void_t<decltype(&F::costs)>> : std::true_type {};
+
+/*
+ *  Threads that help the calling thread evaluate the samples of each contraction. Starting and
+ *  joining threads for every contraction costs about as much as evaluating the samples, so each
+ *  fitting thread keeps its own helpers, which wait between contractions and are joined when the
+ *  fitting thread exits. They are separate from the ITK pool, as its threads may all be busy
+ *  fitting voxels and waiting here.
+ */
+class HelperThreads {
+  public:
+    HelperThreads()                      = default;
+    HelperThreads(HelperThreads const &) = delete;
+    void operator=(HelperThreads const &) = delete;
+
+    ~HelperThreads() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_start.notify_all();
+        for (auto &thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    /*
+     *  Calls task(0) on this thread and task(1) to task(n - 1) on the helpers, and returns once
+     *  they have all finished
+     */
+    template <typename Task> void Run(int const n, Task &&task) {
+        while (static_cast<int>(m_threads.size()) < n - 1) {
+            int const  index = m_threads.size() + 1;
+            long const seen  = m_generation;
+            m_threads.emplace_back([this, index, seen] { Work(index, seen); });
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task    = std::ref(task);
+            m_active  = n;
+            m_pending = n - 1;
+            m_generation++;
+        }
+        m_start.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] { return m_pending == 0; });
+    }
+
+  private:
+    std::vector<std::thread> m_threads;
+    std::mutex               m_mutex;
+    std::condition_variable  m_start, m_done;
+    std::function<void(int)> m_task;
+    long                     m_generation = 0;
+    int                      m_active = 0, m_pending = 0;
+    bool                     m_stop = false;
+
+    void Work(int const index, long seen) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_start.wait(lock, [&] { return m_stop || m_generation != seen; });
+            if (m_stop) {
+                return;
+            }
+            seen = m_generation;
+            if (index < m_active) { // Fewer helpers may be needed than last time
+                lock.unlock();
+                m_task(index);
+                lock.lock();
+                if (--m_pending == 0) {
+                    m_done.notify_one();
+                }
+            }
+        }
+    }
+};
+
 template <typename Functor_t> class RegionContraction {
   private:
     Functor_t &     m_f;
@@ -87,6 +174,31 @@ template <typename Functor_t> class RegionContraction {
     double          m_expand, m_SoS;
     RCStatus        m_status;
     bool            m_gaussian, m_debug;
+    int             m_threads = 1;
+
+    /*
+     *  Evaluates all the samples, split between m_threads threads. Only the evaluation is split,
+     *  the samples are drawn beforehand, so the result does not depend on the number of threads.
+     */
+    void evaluate(Eigen::ArrayXXd const &samples, Eigen::ArrayXd &costs) const {
+        auto const range = [&](Eigen::Index const first, Eigen::Index const last) {
+            if constexpr (HasBatchCost<Functor_t>::value) {
+                m_f.costs(samples, first, last, costs);
+            } else {
+                for (Eigen::Index s = first; s < last; s++) {
+                    costs[s] = m_f(samples.col(s));
+                }
+            }
+        };
+        Eigen::Index const n = samples.cols();
+        if (m_threads <= 1) {
+            range(0, n);
+            return;
+        }
+        static thread_local HelperThreads helpers;
+        helpers.Run(m_threads,
+                    [&](int const t) { range(n * t / m_threads, n * (t + 1) / m_threads); });
+    }
 
   public:
     RegionContraction(Functor_t &f, const Eigen::ArrayXd &loBounds, const Eigen::ArrayXd &hiBounds,
@@ -124,6 +236,7 @@ template <typename Functor_t> class RegionContraction {
         eigen_assert((t >= 0.).all() && (t <= 1.).all());
         m_threshes = t;
     }
+    void                   setThreads(int const n) { m_threads = std::max(n, 1); } // Per voxel
     size_t                 contractions() const { return m_contractions; }
     RCStatus               status() const { return m_status; }
     const Eigen::ArrayXXd &currentBounds() const { return m_currentBounds; }
@@ -136,7 +249,7 @@ template <typename Functor_t> class RegionContraction {
         static std::atomic<bool> finiteWarning(false);
         static std::atomic<bool> constraintWarning(false);
         static std::atomic<bool> boundsWarning(false);
-        std::mutex               warn_mtx;
+        static std::mutex        warn_mtx;
 
         eigen_assert(m_f.inputs() == params.size());
         int                 nP = static_cast<int>(params.size());
@@ -182,11 +295,20 @@ template <typename Functor_t> class RegionContraction {
                     }
                     startSample = m_nR;
             }*/
+            // Draw all the samples first, then evaluate them in one go
+            std::vector<std::normal_distribution<double>> gauss;
+            bool const use_gauss = m_gaussian && (m_contractions > 0);
+            if (use_gauss) {
+                for (int p = 0; p < nP; p++) {
+                    gauss.emplace_back(gauss_mu(p),
+                                       std::isfinite(gauss_sigma(p)) ? gauss_sigma(p) : 1.);
+                }
+            }
             for (size_t s = startSample; s < m_nS; s++) {
-                Eigen::ArrayXd tempSample(nP);
-                size_t         nTries = 0;
+                auto   tempSample = samples.col(s);
+                size_t nTries     = 0;
                 do {
-                    if (!m_gaussian || (m_contractions == 0)) {
+                    if (!use_gauss) {
                         for (int p = 0; p < nP; p++) {
                             tempSample(p) = uniform(m_rng);
                         }
@@ -195,9 +317,8 @@ template <typename Functor_t> class RegionContraction {
                     } else {
                         for (int p = 0; p < nP; p++) {
                             if (std::isfinite(gauss_sigma(p))) {
-                                std::normal_distribution<double> gauss(gauss_mu(p), gauss_sigma(p));
                                 do {
-                                    tempSample(p) = gauss(m_rng);
+                                    tempSample(p) = gauss[p](m_rng);
                                 } while ((tempSample(p) < m_currentBounds(p, 0)) ||
                                          (tempSample(p) > m_currentBounds(p, 1)));
                             } else {
@@ -222,8 +343,9 @@ template <typename Functor_t> class RegionContraction {
                         return false;
                     }
                 } while (!m_f.constraint(tempSample));
-
-                residuals[s] = m_f(tempSample);
+            }
+            evaluate(samples, residuals);
+            for (size_t s = startSample; s < m_nS; s++) {
                 if (!std::isfinite(residuals[s])) {
                     warn_mtx.lock();
                     if (!finiteWarning) {
@@ -232,14 +354,13 @@ template <typename Functor_t> class RegionContraction {
                             << "Warning: Non-finite residual found!" << std::endl
                             << "Result may be meaningless. This warning will only be printed once."
                             << std::endl
-                            << "Parameters were " << tempSample.transpose() << std::endl;
+                            << "Parameters were " << samples.col(s).transpose() << std::endl;
                     }
                     warn_mtx.unlock();
                     params   = retained.col(0);
                     m_status = RCStatus::ErrorResidual;
                     return false;
                 }
-                samples.col(s) = tempSample;
             }
             indices                     = index_partial_sort(residuals, m_nR);
             Eigen::ArrayXd previousBest = retained.col(0);
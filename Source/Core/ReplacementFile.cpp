@@ -0,0 +1,56 @@
+/*
+ *  ReplacementFile.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Log.h"
+#include "ReplacementFile.h"
+
+namespace QI {
+
+ReplacementFile::ReplacementFile(std::string const &path) : m_path{path} {
+    std::string temp = path + ".XXXXXX";
+    int const   fd   = ::mkstemp(temp.data());
+    if (fd < 0) {
+        QI::Fail("Could not create a temporary file next to {}", path);
+    }
+    ::fchmod(fd, 0644); // mkstemp only allows the owner to read
+    ::close(fd);
+    m_temp = temp;
+    m_stream.open(m_temp, std::ios::binary | std::ios::trunc);
+    if (!m_stream) {
+        std::remove(m_temp.c_str());
+        QI::Fail("Could not open temporary file {}", m_temp);
+    }
+}
+
+ReplacementFile::~ReplacementFile() {
+    if (!m_committed) {
+        m_stream.close();
+        std::remove(m_temp.c_str());
+    }
+}
+
+void ReplacementFile::Commit() {
+    m_stream.close();
+    if (!m_stream) {
+        QI::Fail("Failed to write {}", m_temp);
+    }
+    if (std::rename(m_temp.c_str(), m_path.c_str()) != 0) {
+        QI::Fail("Could not rename {} to {}", m_temp, m_path);
+    }
+    m_committed = true;
+}
+
+} // namespace QI
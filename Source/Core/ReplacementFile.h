@@ -0,0 +1,41 @@
+/*
+ *  ReplacementFile.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <fstream>
+#include <string>
+
+namespace QI {
+
+/*
+ *  Writes a file under a unique temporary name in the same directory, then renames it over the
+ *  final path. Readers only ever see a complete file, processes that already have the old file
+ *  mapped keep their copy, and two processes writing at once cannot interleave. The temporary
+ *  file is removed if Commit() is never reached.
+ */
+class ReplacementFile {
+  public:
+    explicit ReplacementFile(std::string const &path);
+    ~ReplacementFile();
+    ReplacementFile(ReplacementFile const &) = delete;
+    void operator=(ReplacementFile const &) = delete;
+
+    std::ofstream &stream() { return m_stream; }
+    void           Commit();
+
+  private:
+    std::string   m_path, m_temp;
+    std::ofstream m_stream;
+    bool          m_committed = false;
+};
+
+} // namespace QI
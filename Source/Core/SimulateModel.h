@@ -29,11 +29,18 @@ void SimulateModel(json &                                    json,
                    std::string const &                       subRegion) {
     auto simulator = QI::ModelSimFilter<Model, MultiOutput>::New(model, verbose, subRegion);
     simulator->SetNoise(noise);
+    // With a subregion, only that part of each file is read and simulated
+    auto const read = [&](std::string const &path, bool const verbose_read) {
+        return subRegion.empty() ?
+                   QI::ReadImage(path, verbose_read) :
+                   QI::ReadImageSubregion<QI::VolumeF>(
+                       path, RegionFromString<QI::VolumeF::RegionType>(subRegion), verbose_read);
+    };
     for (auto i = 0; i < Model::NV; i++) {
         const std::string vname = model.varying_names[i];
         const std::string vfile = json.at(vname).get<std::string>();
         QI::Log(verbose, "Reading {} from file: {}", vname, vfile);
-        simulator->SetVarying(i, QI::ReadImage(vfile, false));
+        simulator->SetVarying(i, read(vfile, false));
     }
     if constexpr (Model::NF > 0) {
         if (fixedpaths.size() != Model::NF) {
@@ -46,12 +53,12 @@ void SimulateModel(json &                                    json,
                 std::string const &fname = model.fixed_names[i];
                 std::string const &ffile = fixedpaths[i];
                 QI::Log(verbose, "Reading {} from file: {}", fname, ffile);
-                simulator->SetFixed(i, QI::ReadImage(ffile, false));
+                simulator->SetFixed(i, read(ffile, false));
             }
         }
     }
     if (mask_path != "") {
-        simulator->SetMask(QI::ReadImage(mask_path, verbose));
+        simulator->SetMask(read(mask_path, verbose));
     }
     QI::Log(verbose, "Noise level is {}\nSimulating model...", noise);
     srand((unsigned int)time(0));
@@ -74,6 +74,37 @@ const std::string &OutExt() {
     return ext;
 }
 
+namespace {
+Precision PrecisionFromName(const std::string &name) {
+    static const std::map<std::string, Precision> valid_precision{
+        {"FLOAT", Precision::Float}, {"HALF", Precision::Half}, {"INT16", Precision::Int16}};
+    auto const it = valid_precision.find(name);
+    if (it == valid_precision.end()) {
+        QI::Fail("Output precision must be one of FLOAT, HALF or INT16, not {}", name);
+    }
+    return it->second;
+}
+
+Precision &OutPrecisionSetting() {
+    static const char *env_precision = getenv("QUIT_PRECISION");
+    static Precision   precision =
+        env_precision ? PrecisionFromName(env_precision) : Precision::Float;
+    return precision;
+}
+} // namespace
+
+Precision OutPrecision() {
+    return OutPrecisionSetting();
+}
+
+void SetOutPrecision(const std::string &name) {
+    OutPrecisionSetting() = PrecisionFromName(name);
+}
+
+void SetOutPrecision(const Precision precision) {
+    OutPrecisionSetting() = precision;
+}
+
 std::string StripExt(const std::string &filename) {
     std::size_t dot = filename.find_last_of(".");
     if (dot != std::string::npos) {
@@ -47,6 +47,16 @@ int GetDefaultThreads(); //!< Return the number of threads in the $QUIT_THREADS
 const std::string &GetVersion(); //!< Return the version of the QI library
 const std::string &OutExt();     //!< Return the extension stored in $QUIT_EXT
 
+/*
+ * Precision that real-valued images are written with. Half keeps float32 storage but rounds to
+ * the 11-bit significand of a half-float, which then compresses well. Int16 stores integers with
+ * the NIfTI scl_slope/scl_inter scaling. The default is read from $QUIT_PRECISION.
+ */
+enum class Precision { Float, Half, Int16 };
+Precision OutPrecision();
+void      SetOutPrecision(const std::string &name); //!< One of FLOAT, HALF or INT16
+void      SetOutPrecision(const Precision precision);
+
 std::string StripExt(const std::string &filename); //!< Remove the extension from a filename
 std::string GetExt(const std::string &filename);   //!< Return the extension from a filename with .
 std::string Basename(const std::string &path);     //!< Return only the filename part of a path
@@ -82,6 +92,16 @@ template <typename T> T Clamp(const T &value, const T &low, const T &high) {
     }
 }
 
+/*
+ * Element-wise version of Clamp for Eigen arrays. As above, NaNs end up at the low value
+ */
+template <typename Derived>
+auto Clamp(const Eigen::ArrayBase<Derived> &value,
+           const typename Derived::Scalar &low,
+           const typename Derived::Scalar &high) -> typename Derived::PlainObject {
+    return (value > low).select((value < high).select(value, high), low);
+}
+
 template <typename T, unsigned int D>
 Eigen::Array<T, D, 1> Eigenify(const itk::Vector<T, D> &itk_vector) {
     Eigen::Array<T, D, 1> eigen_vector;
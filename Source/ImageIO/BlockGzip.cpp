@@ -0,0 +1,192 @@
+/*
+ *  BlockGzip.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "itkMultiThreaderBase.h"
+#include "itk_zlib.h"
+
+#include "BlockGzip.h"
+#include "Log.h"
+
+namespace QI {
+
+namespace {
+constexpr size_t BlockSize    = 0xff00; // Input per block, leaves room for incompressible data
+constexpr size_t HeaderSize   = 18;
+constexpr size_t FooterSize   = 8;
+constexpr size_t MaxBlockSize = 0x10000;
+constexpr size_t BatchBlocks  = 1024; // Blocks held in memory at once
+
+// gzip header with the FEXTRA flag and the BGZF "BC" field holding the total block size - 1
+constexpr unsigned char Header[HeaderSize] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0};
+// An empty block, which BGZF readers expect at the end of the file
+constexpr unsigned char EndOfFile[28] = {31,  139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67,
+                                         2,   0,   27, 0, 3, 0, 0, 0, 0, 0,   0, 0, 0,  0};
+
+void PutLE16(unsigned char *p, uint32_t const v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+void PutLE32(unsigned char *p, uint32_t const v) {
+    PutLE16(p, v & 0xffff);
+    PutLE16(p + 2, v >> 16);
+}
+
+uint32_t GetLE16(unsigned char const *p) {
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t GetLE32(unsigned char const *p) {
+    return GetLE16(p) | (GetLE16(p + 2) << 16);
+}
+
+/*
+ *  Compresses one block into a complete gzip member
+ */
+std::vector<unsigned char> CompressBlock(unsigned char const *in, size_t const n) {
+    std::vector<unsigned char> block(MaxBlockSize);
+    z_stream                   zs;
+    std::memset(&zs, 0, sizeof(zs));
+    // Negative window bits give a raw deflate stream, as we write the gzip wrapper ourselves
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        QI::Fail("Could not initialise zlib");
+    }
+    zs.next_in   = const_cast<unsigned char *>(in);
+    zs.avail_in  = n;
+    zs.next_out  = block.data() + HeaderSize;
+    zs.avail_out = MaxBlockSize - HeaderSize - FooterSize;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        QI::Fail("Block did not fit in BGZF block size");
+    }
+    size_t const total = HeaderSize + zs.total_out + FooterSize;
+    deflateEnd(&zs);
+
+    std::memcpy(block.data(), Header, HeaderSize);
+    PutLE16(block.data() + 16, total - 1);
+    PutLE32(block.data() + total - 8, crc32(crc32(0, nullptr, 0), in, n));
+    PutLE32(block.data() + total - 4, n);
+    block.resize(total);
+    return block;
+}
+} // namespace
+
+bool IsNiftiGz(std::string const &path) {
+    std::string const ext = ".nii.gz";
+    return path.size() >= ext.size() &&
+           path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+void BlockGzip(std::string const &in_path, std::string const &out_path) {
+    std::ifstream in(in_path, std::ios::binary);
+    std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+    if (!in || !out) {
+        QI::Fail("Could not open {} to compress into {}", in_path, out_path);
+    }
+    auto threader = itk::MultiThreaderBase::New();
+
+    std::vector<unsigned char>              batch(BatchBlocks * BlockSize);
+    std::vector<std::vector<unsigned char>> blocks(BatchBlocks);
+    while (in) {
+        in.read(reinterpret_cast<char *>(batch.data()), batch.size());
+        size_t const n       = in.gcount();
+        size_t const nblocks = (n + BlockSize - 1) / BlockSize;
+        threader->ParallelizeArray(
+            0,
+            nblocks,
+            [&](itk::SizeValueType const b) {
+                size_t const start = b * BlockSize;
+                blocks[b] = CompressBlock(batch.data() + start, std::min(BlockSize, n - start));
+            },
+            nullptr);
+        for (size_t b = 0; b < nblocks; b++) {
+            out.write(reinterpret_cast<char const *>(blocks[b].data()), blocks[b].size());
+        }
+    }
+    out.write(reinterpret_cast<char const *>(EndOfFile), sizeof(EndOfFile));
+    if (!out) {
+        QI::Fail("Failed to write {}", out_path);
+    }
+}
+
+bool BlockGunzip(std::string const &path, std::vector<char> &out) {
+    std::ifstream file(path, std::ios::binary);
+    unsigned char first[HeaderSize];
+    if (!file.read(reinterpret_cast<char *>(first), HeaderSize) || first[12] != 'B' ||
+        first[13] != 'C') {
+        return false; // Check before reading the whole of a file that is not BGZF
+    }
+    file.seekg(0);
+    std::vector<unsigned char> const in((std::istreambuf_iterator<char>(file)),
+                                        std::istreambuf_iterator<char>());
+
+    // Find the blocks first, so that they can be inflated straight into place
+    struct Block {
+        size_t in_start, in_size, out_start, out_size;
+    };
+    std::vector<Block> blocks;
+    size_t             in_pos = 0, out_size = 0;
+    while (in_pos < in.size()) {
+        unsigned char const *h = in.data() + in_pos;
+        if (in.size() - in_pos < HeaderSize + FooterSize || h[0] != 31 || h[1] != 139 ||
+            h[3] != 4 || GetLE16(h + 10) != 6 || h[12] != 'B' || h[13] != 'C') {
+            return false; // Not BGZF, e.g. written by ITK or gzip
+        }
+        size_t const size = GetLE16(h + 16) + 1;
+        if (size < HeaderSize + FooterSize || in_pos + size > in.size()) {
+            return false;
+        }
+        size_t const isize = GetLE32(h + size - 4);
+        blocks.push_back({in_pos + HeaderSize, size - HeaderSize - FooterSize, out_size, isize});
+        in_pos += size;
+        out_size += isize;
+    }
+
+    out.resize(out_size);
+    std::atomic<bool> ok{true};
+    itk::MultiThreaderBase::New()->ParallelizeArray(
+        0,
+        blocks.size(),
+        [&](itk::SizeValueType const b) {
+            auto const &block = blocks[b];
+            auto *      dest  = reinterpret_cast<unsigned char *>(out.data()) + block.out_start;
+            z_stream    zs;
+            std::memset(&zs, 0, sizeof(zs));
+            if (inflateInit2(&zs, -15) != Z_OK) {
+                ok = false;
+                return;
+            }
+            zs.next_in   = const_cast<unsigned char *>(in.data() + block.in_start);
+            zs.avail_in  = block.in_size;
+            zs.next_out  = dest;
+            zs.avail_out = block.out_size;
+            int const status = inflate(&zs, Z_FINISH);
+            inflateEnd(&zs);
+            uint32_t const crc = GetLE32(in.data() + block.in_start + block.in_size);
+            if (status != Z_STREAM_END || zs.total_out != block.out_size ||
+                crc32(crc32(0, nullptr, 0), dest, block.out_size) != crc) {
+                ok = false;
+            }
+        },
+        nullptr);
+    if (!ok) {
+        QI::Fail("Corrupt block in {}", path);
+    }
+    return true;
+}
+
+} // namespace QI
@@ -0,0 +1,71 @@
+/*
+ *  BlockGzip.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace QI {
+
+/*
+ *  zlib can only deflate a stream on one thread, so writing .nii.gz is much slower than the rest
+ *  of a command. Instead the file is cut into blocks that are compressed in parallel, each as its
+ *  own gzip member. This is the BGZF layout used by samtools/htslib. The result is still a valid
+ *  gzip file, so ITK, FSL, nibabel and gunzip read it as usual, and since every block records its
+ *  compressed size it can also be inflated in parallel.
+ */
+bool IsNiftiGz(std::string const &path);
+
+void BlockGzip(std::string const &in_path, std::string const &out_path);
+
+/*
+ *  Inflates a file written by BlockGzip(). Returns false if the file is not BGZF, in which case
+ *  the caller should fall back to reading it normally.
+ */
+bool BlockGunzip(std::string const &path, std::vector<char> &out);
+
+/*
+ *  Runs an ITK writer, using BlockGzip for .nii.gz. ITK writes an uncompressed temporary file next
+ *  to the output first, which is then compressed and removed, even if a step fails. If given,
+ *  finish is called with the path of the uncompressed file once ITK has written it, e.g. to edit
+ *  the header.
+ */
+template <typename TWriter>
+void UpdateWriter(TWriter *                                      file,
+                  std::string const &                            path,
+                  std::function<void(std::string const &)> const &finish = {}) {
+    if (IsNiftiGz(path)) {
+        std::string const tmp_path = path + ".tmp.nii";
+        file->SetFileName(tmp_path);
+        try {
+            file->Update();
+            if (finish) {
+                finish(tmp_path);
+            }
+            BlockGzip(tmp_path, path);
+        } catch (...) {
+            std::remove(tmp_path.c_str()); // Do not leave a full-size uncompressed copy behind
+            throw;
+        }
+        std::remove(tmp_path.c_str());
+    } else {
+        file->SetFileName(path);
+        file->Update();
+        if (finish) {
+            finish(path);
+        }
+    }
+}
+
+} // namespace QI
@@ -0,0 +1,154 @@
+/*
+ *  ImageCache.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdlib>
+#include <map>
+#include <mutex>
+
+#include <sys/stat.h>
+
+#include "ImageCache.h"
+
+namespace QI {
+
+namespace {
+/*
+ *  Identifies the contents of a file, as long as nothing rewrites it within one mtime tick
+ *  without changing its size
+ */
+struct FileStamp {
+    long long seconds = 0, nanoseconds = 0, size = -1;
+
+    bool operator==(FileStamp const &other) const {
+        return seconds == other.seconds && nanoseconds == other.nanoseconds && size == other.size;
+    }
+};
+
+bool Stamp(std::string const &path, FileStamp &stamp) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#if defined(__APPLE__)
+    auto const &mtime = st.st_mtimespec;
+#else
+    auto const &mtime = st.st_mtim;
+#endif
+    stamp.seconds     = mtime.tv_sec;
+    stamp.nanoseconds = mtime.tv_nsec;
+    stamp.size        = st.st_size;
+    return true;
+}
+
+/*
+ *  Commands can name the same file by different relative paths, and qi serve changes to the
+ *  working directory of each request, so the same relative path can name different files. The
+ *  cache is keyed by the canonical absolute path instead.
+ */
+bool Identify(std::string const &path, std::string &key, FileStamp &stamp) {
+    char *const real = ::realpath(path.c_str(), nullptr);
+    if (!real) {
+        return false;
+    }
+    key = real;
+    std::free(real);
+    return Stamp(key, stamp);
+}
+
+struct CacheEntry {
+    FileStamp                stamp;
+    itk::DataObject::Pointer image;
+    size_t                   bytes     = 0;
+    size_t                   last_used = 0;
+};
+
+struct Cache {
+    std::mutex                        mutex;
+    std::map<std::string, CacheEntry> entries;
+    size_t                            max_bytes = 0;
+    size_t                            bytes     = 0;
+    size_t                            tick      = 0;
+    bool                              enabled   = false;
+
+    void erase(std::map<std::string, CacheEntry>::iterator it) {
+        bytes -= it->second.bytes;
+        entries.erase(it);
+    }
+};
+
+Cache &TheCache() {
+    static Cache cache;
+    return cache;
+}
+} // namespace
+
+void EnableImageCache(size_t const max_bytes) {
+    auto &                      cache = TheCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.enabled   = true;
+    cache.max_bytes = max_bytes;
+}
+
+bool ImageCacheEnabled() {
+    auto &                      cache = TheCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    return cache.enabled;
+}
+
+itk::DataObject::Pointer FindCachedImage(std::string const &path) {
+    std::string key;
+    FileStamp   stamp;
+    if (!Identify(path, key, stamp)) {
+        return nullptr;
+    }
+    auto &                      cache = TheCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto                        it = cache.entries.find(key);
+    if (it == cache.entries.end()) {
+        return nullptr;
+    }
+    if (!(it->second.stamp == stamp)) {
+        cache.erase(it); // The file has changed since
+        return nullptr;
+    }
+    it->second.last_used = ++cache.tick;
+    return it->second.image;
+}
+
+void AddCachedImage(std::string const &path, itk::DataObject::Pointer image, size_t const bytes) {
+    std::string key;
+    FileStamp   stamp;
+    if (!Identify(path, key, stamp)) {
+        return;
+    }
+    auto &                      cache = TheCache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto const                  existing = cache.entries.find(key);
+    if (existing != cache.entries.end()) {
+        cache.erase(existing);
+    }
+    if (bytes > cache.max_bytes) {
+        return;
+    }
+    while (cache.bytes + bytes > cache.max_bytes) {
+        auto oldest = cache.entries.begin();
+        for (auto it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+            if (it->second.last_used < oldest->second.last_used) {
+                oldest = it;
+            }
+        }
+        cache.erase(oldest);
+    }
+    cache.entries[key] = CacheEntry{stamp, image, bytes, ++cache.tick};
+    cache.bytes += bytes;
+}
+
+} // namespace QI
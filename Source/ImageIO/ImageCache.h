@@ -0,0 +1,93 @@
+/*
+ *  ImageCache.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+
+#include "itkDataObject.h"
+
+namespace QI {
+
+/*
+ *  When several commands run in one process (see qi pipeline), the same inputs are read again and
+ *  again, and the outputs of one command are read straight back by the next. The cache keeps
+ *  images that have been read or written, keyed by the canonical absolute path and the
+ *  modification time and size of the file, so an image is only served from memory if the file
+ *  has not changed since. It is off unless EnableImageCache() is called, and the oldest images
+ *  are dropped once it holds more than max_bytes.
+ *
+ *  Callers always get their own copy, as commands are free to modify the images they read.
+ */
+void EnableImageCache(size_t const max_bytes);
+bool ImageCacheEnabled();
+
+itk::DataObject::Pointer FindCachedImage(std::string const &path);
+void AddCachedImage(std::string const &path, itk::DataObject::Pointer image, size_t const bytes);
+
+/*
+ *  Deep copy of the buffered part of an image or vector image
+ */
+template <typename TImg> auto CopyImage(TImg const *img) -> typename TImg::Pointer {
+    auto copy = TImg::New();
+    copy->CopyInformation(img);
+    copy->SetBufferedRegion(img->GetBufferedRegion());
+    copy->SetRequestedRegion(img->GetBufferedRegion());
+    copy->SetNumberOfComponentsPerPixel(img->GetNumberOfComponentsPerPixel());
+    copy->Allocate();
+    auto const *container = img->GetPixelContainer();
+    std::copy_n(container->GetBufferPointer(),
+                container->Size(),
+                copy->GetPixelContainer()->GetBufferPointer());
+    return copy;
+}
+
+/*
+ *  A copy of the cached image at path, or nullptr if there is none of this type
+ */
+template <typename TImg> auto ReadCachedImage(std::string const &path) -> typename TImg::Pointer {
+    if (!ImageCacheEnabled()) {
+        return nullptr;
+    }
+    auto const cached = FindCachedImage(path);
+    if (auto const *img = dynamic_cast<TImg const *>(cached.GetPointer())) {
+        return CopyImage(img);
+    }
+    return nullptr;
+}
+
+/*
+ *  Keeps a copy of an image that has just been read from or written to path. Only images that
+ *  cover the whole of their file are kept, as anything else would not match the file when it is
+ *  read back.
+ */
+template <typename TImg> void CacheImage(TImg const *img, std::string const &path) {
+    if (!ImageCacheEnabled()) {
+        return;
+    }
+    auto const region = img->GetBufferedRegion();
+    for (unsigned int i = 0; i < TImg::ImageDimension; i++) {
+        if (region.GetIndex(i) != 0) {
+            return;
+        }
+    }
+    if (region != img->GetLargestPossibleRegion()) {
+        return;
+    }
+    auto copy = CopyImage(img);
+    AddCachedImage(path,
+                   copy.GetPointer(),
+                   copy->GetPixelContainer()->Size() * sizeof(typename TImg::InternalPixelType));
+}
+
+} // namespace QI
@@ -51,6 +51,39 @@ extern void WriteScaledImage(const itk::SmartPointer<TImg> &       ptr,
                              const std::string &                   path,
                              const bool                            verbose);
 
+/*
+ *  Partial I/O for processing images that do not fit in memory. ReadImageInformation returns an
+ *  image with the header information but no buffer. WriteImageRegion writes the buffered region
+ *  of an image into the file, which requires a format that supports streamed writing.
+ */
+template <typename TImg>
+extern auto ReadImageInformation(const std::string &path, const bool verbose) ->
+    typename TImg::Pointer;
+
+/*
+ *  Whether only part of the file at path can be read. Compressed files can not, nor can formats
+ *  that ITK always reads whole.
+ */
+bool CanStreamRead(const std::string &path);
+
+template <typename TImg>
+extern auto ReadImageRegion(const std::string &              path,
+                            const typename TImg::RegionType &region,
+                            const bool                       verbose) -> typename TImg::Pointer;
+
+/*
+ *  Reads only the given region, and returns an image that covers just that region. The region
+ *  index is kept, so the image is in the right place in space and writing it out gives a
+ *  correctly positioned subvolume.
+ */
+template <typename TImg>
+extern auto ReadImageSubregion(const std::string &              path,
+                               const typename TImg::RegionType &region,
+                               const bool                       verbose) -> typename TImg::Pointer;
+
+template <typename TImg>
+extern void WriteImageRegion(const TImg *img, const std::string &path, const bool verbose);
+
 } // namespace QI
 
 #endif // QUIT_IMAGEIO_H
\ No newline at end of file
@@ -13,25 +13,67 @@
 
 #include <string>
 
+#include "ImageCache.h"
 #include "ImageIO.h"
 #include "Log.h"
+#include "MappedNifti.h"
 #include "itkComplexToModulusImageFilter.h"
 #include "itkImageFileReader.h"
 
 namespace QI {
 
+namespace {
+/*
+ *  If the file is uncompressed NIfTI with the right datatype, the image uses the voxels directly
+ *  from a memory map of the file. Otherwise returns nullptr.
+ */
+template <typename TImg>
+auto MapImage(itk::ImageFileReader<TImg> *file, const bool verbose) -> typename TImg::Pointer {
+    using TPixel = typename TImg::PixelType;
+    if constexpr (NiftiDatatype<TPixel>() == 0) {
+        return nullptr;
+    } else {
+        auto const map = MappedNifti::Open(file->GetFileName());
+        if (!map) {
+            return nullptr;
+        }
+        file->UpdateOutputInformation();
+        auto const n = file->GetOutput()->GetLargestPossibleRegion().GetNumberOfPixels();
+        if (file->GetImageIO()->GetNumberOfComponents() != 1 || !map->holds<TPixel>(n)) {
+            return nullptr;
+        }
+        auto container = MappedImageContainer<TPixel>::New();
+        container->SetMapping(map, n);
+        auto img = TImg::New();
+        img->CopyInformation(file->GetOutput());
+        img->SetRegions(img->GetLargestPossibleRegion());
+        img->SetPixelContainer(container);
+        QI::Log(verbose, "Mapped image into memory");
+        return img;
+    }
+}
+} // namespace
+
 template <typename TImg>
 auto ReadImage(const std::string &path, const bool verbose) -> typename TImg::Pointer {
+    if (auto cached = ReadCachedImage<TImg>(path)) {
+        QI::Log(verbose, "Reading cached image: {}", path);
+        return cached;
+    }
     typedef itk::ImageFileReader<TImg> TReader;
     typename TReader::Pointer          file = TReader::New();
     file->SetFileName(path);
     QI::Log(verbose, "Reading image: {}", path);
-    file->Update();
-    typename TImg::Pointer img = file->GetOutput();
+    typename TImg::Pointer img = MapImage<TImg>(file, verbose);
     if (!img) {
-        QI::Fail("Failed to read file: {}", path);
+        file->Update();
+        img = file->GetOutput();
+        if (!img) {
+            QI::Fail("Failed to read file: {}", path);
+        }
+        img->DisconnectPipeline();
     }
-    img->DisconnectPipeline();
+    CacheImage(img.GetPointer(), path);
     return img;
 }
 
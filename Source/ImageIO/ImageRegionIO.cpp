@@ -0,0 +1,242 @@
+/*
+ *  ImageRegionIO.cpp
+ *
+ *  Copyright (c) 2019 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <string>
+#include <type_traits>
+
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIOFactory.h"
+
+#include "ImageIO.h"
+#include "Log.h"
+#include "Quantise.h"
+#include "SeriesTranspose.h"
+
+namespace QI {
+
+namespace {
+template <typename T> struct IsVectorImage : std::false_type {};
+template <typename P, unsigned int D>
+struct IsVectorImage<itk::VectorImage<P, D>> : std::true_type {};
+
+/*
+ *  Vector images are stored on disk as a series with the volumes along the last dimension
+ */
+template <typename TImg>
+using FileImage = std::conditional_t<IsVectorImage<TImg>::value,
+                                     itk::Image<typename TImg::InternalPixelType,
+                                                TImg::ImageDimension + 1>,
+                                     TImg>;
+
+template <typename TImg>
+void CopySeriesInformation(FileImage<TImg> const *series, TImg *img) {
+    constexpr unsigned int D = TImg::ImageDimension;
+
+    auto const                   series_region = series->GetLargestPossibleRegion();
+    typename TImg::RegionType    region;
+    typename TImg::SpacingType   spacing;
+    typename TImg::PointType     origin;
+    typename TImg::DirectionType direction;
+    for (unsigned int i = 0; i < D; i++) {
+        region.SetIndex(i, series_region.GetIndex(i));
+        region.SetSize(i, series_region.GetSize(i));
+        spacing[i] = series->GetSpacing()[i];
+        origin[i]  = series->GetOrigin()[i];
+        for (unsigned int j = 0; j < D; j++) {
+            direction[i][j] = series->GetDirection()[i][j];
+        }
+    }
+    img->SetLargestPossibleRegion(region);
+    img->SetSpacing(spacing);
+    img->SetOrigin(origin);
+    img->SetDirection(direction);
+    img->SetNumberOfComponentsPerPixel(series_region.GetSize(D));
+}
+
+template <typename TImg>
+auto SeriesRegion(typename TImg::RegionType const &region, size_t const nvols) ->
+    typename FileImage<TImg>::RegionType {
+    constexpr unsigned int               D = TImg::ImageDimension;
+    typename FileImage<TImg>::RegionType series_region;
+    for (unsigned int i = 0; i < D; i++) {
+        series_region.SetIndex(i, region.GetIndex(i));
+        series_region.SetSize(i, region.GetSize(i));
+    }
+    series_region.SetIndex(D, 0);
+    series_region.SetSize(D, nvols);
+    return series_region;
+}
+} // namespace
+
+template <typename TImg>
+auto ReadImageInformation(const std::string &path, const bool verbose) -> typename TImg::Pointer {
+    using TFile = FileImage<TImg>;
+    auto file   = itk::ImageFileReader<TFile>::New();
+    file->SetFileName(path);
+    QI::Log(verbose, "Reading image header: {}", path);
+    file->UpdateOutputInformation();
+    auto img = TImg::New();
+    if constexpr (IsVectorImage<TImg>::value) {
+        CopySeriesInformation<TImg>(file->GetOutput(), img);
+    } else {
+        img->CopyInformation(file->GetOutput());
+    }
+    return img;
+}
+
+bool CanStreamRead(const std::string &path) {
+    // gzip has no random access, so every region would be inflated from the start of the file
+    if (path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0) {
+        return false;
+    }
+    auto io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::ImageIOFactory::ReadMode);
+    if (!io) {
+        QI::Fail("Could not find an image format to read: {}", path);
+    }
+    return io->CanStreamRead();
+}
+
+template <typename TImg>
+auto ReadImageRegion(const std::string &              path,
+                     const typename TImg::RegionType &region,
+                     const bool                       verbose) -> typename TImg::Pointer {
+    using TFile = FileImage<TImg>;
+    auto file   = itk::ImageFileReader<TFile>::New();
+    file->SetFileName(path);
+    file->UpdateOutputInformation();
+    typename TFile::Pointer series = file->GetOutput();
+    auto const largest = series->GetLargestPossibleRegion();
+    for (unsigned int i = 0; i < TImg::ImageDimension; i++) {
+        if (region.GetIndex(i) < largest.GetIndex(i) ||
+            region.GetIndex(i) + static_cast<long>(region.GetSize(i)) >
+                largest.GetIndex(i) + static_cast<long>(largest.GetSize(i))) {
+            QI::Fail("Requested region is not entirely inside image: {}", path);
+        }
+    }
+    if constexpr (IsVectorImage<TImg>::value) {
+        auto const nvols = series->GetLargestPossibleRegion().GetSize(TImg::ImageDimension);
+        series->SetRequestedRegion(SeriesRegion<TImg>(region, nvols));
+    } else {
+        series->SetRequestedRegion(region);
+    }
+    QI::Log(verbose, "Reading image region: {}", path);
+    file->Update();
+    series->DisconnectPipeline();
+
+    if constexpr (IsVectorImage<TImg>::value) {
+        // Transpose the volumes into the vector image
+        auto img = TImg::New();
+        CopySeriesInformation<TImg>(series, img);
+        img->SetBufferedRegion(region);
+        img->SetRequestedRegion(region);
+        img->Allocate();
+        SeriesToVector(series->GetBufferPointer(),
+                       img->GetBufferPointer(),
+                       region.GetNumberOfPixels(),
+                       img->GetNumberOfComponentsPerPixel());
+        return img;
+    } else {
+        return series;
+    }
+}
+
+template <typename TImg>
+auto ReadImageSubregion(const std::string &              path,
+                        const typename TImg::RegionType &region,
+                        const bool                       verbose) -> typename TImg::Pointer {
+    auto img = ReadImageRegion<TImg>(path, region, verbose);
+    img->SetLargestPossibleRegion(region);
+    return img;
+}
+
+template <typename TImg>
+void WriteImageRegion(const TImg *img, const std::string &path, const bool verbose) {
+    using TFile = FileImage<TImg>;
+
+    typename TFile::ConstPointer series;
+    if constexpr (IsVectorImage<TImg>::value) {
+        auto volumes = ToSeries(img);
+        series       = volumes.GetPointer();
+    } else {
+        series = img;
+    }
+    // Int16 scaling depends on the whole image, so a region can only be reduced to half precision
+    if constexpr (std::is_same_v<typename TFile::PixelType, float>) {
+        if (OutPrecision() != Precision::Float) {
+            auto half = HalfImage(series.GetPointer(), path, verbose);
+            series    = half.GetPointer();
+        }
+    }
+
+    auto const         paste = series->GetBufferedRegion();
+    itk::ImageIORegion io_region(TFile::ImageDimension);
+    for (unsigned int i = 0; i < TFile::ImageDimension; i++) {
+        io_region.SetIndex(i, paste.GetIndex(i));
+        io_region.SetSize(i, paste.GetSize(i));
+    }
+    auto io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::ImageIOFactory::WriteMode);
+    if (!io) {
+        QI::Fail("Could not find an image format to write: {}", path);
+    }
+    if (!io->CanStreamWrite() && paste != series->GetLargestPossibleRegion()) {
+        QI::Fail("Writing part of an image requires a format that supports streaming, e.g. .mhd. "
+                 "Cannot write: {}",
+                 path);
+    }
+    auto file = itk::ImageFileWriter<TFile>::New();
+    file->SetFileName(path);
+    file->SetImageIO(io);
+    file->SetInput(series);
+    file->SetIORegion(io_region);
+    QI::Log(verbose, "Writing image region: {}", path);
+    file->Update();
+}
+
+template auto ReadImageInformation<VolumeF>(const std::string &path, const bool verbose) ->
+    typename VolumeF::Pointer;
+template auto ReadImageInformation<VectorVolumeF>(const std::string &path, const bool verbose) ->
+    typename VectorVolumeF::Pointer;
+template auto ReadImageInformation<VectorVolumeXF>(const std::string &path, const bool verbose) ->
+    typename VectorVolumeXF::Pointer;
+
+template auto ReadImageRegion<VolumeF>(const std::string &       path,
+                                       const VolumeF::RegionType &region,
+                                       const bool                 verbose) -> VolumeF::Pointer;
+template auto ReadImageRegion<VectorVolumeF>(const std::string &             path,
+                                             const VectorVolumeF::RegionType &region,
+                                             const bool verbose) -> VectorVolumeF::Pointer;
+template auto ReadImageRegion<VectorVolumeXF>(const std::string &              path,
+                                              const VectorVolumeXF::RegionType &region,
+                                              const bool verbose) -> VectorVolumeXF::Pointer;
+
+template auto ReadImageSubregion<VolumeF>(const std::string &       path,
+                                          const VolumeF::RegionType &region,
+                                          const bool                 verbose) -> VolumeF::Pointer;
+template auto ReadImageSubregion<VectorVolumeF>(const std::string &             path,
+                                                const VectorVolumeF::RegionType &region,
+                                                const bool verbose) -> VectorVolumeF::Pointer;
+template auto ReadImageSubregion<VectorVolumeXF>(const std::string &              path,
+                                                 const VectorVolumeXF::RegionType &region,
+                                                 const bool verbose) -> VectorVolumeXF::Pointer;
+
+template void WriteImageRegion<VolumeF>(const VolumeF *img, const std::string &path,
+                                        const bool verbose);
+template void WriteImageRegion<VolumeI>(const VolumeI *img, const std::string &path,
+                                        const bool verbose);
+template void WriteImageRegion<VectorVolumeF>(const VectorVolumeF *img, const std::string &path,
+                                              const bool verbose);
+template void WriteImageRegion<VectorVolumeI>(const VectorVolumeI *img, const std::string &path,
+                                              const bool verbose);
+template void WriteImageRegion<VectorVolumeXF>(const VectorVolumeXF *img, const std::string &path,
+                                               const bool verbose);
+
+} // namespace QI
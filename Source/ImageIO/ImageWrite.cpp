@@ -15,19 +15,25 @@
 #include "itkDivideImageFilter.h"
 #include "itkImageFileWriter.h"
 
+#include "BlockGzip.h"
+#include "ImageCache.h"
 #include "ImageIO.h"
 #include "Log.h"
+#include "Quantise.h"
 
 namespace QI {
 
 template <typename TImg>
 void WriteImage(const TImg *ptr, const std::string &path, const bool verbose) {
+    if (WriteReducedImage(ptr, path, verbose)) {
+        return;
+    }
     typedef itk::ImageFileWriter<TImg> TWriter;
     typename TWriter::Pointer          file = TWriter::New();
-    file->SetFileName(path);
     file->SetInput(ptr);
     QI::Log(verbose, "Writing image: {}", path);
-    file->Update();
+    QI::UpdateWriter(file.GetPointer(), path);
+    CacheImage(ptr, path);
 }
 
 template <typename TImg>
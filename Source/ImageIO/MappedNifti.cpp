@@ -0,0 +1,129 @@
+/*
+ *  MappedNifti.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BlockGzip.h"
+#include "Log.h"
+#include "MappedNifti.h"
+
+namespace QI {
+
+namespace {
+// Offsets of the fields we need in the 348 byte NIfTI-1 header
+constexpr size_t SizeofHdr = 0;
+constexpr size_t Datatype  = 70;
+constexpr size_t VoxOffset = 108;
+constexpr size_t SclSlope  = 112;
+constexpr size_t SclInter  = 116;
+constexpr size_t Magic     = 344;
+constexpr size_t HdrSize   = 348;
+
+template <typename T> T HeaderField(char const *header, size_t const offset) {
+    T value;
+    std::memcpy(&value, header + offset, sizeof(T));
+    return value;
+}
+
+bool EndsWith(std::string const &s, std::string const &suffix) {
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+} // namespace
+
+bool MappedNifti::ParseHeader(char const *header, size_t const length) {
+    if (length < HdrSize) {
+        return false;
+    }
+    auto const slope  = HeaderField<float>(header, SclSlope);
+    auto const inter  = HeaderField<float>(header, SclInter);
+    auto const offset = static_cast<size_t>(HeaderField<float>(header, VoxOffset));
+    if (HeaderField<int32_t>(header, SizeofHdr) != HdrSize ||
+        std::memcmp(header + Magic, "n+1", 4) != 0 || (slope != 0.f && slope != 1.f) ||
+        inter != 0.f || offset < HdrSize || offset >= length) {
+        return false;
+    }
+    m_offset   = offset;
+    m_bytes    = length - offset;
+    m_datatype = HeaderField<int16_t>(header, Datatype);
+    return true;
+}
+
+std::shared_ptr<MappedNifti> MappedNifti::Open(std::string const &path) {
+    if (IsNiftiGz(path)) {
+        std::shared_ptr<MappedNifti> nifti(new MappedNifti);
+        if (!BlockGunzip(path, nifti->m_buffer) ||
+            !nifti->ParseHeader(nifti->m_buffer.data(), nifti->m_buffer.size())) {
+            return nullptr;
+        }
+        nifti->m_base = nifti->m_buffer.data();
+        return nifti;
+    }
+    if (!EndsWith(path, ".nii")) {
+        return nullptr;
+    }
+    int const fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    char        header[HdrSize];
+    if (::fstat(fd, &st) != 0 ||
+        ::pread(fd, header, HdrSize, 0) != static_cast<ssize_t>(HdrSize)) {
+        ::close(fd);
+        return nullptr;
+    }
+    std::shared_ptr<MappedNifti> nifti(new MappedNifti);
+    if (!nifti->ParseHeader(header, st.st_size)) {
+        ::close(fd);
+        return nullptr;
+    }
+    void *map = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd); // The mapping keeps its own reference to the file
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    nifti->m_map    = map;
+    nifti->m_length = st.st_size;
+    nifti->m_base   = static_cast<char *>(map);
+    return nifti;
+}
+
+MappedNifti::~MappedNifti() {
+    if (m_map) {
+        ::munmap(m_map, m_length);
+    }
+}
+
+void SetNiftiScaling(std::string const &path, float const slope, float const inter) {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    char         header[HdrSize];
+    if (!file.read(header, HdrSize) || HeaderField<int32_t>(header, SizeofHdr) != HdrSize ||
+        std::memcmp(header + Magic, "n+1", 4) != 0) {
+        QI::Fail("Could not set the intensity scaling of {}, it is not a .nii file", path);
+    }
+    file.seekp(SclSlope);
+    file.write(reinterpret_cast<char const *>(&slope), sizeof(slope));
+    file.seekp(SclInter);
+    file.write(reinterpret_cast<char const *>(&inter), sizeof(inter));
+    if (!file) {
+        QI::Fail("Failed to write the intensity scaling of {}", path);
+    }
+}
+
+} // namespace QI
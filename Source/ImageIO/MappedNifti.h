@@ -0,0 +1,121 @@
+/*
+ *  MappedNifti.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "itkImportImageContainer.h"
+
+namespace QI {
+
+/*
+ *  Uncompressed single-file NIfTI (.nii) stores the voxels as one contiguous block after the
+ *  header, so they can be mapped into memory instead of copied into a new buffer. Pages are then
+ *  only read from disk when they are touched. The mapping is private, so writing to the voxels
+ *  makes a copy of the page and never changes the file.
+ *
+ *  Block-compressed .nii.gz files written by QUIT (see BlockGzip.h) are instead inflated in
+ *  parallel into a buffer, which the image then uses in the same way.
+ *
+ *  Open() returns nullptr for anything it cannot use without conversion, i.e. ordinary gzip or
+ *  two-file NIfTI, NIfTI-2, byte-swapped files or intensity scaling. The caller should then fall
+ *  back to the ITK reader.
+ */
+class MappedNifti {
+  public:
+    static std::shared_ptr<MappedNifti> Open(std::string const &path);
+    ~MappedNifti();
+    MappedNifti(MappedNifti const &) = delete;
+    void operator=(MappedNifti const &) = delete;
+
+    short  datatype() const { return m_datatype; }
+    size_t bytes() const { return m_bytes; } // Size of the voxel data
+    void * data() const { return m_base + m_offset; }
+
+    template <typename T> bool holds(size_t const n) const;
+
+  private:
+    MappedNifti() = default;
+    bool ParseHeader(char const *header, size_t const length);
+
+    void *            m_map      = nullptr; // The mapped file,
+    std::vector<char> m_buffer;             // or the inflated file
+    size_t            m_length   = 0;
+    char *            m_base     = nullptr;
+    size_t            m_offset   = 0;
+    size_t            m_bytes    = 0;
+    short             m_datatype = 0;
+};
+
+/*
+ *  NIfTI datatype codes for the pixel types QUIT reads. Complex types are left out because ITK
+ *  treats them as two components.
+ */
+template <typename T> constexpr short NiftiDatatype() {
+    if constexpr (std::is_same_v<T, unsigned char>) {
+        return 2;
+    } else if constexpr (std::is_same_v<T, int>) {
+        return 8;
+    } else if constexpr (std::is_same_v<T, float>) {
+        return 16;
+    } else if constexpr (std::is_same_v<T, double>) {
+        return 64;
+    } else {
+        return 0;
+    }
+}
+
+/*
+ *  True if the file contains at least n voxels of type T
+ */
+template <typename T> bool MappedNifti::holds(size_t const n) const {
+    return NiftiDatatype<T>() != 0 && m_datatype == NiftiDatatype<T>() && n * sizeof(T) <= m_bytes;
+}
+
+/*
+ *  Sets scl_slope and scl_inter in the header of an uncompressed .nii file, which ITK always
+ *  writes as 1 and 0
+ */
+void SetNiftiScaling(std::string const &path, float const slope, float const inter);
+
+/*
+ *  Pixel container that uses the mapped voxels in place. It keeps the mapping alive for as long as
+ *  the image does.
+ */
+template <typename T>
+class MappedImageContainer : public itk::ImportImageContainer<itk::SizeValueType, T> {
+  public:
+    using Self         = MappedImageContainer;
+    using Superclass   = itk::ImportImageContainer<itk::SizeValueType, T>;
+    using Pointer      = itk::SmartPointer<Self>;
+    using ConstPointer = itk::SmartPointer<const Self>;
+    itkNewMacro(Self);
+    itkTypeMacro(MappedImageContainer, ImportImageContainer);
+
+    void SetMapping(std::shared_ptr<MappedNifti> const &map, itk::SizeValueType const n) {
+        m_map = map;
+        this->SetImportPointer(static_cast<T *>(map->data()), n, false);
+    }
+
+  protected:
+    MappedImageContainer()           = default;
+    ~MappedImageContainer() override = default;
+
+  private:
+    std::shared_ptr<MappedNifti> m_map;
+};
+
+} // namespace QI
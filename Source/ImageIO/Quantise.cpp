@@ -0,0 +1,146 @@
+/*
+ *  Quantise.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "BlockGzip.h"
+#include "Quantise.h"
+
+namespace QI {
+
+namespace {
+constexpr uint32_t ExponentMask = 0x7f800000;
+constexpr int      DroppedBits  = 13; // float32 has a 24-bit significand, half-float has 11
+
+/*
+ *  Round to nearest, ties to even, on the bits of the float. A carry out of the significand
+ *  correctly moves on to the next exponent.
+ */
+float RoundFloatToHalf(float const f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    if ((bits & ExponentMask) == ExponentMask) {
+        return f; // Inf or NaN
+    }
+    uint32_t const dropped = (1u << DroppedBits) - 1;
+    uint32_t const rounded = (bits + (dropped >> 1) + ((bits >> DroppedBits) & 1)) & ~dropped;
+    if ((rounded & ExponentMask) == ExponentMask) {
+        return f; // Rounding up would overflow to Inf
+    }
+    float out;
+    std::memcpy(&out, &rounded, sizeof(out));
+    return out;
+}
+
+struct ErrorAccumulator {
+    double max = 0, sum_sq = 0;
+    size_t n   = 0;
+
+    void add(double const original, double const written) {
+        double const diff = std::abs(original - written);
+        max               = std::max(max, diff);
+        sum_sq += diff * diff;
+        n++;
+    }
+
+    QuantisationError result(size_t const nonfinite) const {
+        return {max, n > 0 ? std::sqrt(sum_sq / n) : 0., nonfinite};
+    }
+};
+} // namespace
+
+template <typename T> QuantisationError RoundToHalf(T const *in, float *out, size_t const n) {
+    ErrorAccumulator error;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = RoundFloatToHalf(static_cast<float>(in[i]));
+        if (std::isfinite(in[i])) {
+            error.add(in[i], out[i]);
+        }
+    }
+    return error.result(0);
+}
+
+template <typename T>
+QuantisationError
+ScaleToInt16(T const *in, int16_t *out, size_t const n, float &slope, float &inter) {
+    double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+    for (size_t i = 0; i < n; i++) {
+        if (std::isfinite(in[i])) {
+            lo = std::min<double>(lo, in[i]);
+            hi = std::max<double>(hi, in[i]);
+        }
+    }
+    if (!(lo <= hi)) {
+        lo = hi = 0; // No finite voxels
+    }
+    constexpr double levels = std::numeric_limits<uint16_t>::max();
+    slope                   = static_cast<float>((hi - lo) / levels);
+    if (!(slope > 0.f)) {
+        slope = 1.f; // Constant image, all voxels are written as the intercept
+    }
+    inter = static_cast<float>(lo - std::numeric_limits<int16_t>::min() * double{slope});
+
+    auto const quantise = [&](double const x) {
+        double const q = std::round((x - inter) / slope);
+        return static_cast<int16_t>(std::clamp<double>(
+            q, std::numeric_limits<int16_t>::min(), std::numeric_limits<int16_t>::max()));
+    };
+    int16_t const    zero = quantise(0);
+    ErrorAccumulator error;
+    size_t           nonfinite = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (std::isfinite(in[i])) {
+            out[i] = quantise(in[i]);
+            error.add(in[i], out[i] * static_cast<double>(slope) + inter);
+        } else {
+            out[i] = zero;
+            nonfinite++;
+        }
+    }
+    return error.result(nonfinite);
+}
+
+void LogQuantisation(QuantisationError const &error,
+                     std::string const &      precision,
+                     std::string const &      path,
+                     bool const               verbose) {
+    QI::Log(verbose,
+            "Quantised {} to {}, max error {:.3g} RMS error {:.3g}",
+            path,
+            precision,
+            error.max,
+            error.rms);
+    if (error.nonfinite > 0) {
+        QI::Warn("{} voxels in {} were not finite and have been written as the closest {} "
+                 "value to 0",
+                 error.nonfinite,
+                 path,
+                 precision);
+    }
+}
+
+bool IsNifti(std::string const &path) {
+    std::string const ext = ".nii";
+    return IsNiftiGz(path) || (path.size() >= ext.size() &&
+                               path.compare(path.size() - ext.size(), ext.size(), ext) == 0);
+}
+
+template QuantisationError RoundToHalf<float>(float const *in, float *out, size_t const n);
+template QuantisationError RoundToHalf<double>(double const *in, float *out, size_t const n);
+template QuantisationError
+ScaleToInt16<float>(float const *in, int16_t *out, size_t const n, float &slope, float &inter);
+template QuantisationError
+ScaleToInt16<double>(double const *in, int16_t *out, size_t const n, float &slope, float &inter);
+
+} // namespace QI
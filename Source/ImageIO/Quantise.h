@@ -0,0 +1,124 @@
+/*
+ *  Quantise.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+#include "itkImage.h"
+#include "itkImageFileWriter.h"
+
+#include "BlockGzip.h"
+#include "Log.h"
+#include "MappedNifti.h"
+#include "Util.h"
+
+namespace QI {
+
+/*
+ *  Reduced precision output, see OutPrecision() in Util.h. NIfTI has no half-float datatype, so
+ *  Half rounds each value to the nearest value with an 11-bit significand but keeps float32
+ *  storage and range. The zeroed low bits make .nii.gz files much smaller. Int16 uses the full
+ *  int16 range between the minimum and maximum of the image, and records the scaling in the
+ *  header. Both report how far the written values are from the originals.
+ */
+struct QuantisationError {
+    double max       = 0;
+    double rms       = 0;
+    size_t nonfinite = 0; // Int16 only, these voxels are written as the closest value to 0
+};
+
+template <typename T> QuantisationError RoundToHalf(T const *in, float *out, size_t const n);
+
+template <typename T>
+QuantisationError
+ScaleToInt16(T const *in, int16_t *out, size_t const n, float &slope, float &inter);
+
+void LogQuantisation(QuantisationError const &error,
+                     std::string const &      precision,
+                     std::string const &      path,
+                     bool const               verbose);
+
+bool IsNifti(std::string const &path); // True for .nii and .nii.gz, which can hold a scaling
+
+/*
+ *  New image of a different pixel type with the same regions and geometry
+ */
+template <typename TOut, typename TImg>
+auto NewImageLike(TImg const *img) -> typename itk::Image<TOut, TImg::ImageDimension>::Pointer {
+    auto out = itk::Image<TOut, TImg::ImageDimension>::New();
+    out->CopyInformation(img);
+    out->SetBufferedRegion(img->GetBufferedRegion());
+    out->SetRequestedRegion(img->GetBufferedRegion());
+    out->Allocate();
+    return out;
+}
+
+/*
+ *  Copy of a real image rounded to half precision, for writers that cannot use WriteReducedImage
+ */
+template <typename TImg>
+auto HalfImage(TImg const *img, std::string const &path, bool const verbose) ->
+    typename itk::Image<float, TImg::ImageDimension>::Pointer {
+    auto       out   = NewImageLike<float>(img);
+    auto const error = RoundToHalf(img->GetBufferPointer(),
+                                   out->GetBufferPointer(),
+                                   img->GetBufferedRegion().GetNumberOfPixels());
+    LogQuantisation(error, "half", path, verbose);
+    return out;
+}
+
+/*
+ *  Writes a real image at the precision from OutPrecision(). Returns false if nothing was written
+ *  and the image should be written as normal, i.e. for Float or non-real pixel types.
+ */
+template <typename TImg>
+bool WriteReducedImage(TImg const *img, std::string const &path, bool const verbose) {
+    if constexpr (!std::is_floating_point_v<typename TImg::PixelType>) {
+        return false;
+    } else {
+        auto const precision = OutPrecision();
+        if (precision == Precision::Float) {
+            return false;
+        }
+        if (precision == Precision::Int16) {
+            if (IsNifti(path)) {
+                auto       scaled = NewImageLike<int16_t>(img);
+                float      slope, inter;
+                auto const error = ScaleToInt16(img->GetBufferPointer(),
+                                                scaled->GetBufferPointer(),
+                                                img->GetBufferedRegion().GetNumberOfPixels(),
+                                                slope,
+                                                inter);
+                auto file = itk::ImageFileWriter<itk::Image<int16_t, TImg::ImageDimension>>::New();
+                file->SetInput(scaled);
+                QI::Log(verbose, "Writing int16 image: {}", path);
+                UpdateWriter(file.GetPointer(), path, [=](std::string const &written) {
+                    SetNiftiScaling(written, slope, inter);
+                });
+                LogQuantisation(error, "int16", path, verbose);
+                return true;
+            }
+            QI::Warn("Int16 output needs NIfTI for the scaling, writing {} as half precision",
+                     path);
+        }
+        auto file = itk::ImageFileWriter<itk::Image<float, TImg::ImageDimension>>::New();
+        file->SetInput(HalfImage(img, path, verbose));
+        QI::Log(verbose, "Writing half precision image: {}", path);
+        UpdateWriter(file.GetPointer(), path);
+        return true;
+    }
+}
+
+} // namespace QI
@@ -0,0 +1,127 @@
+/*
+ *  SeriesTranspose.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include "itkImage.h"
+#include "itkMultiThreaderBase.h"
+
+namespace QI {
+
+/*
+ *  Vector images are stored on disk as a series, i.e. one whole volume after another, while a
+ *  VectorImage keeps all the volumes of a voxel together. Converting between the two is a
+ *  transpose of an nvols x nvox matrix. A naive loop touches a new cache line for every element
+ *  on one side, so the copy is done in small tiles of voxels and volumes that stay in cache.
+ *  Blocks of voxels are shared between the threads.
+ */
+namespace Transpose {
+constexpr size_t VoxelBlock  = 4096; // Voxels per work item
+constexpr size_t VoxelTile   = 64;
+constexpr size_t VolumesTile = 16;
+
+template <typename Func> void ForEachTile(size_t const nvox, size_t const nvols, Func &&copy) {
+    auto const nblocks = (nvox + VoxelBlock - 1) / VoxelBlock;
+    itk::MultiThreaderBase::New()->ParallelizeArray(
+        0,
+        nblocks,
+        [&](itk::SizeValueType const b) {
+            auto const block_end = std::min((b + 1) * VoxelBlock, nvox);
+            for (size_t v0 = b * VoxelBlock; v0 < block_end; v0 += VoxelTile) {
+                auto const v1 = std::min(v0 + VoxelTile, block_end);
+                for (size_t t0 = 0; t0 < nvols; t0 += VolumesTile) {
+                    auto const t1 = std::min(t0 + VolumesTile, nvols);
+                    copy(v0, v1, t0, t1);
+                }
+            }
+        },
+        nullptr);
+}
+} // namespace Transpose
+
+template <typename T>
+void SeriesToVector(T const *series, T *vec, size_t const nvox, size_t const nvols) {
+    Transpose::ForEachTile(nvox, nvols, [=](size_t v0, size_t v1, size_t t0, size_t t1) {
+        for (size_t t = t0; t < t1; t++) {
+            T const *in = series + t * nvox;
+            for (size_t v = v0; v < v1; v++) {
+                vec[v * nvols + t] = in[v];
+            }
+        }
+    });
+}
+
+template <typename T>
+void VectorToSeries(T const *vec, T *series, size_t const nvox, size_t const nvols) {
+    Transpose::ForEachTile(nvox, nvols, [=](size_t v0, size_t v1, size_t t0, size_t t1) {
+        for (size_t t = t0; t < t1; t++) {
+            T *out = series + t * nvox;
+            for (size_t v = v0; v < v1; v++) {
+                out[v] = vec[v * nvols + t];
+            }
+        }
+    });
+}
+
+/*
+ *  Copies the buffered part of a vector image into a series with one more dimension, ready to be
+ *  written. The largest possible region, including its index, is kept so that a subregion or slab
+ *  ends up in the right place in the file.
+ */
+template <typename TVImg>
+auto ToSeries(TVImg const *img) ->
+    typename itk::Image<typename TVImg::InternalPixelType, TVImg::ImageDimension + 1>::Pointer {
+    constexpr unsigned int D = TVImg::ImageDimension;
+    using TSeries            = itk::Image<typename TVImg::InternalPixelType, D + 1>;
+
+    auto const nvols    = img->GetNumberOfComponentsPerPixel();
+    auto const buffered = img->GetBufferedRegion();
+    auto const largest  = img->GetLargestPossibleRegion();
+    typename TSeries::RegionType    series_buffered, series_largest;
+    typename TSeries::SpacingType   spacing;
+    typename TSeries::PointType     origin;
+    typename TSeries::DirectionType direction;
+    spacing.Fill(1);
+    origin.Fill(0);
+    direction.SetIdentity();
+    for (unsigned int i = 0; i < D; i++) {
+        series_buffered.SetIndex(i, buffered.GetIndex(i));
+        series_buffered.SetSize(i, buffered.GetSize(i));
+        series_largest.SetIndex(i, largest.GetIndex(i));
+        series_largest.SetSize(i, largest.GetSize(i));
+        spacing[i] = img->GetSpacing()[i];
+        origin[i]  = img->GetOrigin()[i];
+        for (unsigned int j = 0; j < D; j++) {
+            direction[i][j] = img->GetDirection()[i][j];
+        }
+    }
+    series_buffered.SetIndex(D, 0);
+    series_buffered.SetSize(D, nvols);
+    series_largest.SetIndex(D, 0);
+    series_largest.SetSize(D, nvols);
+
+    auto series = TSeries::New();
+    series->SetLargestPossibleRegion(series_largest);
+    series->SetBufferedRegion(series_buffered);
+    series->SetRequestedRegion(series_buffered);
+    series->SetSpacing(spacing);
+    series->SetOrigin(origin);
+    series->SetDirection(direction);
+    series->Allocate();
+    VectorToSeries(
+        img->GetBufferPointer(), series->GetBufferPointer(), buffered.GetNumberOfPixels(), nvols);
+    return series;
+}
+
+} // namespace QI
@@ -11,9 +11,11 @@
 
 #ifndef QUIT_IMAGEIO_H
 
+#include "ImageCache.h"
 #include "ImageIO.h"
-#include "ImageToVectorFilter.h"
 #include "Log.h"
+#include "MappedNifti.h"
+#include "SeriesTranspose.h"
 #include "itkImageFileReader.h"
 #include <string>
 
@@ -22,25 +24,63 @@ namespace QI {
 template <typename TVectorImg>
 auto ReadImage(const std::string &path, const bool verbose) -> typename TVectorImg::Pointer {
 
-    using TPixel    = typename TVectorImg::InternalPixelType;
-    using TSeries   = itk::Image<TPixel, 4>;
-    using TReader   = itk::ImageFileReader<TSeries>;
-    using TToVector = itk::ImageToVectorFilter<TSeries>;
+    using TPixel  = typename TVectorImg::InternalPixelType;
+    using TSeries = itk::Image<TPixel, 4>;
+    using TReader = itk::ImageFileReader<TSeries>;
 
+    if (auto cached = ReadCachedImage<TVectorImg>(path)) {
+        QI::Log(verbose, "Reading cached image: {}", path);
+        return cached;
+    }
     auto file = TReader::New();
     file->SetFileName(path);
     QI::Log(verbose, "Reading image: {}", path);
-    file->Update();
-
-    auto convert = TToVector::New();
-    convert->SetInput(file->GetOutput());
-    QI::Log(verbose, "Converting to vector image");
-    convert->Update();
-    typename TVectorImg::Pointer vols = convert->GetOutput();
-    if (!vols) {
-        QI::Fail("Failed to read image: {}", path);
+    file->UpdateOutputInformation();
+    typename TSeries::Pointer series = file->GetOutput();
+
+    auto const                         series_region = series->GetLargestPossibleRegion();
+    auto const                         nvols         = series_region.GetSize()[3];
+    auto                               vols          = TVectorImg::New();
+    typename TVectorImg::RegionType    region;
+    typename TVectorImg::SpacingType   spacing;
+    typename TVectorImg::PointType     origin;
+    typename TVectorImg::DirectionType direction;
+    for (size_t i = 0; i < 3; i++) {
+        region.SetIndex(i, series_region.GetIndex()[i]);
+        region.SetSize(i, series_region.GetSize()[i]);
+        spacing[i] = series->GetSpacing()[i];
+        origin[i]  = series->GetOrigin()[i];
+        for (size_t j = 0; j < 3; j++) {
+            direction[i][j] = series->GetDirection()[i][j];
+        }
+    }
+    vols->SetRegions(region);
+    vols->SetSpacing(spacing);
+    vols->SetOrigin(origin);
+    vols->SetDirection(direction);
+    vols->SetNumberOfComponentsPerPixel(nvols);
+    vols->Allocate();
+
+    // Uncompressed NIfTI can be transposed straight from the file, skipping the 4D buffer
+    auto const nvox = region.GetNumberOfPixels();
+    auto const map  = MappedNifti::Open(path);
+    if (map && file->GetImageIO()->GetNumberOfComponents() == 1 &&
+        map->holds<TPixel>(nvox * nvols)) {
+        QI::Log(verbose, "Converting mapped image to vector image");
+        SeriesToVector(static_cast<TPixel const *>(map->data()),
+                       vols->GetBufferPointer(),
+                       nvox,
+                       nvols);
+    } else {
+        file->Update();
+        if (!series->GetBufferPointer()) {
+            QI::Fail("Failed to read image: {}", path);
+        }
+        QI::Log(verbose, "Converting to vector image");
+        SeriesToVector(series->GetBufferPointer(), vols->GetBufferPointer(), nvox, nvols);
+        series->ReleaseData(); // Do not hold two copies while the reader goes out of scope
     }
-    vols->DisconnectPipeline();
+    CacheImage(vols.GetPointer(), path);
     return vols;
 }
 
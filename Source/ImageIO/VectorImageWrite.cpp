@@ -15,27 +15,29 @@
 #include "itkDivideImageFilter.h"
 #include "itkImageFileWriter.h"
 
-#include "VectorToImageFilter.h"
-
+#include "BlockGzip.h"
+#include "ImageCache.h"
 #include "ImageIO.h"
 #include "Log.h"
+#include "Quantise.h"
+#include "SeriesTranspose.h"
 
 namespace QI {
 
 template <typename TVImg>
 void WriteImage(const TVImg *img, const std::string &path, const bool verbose) {
-    using TToSeries = itk::VectorToImageFilter<TVImg>;
-    using TWriter   = itk::ImageFileWriter<typename TToSeries::TOutput>;
-
-    typename TToSeries::Pointer convert = TToSeries::New();
-    convert->SetInput(img);
-    convert->Update();
+    using TSeries = itk::Image<typename TVImg::InternalPixelType, TVImg::ImageDimension + 1>;
+    using TWriter = itk::ImageFileWriter<TSeries>;
 
+    auto series = ToSeries(img);
+    if (WriteReducedImage(series.GetPointer(), path, verbose)) {
+        return;
+    }
     typename TWriter::Pointer file = TWriter::New();
-    file->SetFileName(path);
-    file->SetInput(convert->GetOutput());
+    file->SetInput(series);
     QI::Log(verbose, "Writing image: {}", path);
-    file->Update();
+    QI::UpdateWriter(file.GetPointer(), path);
+    CacheImage(img, path);
 }
 
 template <typename TVImg>
@@ -45,25 +47,23 @@ void WriteImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path, co
 
 template <typename TVImg>
 void WriteMagnitudeImage(const TVImg *img, const std::string &path, const bool verbose) {
-    using TToSeries   = itk::VectorToImageFilter<TVImg>;
     using TPixel      = typename TVImg::InternalPixelType;
     using TReal       = typename TPixel::value_type;
     using TSeries     = itk::Image<TPixel, 4>;
     using TRealSeries = itk::Image<TReal, 4>;
 
-    auto convert = TToSeries::New();
-    convert->SetInput(img);
-
     auto mag = itk::ComplexToModulusImageFilter<TSeries, TRealSeries>::New();
-    mag->SetInput(convert->GetOutput());
+    mag->SetInput(ToSeries(img));
     mag->Update();
+    if (WriteReducedImage(mag->GetOutput(), path, verbose)) {
+        return;
+    }
 
     using TWriter = itk::ImageFileWriter<TRealSeries>;
     auto file     = TWriter::New();
-    file->SetFileName(path);
     file->SetInput(mag->GetOutput());
     QI::Log(verbose, "Writing magnitude image: {}", path);
-    file->Update();
+    QI::UpdateWriter(file.GetPointer(), path);
 }
 
 template <typename TVImg>
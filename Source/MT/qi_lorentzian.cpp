@@ -182,6 +182,7 @@ template <int N> void Process() {
         LFit fit{model};
         auto fit_filter =
             QI::ModelFitFilter<LFit>::New(&fit, verbose, covar, resids, subregion.Get());
+        QI_FIT_FILTER_ARGS(fit_filter);
         fit_filter->ReadInputs({input_path.Get()}, {}, mask.Get());
         fit_filter->Update();
         fit_filter->WriteOutputs(prefix.Get() + "LTZ_");
@@ -176,6 +176,7 @@ int qmt_main(int argc, char **argv) {
 
         auto fit_filter = QI::ModelFitFilter<RamaniFitFunction>::New(
             &fit, verbose, covar, resids, subregion.Get());
+        QI_FIT_FILTER_ARGS(fit_filter);
         fit_filter->ReadInputs({mtsat_path.Get()}, {f0.Get(), B1.Get(), T1.Get()}, mask.Get());
         fit_filter->Update();
         fit_filter->WriteOutputs(prefix.Get() + "QMT_");
@@ -247,6 +247,7 @@ int ssfp_emt_main(int argc, char **argv) {
         EMTFit fit{model};
         auto   fit_filter =
             QI::ModelFitFilter<EMTFit>::New(&fit, verbose, covar, resids, subregion.Get());
+        QI_FIT_FILTER_ARGS(fit_filter);
         fit_filter->ReadInputs(
             {G_path.Get(), a_path.Get(), b_path.Get()}, {B1.Get(), ""}, mask.Get());
         fit_filter->SetFixed(1, T2_f_calc);
@@ -178,6 +178,7 @@ int ase_oef_main(int argc, char **argv) {
         auto process = [&](auto fit_func) {
             auto fit_filter = QI::ModelFitFilter<decltype(fit_func)>::New(
                 &fit_func, verbose, covar, resids, subregion.Get());
+            QI_FIT_FILTER_ARGS(fit_filter);
             fit_filter->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
             fit_filter->Update();
             fit_filter->WriteOutputs(prefix.Get() + "ASE_");
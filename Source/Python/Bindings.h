@@ -0,0 +1,255 @@
+/*
+ *  Bindings.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+
+#include "itkMultiThreaderBase.h"
+
+#include "FitFunction.h"
+#include "JSON.h"
+#include "Macro.h"
+
+namespace QI {
+namespace Python {
+
+namespace py = pybind11;
+
+/*
+ *  NumPy arrays are passed as voxels x volumes in C order, which is exactly the layout of a
+ *  row-major Eigen matrix, so the data is mapped rather than copied. Arrays of another type or
+ *  layout are converted by pybind11 on the way in.
+ */
+using Array    = py::array_t<double, py::array::c_style | py::array::forcecast>;
+using RowBlock = Eigen::Array<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+using ConstMap = Eigen::Map<RowBlock const>;
+using Map      = Eigen::Map<RowBlock>;
+
+inline ConstMap MapVoxels(Array const &a, std::string const &name) {
+    if (a.ndim() == 1) {
+        return ConstMap(a.data(), 1, a.shape(0));
+    } else if (a.ndim() == 2) {
+        return ConstMap(a.data(), a.shape(0), a.shape(1));
+    }
+    throw py::value_error(name + " must have one or two dimensions (voxels x volumes)");
+}
+
+inline Map MapOutput(Array &a) { return Map(a.mutable_data(), a.shape(0), a.shape(1)); }
+
+/*
+ *  Parameter names as a list of strings
+ */
+template <typename TNames> std::vector<std::string> Names(TNames const &names) {
+    return {names.begin(), names.end()};
+}
+
+/*
+ *  Models without fixed parameters, such as MUPAB1Model, do not declare fixed_names or
+ *  fixed_defaults
+ */
+template <typename ModelType> std::vector<std::string> FixedNames(ModelType const &model) {
+    if constexpr (ModelType::NF > 0) {
+        return Names(model.fixed_names);
+    } else {
+        return {};
+    }
+}
+
+template <typename ModelType>
+typename ModelType::FixedArray FixedDefaults(ModelType const &model) {
+    if constexpr (ModelType::NF > 0) {
+        return model.fixed_defaults;
+    } else {
+        return {};
+    }
+}
+
+/*
+ *  Python only has json.dumps, so sequences arrive as JSON text and go through the same
+ *  from_json() as the command line tools
+ */
+template <typename Sequence> Sequence SequenceFromPython(py::object const &s) {
+    auto const        dumps = py::module::import("json").attr("dumps");
+    std::string const text  = py::isinstance<py::str>(s) ? s.cast<std::string>() :
+                                                          dumps(s).cast<std::string>();
+    return json::parse(text).get<Sequence>();
+}
+
+/*
+ *  Signals for each row of the varying and fixed parameter arrays. A missing fixed array uses
+ *  the model defaults.
+ */
+template <typename ModelType>
+Array Signal(ModelType const &model, Array const &varying_in, py::object const &fixed_in) {
+    auto const varying = MapVoxels(varying_in, "varying");
+    if (varying.cols() != ModelType::NV) {
+        throw py::value_error(fmt::format("Expected {} varying parameters", ModelType::NV));
+    }
+    Array const fixed_arr = fixed_in.is_none() ? Array() : fixed_in.cast<Array>();
+    RowBlock    fixed     = FixedDefaults(model).transpose().replicate(varying.rows(), 1);
+    if (!fixed_in.is_none()) {
+        fixed = MapVoxels(fixed_arr, "fixed");
+        if (fixed.cols() != ModelType::NF || fixed.rows() != varying.rows()) {
+            throw py::value_error(
+                fmt::format("Expected {} fixed parameters for each voxel", ModelType::NF));
+        }
+    }
+    Array out({static_cast<long>(varying.rows()), static_cast<long>(model.input_size(0))});
+    auto  signals = MapOutput(out);
+    {
+        py::gil_scoped_release release;
+        for (Eigen::Index v = 0; v < varying.rows(); v++) {
+            typename ModelType::VaryingArray const p = varying.row(v).transpose();
+            typename ModelType::FixedArray const   f = fixed.row(v).transpose();
+            signals.row(v)                           = model.signal(p, f).transpose();
+        }
+    }
+    return out;
+}
+
+/*
+ *  Runs a fit function over every row of data, split across threads in chunks as
+ *  ModelFitFilter does, with the GIL released. fixed is an optional dict from fixed parameter
+ *  name to an array with one value per voxel. Returns a dict of the varying parameters, rmse and
+ *  iterations, each with one value per voxel, written straight into new NumPy arrays.
+ */
+template <typename FitType>
+py::dict FitVoxels(FitType const &fit, Array const &data_in, py::object const &fixed_in) {
+    using ModelType = typename FitType::ModelType;
+    static_assert(ModelType::NI == 1, "Only single input models are supported so far");
+    static_assert(!FitType::Blocked && !FitType::Indexed, "Blocked fits are not supported");
+
+    auto const         data = MapVoxels(data_in, "data");
+    Eigen::Index const nv   = data.rows();
+    if (data.cols() != fit.input_size(0)) {
+        throw py::value_error(fmt::format(
+            "Data has {} volumes but the sequence has {}", data.cols(), fit.input_size(0)));
+    }
+    auto const                  fixed_names    = FixedNames(fit.model);
+    auto const                  fixed_defaults = FixedDefaults(fit.model);
+    std::vector<Array>          fixed_arrays(ModelType::NF);
+    std::vector<double const *> fixed_ptrs(ModelType::NF, nullptr);
+    if (!fixed_in.is_none()) {
+        auto const fixed_dict = fixed_in.cast<py::dict>();
+        for (int f = 0; f < ModelType::NF; f++) {
+            auto const &name = fixed_names[f];
+            if (fixed_dict.contains(name)) {
+                fixed_arrays[f] = fixed_dict[name.c_str()].template cast<Array>();
+                if (fixed_arrays[f].size() != nv) {
+                    throw py::value_error(name + " must have one value per voxel");
+                }
+                fixed_ptrs[f] = fixed_arrays[f].data();
+            }
+        }
+    }
+
+    std::vector<Array>    varying_arrays;
+    std::vector<double *> varying_ptrs;
+    for (int p = 0; p < ModelType::NV; p++) {
+        varying_arrays.emplace_back(nv);
+        varying_ptrs.push_back(varying_arrays.back().mutable_data());
+    }
+    Array                     rmse_array(nv);
+    py::array_t<int>          iterations_array(nv);
+    double *const             rmse       = rmse_array.mutable_data();
+    int *const                iterations = iterations_array.mutable_data();
+    std::atomic<Eigen::Index> failures{0};
+    InvalidateFitContexts();
+    {
+        py::gil_scoped_release    release;
+        Eigen::Index const        chunk = 1024;
+        std::atomic<Eigen::Index> cursor{0};
+        auto const                threader = itk::MultiThreaderBase::New();
+        threader->ParallelizeArray(
+            0,
+            threader->GetNumberOfWorkUnits(),
+            [&](itk::SizeValueType) {
+                auto const get_fixed = [&](Eigen::Index const v, int const f) {
+                    return fixed_ptrs[f] ? fixed_ptrs[f][v] : fixed_defaults[f];
+                };
+                Eigen::Index start;
+                if constexpr (HasFitBatch<FitType>::value) {
+                    FitBatch<ModelType> batch(fit, chunk, false);
+                    while ((start = cursor.fetch_add(chunk)) < nv) {
+                        batch.count                          = std::min(chunk, nv - start);
+                        batch.inputs[0].topRows(batch.count) = data.middleRows(start, batch.count);
+                        for (Eigen::Index v = 0; v < batch.capacity(); v++) {
+                            // Pad the remainder of the batch with copies of the last voxel
+                            Eigen::Index const src = start + std::min(v, batch.count - 1);
+                            if (v >= batch.count) {
+                                batch.inputs[0].row(v) = data.row(src);
+                            }
+                            for (int f = 0; f < ModelType::NF; f++) {
+                                batch.fixed(v, f) = get_fixed(src, f);
+                            }
+                        }
+                        if (!fit.fit_batch(batch).success) {
+                            failures += batch.count;
+                        }
+                        for (Eigen::Index v = 0; v < batch.count; v++) {
+                            for (int p = 0; p < ModelType::NV; p++) {
+                                varying_ptrs[p][start + v] = batch.varying(v, p);
+                            }
+                            rmse[start + v]       = batch.rmse[v];
+                            iterations[start + v] = batch.flags[v];
+                        }
+                    }
+                } else {
+                    std::vector<Eigen::ArrayXd>      inputs(1), residuals;
+                    typename ModelType::FixedArray   fixed;
+                    typename ModelType::VaryingArray varying;
+                    while ((start = cursor.fetch_add(chunk)) < nv) {
+                        Eigen::Index const end = std::min(start + chunk, nv);
+                        for (Eigen::Index v = start; v < end; v++) {
+                            inputs[0] = data.row(v).transpose();
+                            for (int f = 0; f < ModelType::NF; f++) {
+                                fixed[f] = get_fixed(v, f);
+                            }
+                            typename FitType::FlagType flag{};
+                            varying.setZero();
+                            if (!fit.fit(inputs, fixed, varying, nullptr, rmse[v], residuals, flag)
+                                     .success) {
+                                failures++;
+                            }
+                            iterations[v] = static_cast<int>(flag);
+                            for (int p = 0; p < ModelType::NV; p++) {
+                                varying_ptrs[p][v] = varying[p];
+                            }
+                        }
+                    }
+                }
+            },
+            nullptr);
+    }
+    if (failures > 0) {
+        PyErr_WarnEx(PyExc_RuntimeWarning,
+                     fmt::format("Fit failed for {} of {} voxels", failures.load(), nv).c_str(),
+                     1);
+    }
+
+    py::dict result;
+    for (int p = 0; p < ModelType::NV; p++) {
+        result[fit.model.varying_names[p].c_str()] = varying_arrays[p];
+    }
+    result["rmse"]       = rmse_array;
+    result["iterations"] = iterations_array;
+    return result;
+}
+
+} // namespace Python
+} // namespace QI
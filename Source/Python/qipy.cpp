@@ -0,0 +1,113 @@
+/*
+ *  qipy.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <pybind11/stl.h>
+
+#include "Bindings.h"
+#include "DESPOT1.h"
+#include "FitScaledNumeric.h"
+#include "mupa_model_b1.h"
+
+namespace py = pybind11;
+using QI::Python::Array;
+
+namespace {
+/*
+ *  Models only hold a reference to their sequence, so the Python object owns both
+ */
+struct PyDESPOT1 {
+    QI::SPGRSequence sequence;
+    DESPOT1          model;
+
+    PyDESPOT1(py::object const &seq, long const max_iterations) :
+        sequence{QI::Python::SequenceFromPython<QI::SPGRSequence>(seq)},
+        model{{}, sequence, max_iterations} {}
+
+    py::dict fit(Array const &data, py::object const &fixed, char const algorithm) {
+        switch (algorithm) {
+        case 'l':
+            return QI::Python::FitVoxels(DESPOT1LLS{model}, data, fixed);
+        case 'w':
+            return QI::Python::FitVoxels(DESPOT1WLLS{model}, data, fixed);
+        case 'n':
+            return QI::Python::FitVoxels(DESPOT1NLLS{model}, data, fixed);
+        default:
+            throw py::value_error(fmt::format("Unknown algorithm type: {}", algorithm));
+        }
+    }
+};
+
+struct PyMUPA {
+    RUFISSequence sequence;
+    MUPAB1Model   model;
+
+    PyMUPA(py::object const &seq) :
+        sequence{QI::Python::SequenceFromPython<RUFISSequence>(seq)}, model{{}, sequence} {}
+
+    py::dict fit(Array const &data) {
+        return QI::Python::FitVoxels(
+            QI::ScaledNumericDiffFit<MUPAB1Model, MUPAB1Model::NS>{model}, data, py::none());
+    }
+};
+} // namespace
+
+PYBIND11_MODULE(qipy, m) {
+    m.doc() = "Native QUIT models and fits that work directly on NumPy arrays";
+
+    py::class_<PyDESPOT1>(m, "DESPOT1")
+        .def(py::init<py::object const &, long>(),
+             py::arg("sequence"),
+             py::arg("max_iterations") = 15,
+             "sequence is the contents of the SPGR entry of a qi despot1 JSON file, as a dict or a "
+             "JSON string")
+        .def_property_readonly(
+            "varying_names",
+            [](PyDESPOT1 const &d) { return QI::Python::Names(d.model.varying_names); })
+        .def_property_readonly(
+            "fixed_names",
+            [](PyDESPOT1 const &d) { return QI::Python::Names(d.model.fixed_names); })
+        .def(
+            "signal",
+            [](PyDESPOT1 const &d, Array const &varying, py::object const &fixed) {
+                return QI::Python::Signal(d.model, varying, fixed);
+            },
+            py::arg("varying"),
+            py::arg("fixed") = py::none(),
+            "Signals for voxels x (PD, T1) parameters, with optional voxels x (B1) fixed values")
+        .def("fit",
+             &PyDESPOT1::fit,
+             py::arg("data"),
+             py::arg("fixed")     = py::none(),
+             py::arg("algorithm") = 'l',
+             "Fit voxels x volumes data. fixed is an optional dict such as {'B1': b1}. Returns a "
+             "dict of PD, T1, rmse and iterations")
+
+    py::class_<PyMUPA>(m, "MUPA")
+        .def(py::init<py::object const &>(),
+             py::arg("sequence"),
+             "sequence is the contents of the MUPA entry of a qi mupa JSON file, as a dict or a "
+             "JSON string")
+        .def_property_readonly(
+            "varying_names",
+            [](PyMUPA const &m) { return QI::Python::Names(m.model.varying_names); })
+        .def(
+            "signal",
+            [](PyMUPA const &m, Array const &varying) {
+                return QI::Python::Signal(m.model, varying, py::none());
+            },
+            py::arg("varying"),
+            "Signals for voxels x (M0, T1, T2, B1) parameters")
+        .def("fit",
+             &PyMUPA::fit,
+             py::arg("data"),
+             "Fit voxels x volumes data with the same non-linear fit as qi mupa. Returns a dict of "
+             "M0, T1, T2, B1, rmse and iterations");
+}
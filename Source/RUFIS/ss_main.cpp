@@ -14,6 +14,7 @@
 // #define QI_DEBUG_BUILD 1
 
 #include "Args.h"
+#include "FitDictionary.h"
 #include "FitScaledNumeric.h"
 #include "ImageIO.h"
 #include "Macro.h"
@@ -41,6 +42,12 @@ int rufis_ss_main(int argc, char **argv) {
     args::Flag                   MT(parser, "MT", "Fit MT model", {"MT"});
     args::ValueFlag<std::string> ls_arg(
         parser, "LINESHAPE", "Path to lineshape file", {"lineshape"});
+    args::Flag                   dict(
+        parser, "DICT", "Match a dictionary, grid read from \"dictionary\" in JSON", {"dict"});
+    args::ValueFlag<std::string> dict_cache(
+        parser, "FILE", "Read the dictionary from FILE, or save it there", {"dict-cache"});
+    args::Flag                   polish(
+        parser, "POLISH", "Refine dictionary matches with NLLS", {"polish"});
 
     QI::ParseArgs(parser, argc, argv, verbose, threads);
     QI::CheckPos(input_path);
@@ -61,14 +68,28 @@ int rufis_ss_main(int argc, char **argv) {
                                                       simulate.Get(),
                                                       subregion.Get());
         } else {
-            using FitType = QI::ScaledNumericDiffFit<decltype(model), decltype(model)::NS>;
-            FitType fit(model);
-
-            auto fit_filter =
-                QI::ModelFitFilter<FitType>::New(&fit, verbose, covar, resids, subregion.Get());
-            fit_filter->ReadInputs({input_path.Get()}, fixed, mask.Get());
-            fit_filter->Update();
-            fit_filter->WriteOutputs(prefix.Get() + model_name);
+            auto run = [&](auto &fit) {
+                using FitType = std::remove_reference_t<decltype(fit)>;
+                auto fit_filter =
+                    QI::ModelFitFilter<FitType>::New(&fit, verbose, covar, resids, subregion.Get());
+                QI_FIT_FILTER_ARGS(fit_filter);
+                fit_filter->ReadInputs({input_path.Get()}, fixed, mask.Get());
+                fit_filter->Update();
+                fit_filter->WriteOutputs(prefix.Get() + model_name);
+            };
+            if (dict) {
+                if constexpr (decltype(model)::NS == 1) {
+                    QI::DictionaryFit<decltype(model)> fit(
+                        model, doc.at("dictionary"), polish, dict_cache.Get(), verbose);
+                    run(fit);
+                } else {
+                    QI::Fail("Dictionary matching is not supported for the MT model");
+                }
+            } else {
+                using FitType = QI::ScaledNumericDiffFit<decltype(model), decltype(model)::NS>;
+                FitType fit{model};
+                run(fit);
+            }
         }
     };
 
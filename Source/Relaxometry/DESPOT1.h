@@ -0,0 +1,312 @@
+/*
+ *  DESPOT1.h
+ *
+ *  Copyright (c) 2015 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include "ceres/ceres.h"
+#include <Eigen/Core>
+#include <array>
+#include <limits>
+#include <string>
+
+#include "FitFunction.h"
+#include "LinearFits.h"
+#include "Model.h"
+#include "OnePoolSignals.h"
+#include "SPGRSequence.h"
+#include "Util.h"
+
+struct DESPOT1 : QI::Model<double, double, 2, 1> {
+    using SequenceType = QI::SPGRSequence;
+    SequenceType const &sequence;
+    long const          max_iterations;
+
+    std::array<const std::string, 2> const varying_names{"PD", "T1"};
+    std::array<const std::string, 1> const fixed_names{"B1"};
+    FixedArray const                       fixed_defaults{1.0};
+
+    VaryingArray const bounds_lo{1.e-6, 1.e-6};
+    VaryingArray const bounds_hi{100., 10.};
+
+    int input_size(const int /* Unused */) const { return sequence.size(); }
+
+    template <typename Derived>
+    auto signal(const Eigen::ArrayBase<Derived> &v, const QI_ARRAYN(double, NF) & f) const
+        -> QI_ARRAY(typename Derived::Scalar) {
+        return QI::SPGRSignal(v[0], v[1], f[0], sequence);
+    }
+};
+
+using DESPOT1Fit = QI::FitFunction<DESPOT1>;
+
+/*
+ *  The linear fits regress y = S / sin(a) against x = S / tan(a), see LinearFits.h, with slope E1
+ *  and intercept PD(1 - E1). T is either double for one voxel or an Eigen array for a block.
+ */
+template <typename T>
+void DESPOT1Regression(T const &    sw,
+                       T const &    sx,
+                       T const &    sy,
+                       T const &    sxx,
+                       T const &    sxy,
+                       double const TR,
+                       T &          PD,
+                       T &          T1) {
+    using std::log;
+    T slope, inter;
+    QI::LineFit(sw, sx, sy, sxx, sxy, slope, inter);
+    PD = inter / (1. - slope);
+    T1 = -TR / log(slope);
+}
+
+/*
+ *  The flip angle tables for a block of voxels in the batched fits, which are reused for every
+ *  WLLS iteration and for the residuals
+ */
+struct DESPOT1Block : QI::FlipAngleTables {
+    DESPOT1Block(DESPOT1 const &model, QI::FitBatch<DESPOT1> const &batch) :
+        QI::FlipAngleTables(model.sequence.FA, batch.fixed.col(0), batch.inputs[0]) {}
+
+    /*
+     *  Clamps the parameters and fills in the RMSE and residuals
+     */
+    void finish(DESPOT1 const &model, QI::FitBatch<DESPOT1> &batch) const {
+        batch.varying.col(0) =
+            QI::Clamp(batch.varying.col(0), 0., std::numeric_limits<double>::max());
+        batch.varying.col(1) =
+            QI::Clamp(batch.varying.col(1), model.bounds_lo[1], model.bounds_hi[1]);
+        auto const &         data = batch.inputs[0];
+        Eigen::ArrayXd const E1   = (-model.sequence.TR / batch.varying.col(1)).exp();
+        Eigen::ArrayXd const M    = batch.varying.col(0) * (1. - E1);
+        batch.rmse.setZero();
+        for (Eigen::Index j = 0; j < sin_a.cols(); j++) {
+            Eigen::ArrayXd const r = data.col(j) - M * sin_a.col(j) / (1. - E1 * cos_a.col(j));
+            if (batch.residuals.size() > 0) {
+                batch.residuals[0].col(j) = r;
+            }
+            batch.rmse += r.square();
+        }
+        batch.rmse = (batch.rmse / sin_a.cols()).sqrt();
+    }
+};
+
+/*
+ *  The per-voxel fits below use the same regression with scalar sums, and are only used when
+ *  the batched versions are not, e.g. by the Python module for single voxels
+ */
+inline void DESPOT1Residuals(DESPOT1 const &               model,
+                             Eigen::ArrayXd const &        data,
+                             double const                  B1,
+                             DESPOT1::VaryingArray const & p,
+                             double &                      rmse,
+                             std::vector<Eigen::ArrayXd> & residuals) {
+    double const E1 = exp(-model.sequence.TR / p[1]);
+    double const M  = p[0] * (1. - E1);
+    if (residuals.size() > 0) { // Residuals will only be allocated if the user asked for them
+        residuals[0].resize(data.rows());
+    }
+    double sum = 0;
+    for (Eigen::Index j = 0; j < data.rows(); j++) {
+        double const a = model.sequence.FA[j] * B1;
+        double const r = data[j] - M * sin(a) / (1. - E1 * cos(a));
+        if (residuals.size() > 0) {
+            residuals[0][j] = r;
+        }
+        sum += r * r;
+    }
+    rmse = sqrt(sum / data.rows());
+}
+
+struct DESPOT1LLS : DESPOT1Fit {
+    using DESPOT1Fit::DESPOT1Fit;
+    QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
+                          DESPOT1::FixedArray const &        fixed,
+                          DESPOT1::VaryingArray &            outputs,
+                          DESPOT1::CovarArray * /* Unused */,
+                          RMSErrorType &               residual,
+                          std::vector<Eigen::ArrayXd> &residuals,
+                          FlagType &                   iterations) const override {
+        const Eigen::ArrayXd &data = inputs[0];
+        const double &        B1   = fixed[0];
+        double                sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (Eigen::Index j = 0; j < data.rows(); j++) {
+            double const a = model.sequence.FA[j] * B1;
+            double const y = data[j] / sin(a);
+            double const x = y * cos(a);
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        double PD, T1;
+        DESPOT1Regression<double>(data.rows(), sx, sy, sxx, sxy, model.sequence.TR, PD, T1);
+        outputs << QI::Clamp(PD, 0., std::numeric_limits<double>::max()),
+            QI::Clamp(T1, model.bounds_lo[1], model.bounds_hi[1]);
+        DESPOT1Residuals(model, data, B1, outputs, residual, residuals);
+        iterations = 1;
+        return {true, ""};
+    }
+
+    /*
+     * The same regression for a whole block of voxels, with the sums accumulated column by column
+     * so that each step is a vectorised operation across the voxels
+     */
+    QI::FitReturnType fit_batch(QI::FitBatch<DESPOT1> &batch) const {
+        DESPOT1Block const block(model, batch);
+        Eigen::ArrayXd     sw, sx, sy, sxx, sxy, PD, T1;
+        block.sums(sw, sx, sy, sxx, sxy);
+        DESPOT1Regression(sw, sx, sy, sxx, sxy, model.sequence.TR, PD, T1);
+        batch.varying.col(0) = PD;
+        batch.varying.col(1) = T1;
+        block.finish(model, batch);
+        batch.flags.setOnes();
+        return {true, ""};
+    }
+};
+
+struct DESPOT1WLLS : DESPOT1Fit {
+    using DESPOT1Fit::DESPOT1Fit;
+    QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
+                          DESPOT1::FixedArray const &        fixed,
+                          DESPOT1::VaryingArray &            outputs,
+                          DESPOT1::CovarArray * /* Unused */,
+                          RMSErrorType &               residual,
+                          std::vector<Eigen::ArrayXd> &residuals,
+                          FlagType &                   iterations) const override {
+        const Eigen::ArrayXd &data = inputs[0];
+        const double &        B1   = fixed[0];
+        auto const            regress = [&](bool const weighted, double const T1, auto &out) {
+            double const E1 = exp(-model.sequence.TR / T1);
+            double       sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+            for (Eigen::Index j = 0; j < data.rows(); j++) {
+                double const a = model.sequence.FA[j] * B1;
+                double const y = data[j] / sin(a);
+                double const x = y * cos(a);
+                double const g = sin(a) / (1. - E1 * cos(a));
+                double const w = weighted ? g * g : 1.;
+                sw += w;
+                sx += w * x;
+                sy += w * y;
+                sxx += w * x * x;
+                sxy += w * x * y;
+            }
+            DESPOT1Regression(sw, sx, sy, sxx, sxy, model.sequence.TR, out[0], out[1]);
+        };
+        Eigen::Array2d out;
+        regress(false, 1., out);
+        for (iterations = 0; iterations < model.max_iterations; iterations++) {
+            Eigen::Array2d newOut;
+            regress(true, out[1], newOut);
+            if (newOut.isApprox(out))
+                break;
+            else
+                out = newOut;
+        }
+        outputs << QI::Clamp(out[0], 0., std::numeric_limits<double>::max()),
+            QI::Clamp(out[1], model.bounds_lo[1], model.bounds_hi[1]);
+        DESPOT1Residuals(model, data, B1, outputs, residual, residuals);
+        return {true, ""};
+    }
+
+    /*
+     * The iterations run in lock-step across the block. Voxels that have converged keep their
+     * parameters and iteration count, and the loop stops when all of them have converged.
+     */
+    QI::FitReturnType fit_batch(QI::FitBatch<DESPOT1> &batch) const {
+        DESPOT1Block const block(model, batch);
+        Eigen::ArrayXd     sw, sx, sy, sxx, sxy, PD, T1, newPD, newT1, E1;
+        block.sums(sw, sx, sy, sxx, sxy);
+        DESPOT1Regression(sw, sx, sy, sxx, sxy, model.sequence.TR, PD, T1);
+
+        QI::ActiveMask active = QI::ActiveMask::Ones(batch.capacity());
+        batch.flags.setConstant(model.max_iterations);
+        for (int it = 0; it < model.max_iterations && active.any(); it++) {
+            E1 = (-model.sequence.TR / T1).exp();
+            block.sums(
+                [&](Eigen::Index const j) {
+                    return (block.sin_a.col(j) / (1. - E1 * block.cos_a.col(j))).square();
+                },
+                sw,
+                sx,
+                sy,
+                sxx,
+                sxy);
+            DESPOT1Regression(sw, sx, sy, sxx, sxy, model.sequence.TR, newPD, newT1);
+            QI::LockStep(it, newPD, newT1, PD, T1, active, batch.flags);
+        }
+        batch.varying.col(0) = PD;
+        batch.varying.col(1) = T1;
+        block.finish(model, batch);
+        return {true, ""};
+    }
+};
+
+struct DESPOT1NLLS : DESPOT1Fit {
+    DESPOT1NLLS(DESPOT1 &m) : DESPOT1Fit(m) {}
+
+    QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
+                          DESPOT1::FixedArray const &        fixed,
+                          DESPOT1::VaryingArray &            p,
+                          DESPOT1::CovarArray *              cov,
+                          RMSErrorType &                     rmse,
+                          std::vector<Eigen::ArrayXd> &      residuals,
+                          FlagType &                         iterations) const override {
+        const double &scale = inputs[0].maxCoeff();
+        if (scale < std::numeric_limits<double>::epsilon()) {
+            p << 0.0, 0.0;
+            rmse = 0;
+            return {false, "Maximum data value was not positive"};
+        }
+        auto &ctx     = QI::ThreadFitContext<DESPOT1NLLS, DESPOT1>();
+        auto &problem = ctx.Prepare(this, [&](auto &c) {
+            using Cost     = QI::ContextCost<DESPOT1>;
+            using AutoCost = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, DESPOT1::NV>;
+            c.data[0].resize(model.sequence.size());
+            auto *cost = new Cost{model, c.fixed, c.data[0]};
+            c.problem->AddResidualBlock(
+                new AutoCost(cost, model.sequence.size()), NULL, c.varying.data());
+        });
+        ctx.data[0]      = inputs[0] / scale;
+        ctx.fixed        = fixed;
+        ctx.varying      = {10., 1.};
+        auto const &data = ctx.data[0];
+        ctx.SetBounds(model.bounds_lo, model.bounds_hi);
+        QI::ThreadWarmStart<DESPOT1>().Apply(ctx.varying);
+        ceres::Solver::Options options;
+        ceres::Solver::Summary summary;
+        options.max_num_iterations  = model.max_iterations;
+        options.function_tolerance  = 1e-5;
+        options.gradient_tolerance  = 1e-6;
+        options.parameter_tolerance = 1e-4;
+        options.logging_type        = ceres::SILENT;
+        ceres::Solve(options, &problem, &summary);
+        p = ctx.varying;
+
+        if (!summary.IsSolutionUsable()) {
+            return {false, summary.FullReport()};
+        }
+        iterations = summary.iterations.size();
+        QI::ThreadWarmStart<DESPOT1>().Save(ctx.varying);
+
+        Eigen::ArrayXd const rs  = (data - model.signal(p, fixed));
+        double const         var = rs.square().sum();
+        rmse                     = sqrt(var / data.rows()) * scale;
+        if (residuals.size() > 0) {
+            residuals[0] = rs * scale;
+        }
+        if (cov) {
+            QI::GetModelCovariance<DESPOT1>(
+                problem, ctx.varying, var / (data.rows() - DESPOT1::NV), cov);
+        }
+        p[0] = p[0] * scale;
+        return {true, ""};
+    }
+};
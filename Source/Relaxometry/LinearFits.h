@@ -0,0 +1,132 @@
+/*
+ *  LinearFits.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <Eigen/Core>
+#include <cmath>
+
+namespace QI {
+
+/*
+ *  Slope and intercept of a weighted straight-line fit from the sums of w, wx, wy, wx^2 and wxy,
+ *  i.e. the 2x2 normal equations solved directly. T is either double for one fit or an Eigen
+ *  array for one fit per element.
+ */
+template <typename T>
+void LineFit(T const &sw,
+             T const &sx,
+             T const &sy,
+             T const &sxx,
+             T const &sxy,
+             T &      slope,
+             T &      inter) {
+    T const det = sw * sxx - sx * sx;
+    slope       = (sw * sxy - sx * sy) / det;
+    inter       = (sxx * sy - sx * sxy) / det;
+}
+
+/*
+ *  The DESPOT fits regress y = S / sin(a) against x = S / tan(a) for the actual flip angles a. For
+ *  a block of voxels (rows) these tables hold the sines and cosines of the flip angles and the
+ *  regression variables, one column per volume, so that iterative fits and the residuals can
+ *  reuse them. If all voxels in the block share the same B1, which is always the case without a
+ *  B1 map, the sines and cosines are only calculated once per flip angle.
+ */
+struct FlipAngleTables {
+    Eigen::ArrayXXd sin_a, cos_a, x, y;
+
+    template <typename B1Type, typename DataType>
+    FlipAngleTables(Eigen::ArrayXd const &FA, B1Type const &B1, DataType const &data) :
+        sin_a(data.rows(), data.cols()), cos_a(data.rows(), data.cols()) {
+        bool const uniform = (B1 == B1[0]).all();
+        for (Eigen::Index j = 0; j < data.cols(); j++) {
+            if (uniform) {
+                sin_a.col(j).setConstant(sin(FA[j] * B1[0]));
+                cos_a.col(j).setConstant(cos(FA[j] * B1[0]));
+            } else {
+                sin_a.col(j) = (FA[j] * B1).sin();
+                cos_a.col(j) = (FA[j] * B1).cos();
+            }
+        }
+        y = data / sin_a;
+        x = y * cos_a;
+    }
+
+    /*
+     *  The unweighted sums for LineFit
+     */
+    void sums(Eigen::ArrayXd &sw,
+              Eigen::ArrayXd &sx,
+              Eigen::ArrayXd &sy,
+              Eigen::ArrayXd &sxx,
+              Eigen::ArrayXd &sxy) const {
+        sw  = Eigen::ArrayXd::Constant(x.rows(), x.cols());
+        sx  = x.rowwise().sum();
+        sy  = y.rowwise().sum();
+        sxx = x.square().rowwise().sum();
+        sxy = (x * y).rowwise().sum();
+    }
+
+    /*
+     *  The weighted sums for LineFit, where weights(j) gives the weight of column j for every row
+     */
+    template <typename WeightFunc>
+    void sums(WeightFunc &&   weights,
+              Eigen::ArrayXd &sw,
+              Eigen::ArrayXd &sx,
+              Eigen::ArrayXd &sy,
+              Eigen::ArrayXd &sxx,
+              Eigen::ArrayXd &sxy) const {
+        sw.setZero(x.rows());
+        sx.setZero(x.rows());
+        sy.setZero(x.rows());
+        sxx.setZero(x.rows());
+        sxy.setZero(x.rows());
+        Eigen::ArrayXd w(x.rows());
+        for (Eigen::Index j = 0; j < x.cols(); j++) {
+            w = weights(j);
+            sw += w;
+            sx += w * x.col(j);
+            sy += w * y.col(j);
+            sxx += w * x.col(j).square();
+            sxy += w * x.col(j) * y.col(j);
+        }
+    }
+};
+
+using ActiveMask = Eigen::Array<bool, Eigen::Dynamic, 1>;
+
+/*
+ *  One step of an iterative fit that runs in lock-step across a block of voxels. Voxels where the
+ *  new parameters (a, b) are approximately equal to the current ones, in the same sense as Eigen's
+ *  isApprox(), stop being active and record the iteration they converged on. The current
+ *  parameters of the voxels that are still active are updated.
+ */
+template <typename FlagArray>
+void LockStep(int const             iteration,
+              Eigen::ArrayXd const &new_a,
+              Eigen::ArrayXd const &new_b,
+              Eigen::ArrayXd &      a,
+              Eigen::ArrayXd &      b,
+              ActiveMask &          active,
+              FlagArray &           flags) {
+    double const         prec2     = std::pow(Eigen::NumTraits<double>::dummy_precision(), 2);
+    Eigen::ArrayXd const diff      = (new_a - a).square() + (new_b - b).square();
+    Eigen::ArrayXd const norm      = (a.square() + b.square()).min(new_a.square() + new_b.square());
+    ActiveMask const     converged = active && (diff <= prec2 * norm);
+    flags                          = converged.select(iteration, flags);
+    active                         = active && !converged;
+    a                              = active.select(new_a, a);
+    b                              = active.select(new_b, b);
+}
+
+} // End namespace QI
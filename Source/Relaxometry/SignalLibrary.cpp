@@ -0,0 +1,48 @@
+/*
+ *  SignalLibrary.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SignalLibrary.h"
+
+namespace QI {
+
+std::shared_ptr<MappedFile const> MappedFile::Open(std::string const &path) {
+    int const fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    void *map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // The mapping keeps its own reference to the file
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+    std::shared_ptr<MappedFile> file(new MappedFile);
+    file->m_data = static_cast<char const *>(map);
+    file->m_size = st.st_size;
+    return file;
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        ::munmap(const_cast<char *>(m_data), m_size);
+    }
+}
+
+} // namespace QI
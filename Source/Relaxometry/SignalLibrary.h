@@ -0,0 +1,283 @@
+/*
+ *  SignalLibrary.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "itkMultiThreaderBase.h"
+#include <Eigen/Core>
+
+#include "JSON.h"
+#include "Log.h"
+#include "RegionContraction.h"
+#include "ReplacementFile.h"
+
+namespace QI {
+
+/*
+ *  A read-only memory map of a whole file. The pages are shared between every thread, and with
+ *  any other process that maps the same file.
+ */
+class MappedFile {
+  public:
+    static std::shared_ptr<MappedFile const> Open(std::string const &path); // nullptr on failure
+    ~MappedFile();
+    MappedFile(MappedFile const &) = delete;
+    void operator=(MappedFile const &) = delete;
+
+    char const *data() const { return m_data; }
+    size_t      size() const { return m_size; }
+
+  private:
+    MappedFile() = default;
+    char const *m_data = nullptr;
+    size_t      m_size = 0;
+};
+
+/*
+ *  Precomputed mcDESPOT signals for region contraction. Many voxels share nearly the same f0 and
+ *  B1, so instead of simulating thousands of random samples from scratch for the first
+ *  contraction in every voxel, a fixed set of samples is simulated once for each bin of a
+ *  (f0, B1) grid. A voxel is looked up in its nearest bin, and the contraction then starts from
+ *  the bounds of the best entries.
+ *
+ *  The grid is read from JSON as {"f0": [low, high, steps], "B1": [low, high, steps], "entries":
+ *  N}. A fixed parameter that is not listed has a single bin at its default. The samples are
+ *  drawn uniformly within the model bounds, subject to the same constraints as region
+ *  contraction, with a fixed seed so that the library can be rebuilt exactly.
+ *
+ *  The library lives in a file that is built the first time and then memory mapped. Entries are
+ *  stored as floats, already multiplied by the weights for the bin's f0, alongside half of their
+ *  squared norm. The weighted sum of squared residuals for every entry is then a single
+ *  matrix-vector product. A file that was built for a different model, sequence, set of bounds
+ *  or grid is rebuilt.
+ */
+template <typename Model> class SignalLibrary {
+  public:
+    using VaryingArray = typename Model::VaryingArray;
+    using FixedArray   = typename Model::FixedArray;
+
+    SignalLibrary(Model const &      model,
+                  json const &       spec,
+                  std::string const &path,
+                  bool const         verbose) :
+        m_model{model} {
+        auto const steps = [&](std::string const &name, double const def) -> Eigen::ArrayXd {
+            if (spec.find(name) != spec.end()) {
+                auto const s = ArrayFromJSON<double>(spec, name, 1.0, 3);
+                return Eigen::ArrayXd::LinSpaced(static_cast<Eigen::Index>(s[2]), s[0], s[1]);
+            }
+            return Eigen::ArrayXd::Constant(1, def);
+        };
+        m_f0      = steps("f0", model.fixed_defaults[0]);
+        m_B1      = steps("B1", model.fixed_defaults[1]);
+        m_entries = spec.value("entries", 20000);
+        m_data    = model.spgr.size() + model.ssfp.size();
+        if (m_entries < 1) {
+            QI::Fail("Signal library must have at least one entry");
+        }
+        if (!Map(path)) {
+            Build(path, verbose);
+            if (!Map(path)) {
+                QI::Fail("Could not read back signal library {}", path);
+            }
+        } else {
+            QI::Log(verbose, "Mapped signal library {}", path);
+        }
+    }
+
+    /*
+     *  Narrows lo and hi to the bounds of the best keep entries for the data, which must already
+     *  be scaled to the mean if the model is
+     */
+    void Narrow(Eigen::ArrayXd const &data,
+                FixedArray const &    fixed,
+                Eigen::Index const    keep,
+                VaryingArray &        lo,
+                VaryingArray &        hi) const {
+        Eigen::Index f0_bin, B1_bin;
+        (m_f0 - fixed[0]).abs().minCoeff(&f0_bin);
+        (m_B1 - fixed[1]).abs().minCoeff(&B1_bin);
+        auto const            bin = B1_bin * m_f0.size() + f0_bin;
+        Eigen::VectorXf const wd  = (data * Weights(m_f0[f0_bin])).matrix().template cast<float>();
+        Eigen::ArrayXd        costs =
+            (HalfNorms(bin) - (Signals(bin).transpose() * wd).array()).template cast<double>();
+        auto const best   = index_partial_sort(costs, std::min(keep, m_entries));
+        auto const params = Params();
+        lo = hi = params.col(best[0]);
+        for (auto const e : best) {
+            lo = lo.min(params.col(e));
+            hi = hi.max(params.col(e));
+        }
+    }
+
+  private:
+    Model const &                     m_model;
+    Eigen::ArrayXd                    m_f0, m_B1;
+    Eigen::Index                      m_entries, m_data;
+    std::shared_ptr<MappedFile const> m_file;
+    double const *                    m_params  = nullptr;
+    float const *                     m_signals = nullptr;
+
+    struct Header {
+        char     magic[4] = {'Q', 'I', 'M', 'L'};
+        uint32_t version  = 1;
+        uint32_t nv       = Model::NV;
+        uint32_t n_data   = 0;
+        uint32_t n_f0     = 0;
+        uint32_t n_B1     = 0;
+        uint64_t entries  = 0;
+    };
+
+    Header Expected() const {
+        Header header;
+        header.n_data  = m_data;
+        header.n_f0    = m_f0.size();
+        header.n_B1    = m_B1.size();
+        header.entries = m_entries;
+        return header;
+    }
+
+    /*
+     *  Everything the library depends on apart from the sizes in the header. The signal at the
+     *  centre of the bounds, in the last bin, changes with the sequence and with scaling to the
+     *  mean.
+     */
+    Eigen::ArrayXd Fingerprint() const {
+        VaryingArray const centre = (m_model.bounds_lo + m_model.bounds_hi) / 2;
+        FixedArray const   last{m_f0[m_f0.size() - 1], m_B1[m_B1.size() - 1]};
+        Eigen::ArrayXd     check(m_data + 2 * Model::NV + m_f0.size() + m_B1.size());
+        check << m_model.signal(centre, last), m_model.bounds_lo, m_model.bounds_hi, m_f0, m_B1;
+        return check;
+    }
+
+    Eigen::ArrayXd Weights(double const f0) const {
+        Eigen::ArrayXd weights(m_data);
+        weights.head(m_model.spgr.size()) = 1;
+        weights.tail(m_model.ssfp.size()) = m_model.ssfp.weights(f0);
+        return weights;
+    }
+
+    size_t n_bins() const { return m_f0.size() * m_B1.size(); }
+    size_t bin_floats() const { return (m_data + 1) * m_entries; }
+
+    Eigen::Map<Eigen::ArrayXXd const> Params() const {
+        return {m_params, Model::NV, m_entries};
+    }
+    Eigen::Map<Eigen::MatrixXf const> Signals(size_t const bin) const {
+        return {m_signals + bin * bin_floats(), m_data, m_entries};
+    }
+    Eigen::Map<Eigen::ArrayXf const> HalfNorms(size_t const bin) const {
+        return {m_signals + bin * bin_floats() + m_data * m_entries, m_entries};
+    }
+
+    bool Map(std::string const &path) {
+        auto file = MappedFile::Open(path);
+        if (!file) {
+            return false;
+        }
+        Header const         expected    = Expected();
+        Eigen::ArrayXd const fingerprint = Fingerprint();
+        size_t const         n_doubles   = fingerprint.size() + Model::NV * m_entries;
+        size_t const         size =
+            sizeof(Header) + n_doubles * sizeof(double) + n_bins() * bin_floats() * sizeof(float);
+        if (file->size() != size || std::memcmp(file->data(), &expected, sizeof(Header)) != 0) {
+            QI::Warn("Signal library {} does not match the model or grid, re-building", path);
+            return false;
+        }
+        auto const *doubles = reinterpret_cast<double const *>(file->data() + sizeof(Header));
+        if (!Eigen::Map<Eigen::ArrayXd const>(doubles, fingerprint.size()).isApprox(fingerprint)) {
+            QI::Warn("Signal library {} does not match the model or grid, re-building", path);
+            return false;
+        }
+        m_file    = file;
+        m_params  = doubles + fingerprint.size();
+        m_signals = reinterpret_cast<float const *>(doubles + n_doubles);
+        return true;
+    }
+
+    void Build(std::string const &path, bool const verbose) {
+        QI::Log(verbose,
+                "Building signal library with {} entries for {} f0 and {} B1 bins",
+                m_entries,
+                m_f0.size(),
+                m_B1.size());
+        Eigen::ArrayXXd                        params(Model::NV, m_entries);
+        std::mt19937_64                        rng(0);
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        VaryingArray const width = m_model.bounds_hi - m_model.bounds_lo;
+        for (Eigen::Index e = 0; e < m_entries; e++) {
+            VaryingArray v;
+            int          tries = 0;
+            do {
+                if (++tries > 1000) {
+                    QI::Fail("Could not draw a valid signal library sample within the bounds");
+                }
+                for (int p = 0; p < Model::NV; p++) {
+                    v[p] = m_model.bounds_lo[p] + uniform(rng) * width[p];
+                }
+            } while (!m_model.valid(v));
+            params.col(e) = v;
+        }
+
+        ReplacementFile replacement(path);
+        std::ofstream & file        = replacement.stream();
+        Header const    header      = Expected();
+        auto const      fingerprint = Fingerprint();
+        file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        file.write(reinterpret_cast<char const *>(fingerprint.data()),
+                   fingerprint.size() * sizeof(double));
+        file.write(reinterpret_cast<char const *>(params.data()), params.size() * sizeof(double));
+        Eigen::MatrixXf signals(m_data, m_entries);
+        Eigen::ArrayXf  half_norms(m_entries);
+        auto            threader = itk::MultiThreaderBase::New();
+        for (Eigen::Index b = 0; b < m_B1.size(); b++) {
+            for (Eigen::Index f = 0; f < m_f0.size(); f++) {
+                FixedArray const     fixed{m_f0[f], m_B1[b]};
+                auto const           angles  = m_model.angles(fixed);
+                Eigen::ArrayXd const weights = Weights(m_f0[f]);
+                threader->ParallelizeArray(
+                    0,
+                    m_entries,
+                    [&](itk::SizeValueType const e) {
+                        VaryingArray const v = params.col(e);
+                        Eigen::ArrayXd     signal(m_data);
+                        m_model.signal(v, angles, signal);
+                        signal *= weights;
+                        if (signal.allFinite()) {
+                            signals.col(e) = signal.matrix().template cast<float>();
+                            half_norms[e]  = signal.square().sum() / 2;
+                        } else {
+                            signals.col(e).setZero(); // Will never be the best match
+                            half_norms[e] = std::numeric_limits<float>::infinity();
+                        }
+                    },
+                    nullptr);
+                file.write(reinterpret_cast<char const *>(signals.data()),
+                           signals.size() * sizeof(float));
+                file.write(reinterpret_cast<char const *>(half_norms.data()),
+                           half_norms.size() * sizeof(float));
+            }
+        }
+        replacement.Commit();
+        QI::Log(verbose, "Saved signal library to {}", path);
+    }
+};
+
+} // namespace QI
@@ -15,44 +15,19 @@
 #include "Helpers.h"
 #include "Log.h"
 
-#include <Eigen/Dense>
-// There's a bug in matrix log that leads to duplicate symbol definitions if
-// this is included in the header file
-#include <unsupported/Eigen/MatrixFunctions>
+#include <cmath>
 
 using namespace std::literals;
 
 namespace {
-
-Eigen::ArrayXd SSFP1(const double &          PD,
-                     const double &          T1,
-                     const double &          T2,
-                     const double &          f0,
-                     const double &          B1,
-                     const QI::SSFPSequence &s) {
-    {
-        const double         E1     = exp(-s.TR / T1);
-        const double         E2     = exp(-s.TR / T2);
-        const Eigen::ArrayXd d      = (1 - E1 * cos(B1 * s.FA) - (E2 * E2) * (E1 - cos(B1 * s.FA)));
-        const Eigen::ArrayXd G      = sin(B1 * s.FA) * (1 - E1) / d;
-        const double         a      = E2;
-        const Eigen::ArrayXd b      = E2 * (1 - E1) * (1 + cos(B1 * s.FA)) / d;
-        const double         theta0 = 2.0 * M_PI * f0;
-        const Eigen::ArrayXd theta  = theta0 - s.PhaseInc;
-        const double         psi    = theta0 / 2.0;
-        const Eigen::ArrayXd cos_th = cos(theta);
-        const Eigen::ArrayXd sin_th = sin(theta);
-        const double         cos_psi = cos(psi);
-        const double         sin_psi = sin(psi);
-        const Eigen::ArrayXd re_m =
-            (cos_psi - a * (cos_th * cos_psi - sin_th * sin_psi)) * G / (1.0 - b * cos_th);
-        const Eigen::ArrayXd im_m =
-            (sin_psi - a * (cos_th * sin_psi + sin_th * cos_psi)) * G / (1.0 - b * cos_th);
-        const Eigen::ArrayXd result = PD * sqrt(re_m.square() + im_m.square());
-        // std::cout << PD << " " << T1 << " " << T2 << " " << f0 << " " << B1 << ":" <<
-        // result.transpose() << std::endl;
-        return result;
-    }
+/*
+ *  The myelin and IE pools are a two-pool model with their share of PD and the fraction of each
+ */
+QI::TwoPoolModel::VaryingArray TwoPoolVarying(QI::ThreePoolModel::VaryingArray const &v) {
+    double const                   f_ab = 1. - v[9];
+    QI::TwoPoolModel::VaryingArray two_pool_varying;
+    two_pool_varying << v[0] * f_ab, v[1], v[2], v[3], v[4], v[7], v[8] / f_ab;
+    return two_pool_varying;
 }
 } // namespace
 
@@ -99,41 +74,70 @@ std::vector<Eigen::ArrayXd> ThreePoolModel::signals(const Eigen::ArrayXd &v,
 
 Eigen::ArrayXd ThreePoolModel::signal(const Eigen::ArrayXd &v,
                                       const QI_ARRAYN(double, NF) & f) const {
-    auto           sigs = signals(v, f);
     Eigen::ArrayXd sig(spgr.size() + ssfp.size());
-    sig.head(spgr.size()) = sigs[0];
-    sig.tail(ssfp.size()) = sigs[1];
+    signal(v, angles(f), sig);
     return sig;
 }
 
 Eigen::ArrayXd ThreePoolModel::spgr_signal(const Eigen::ArrayXd &v,
                                            const QI_ARRAYN(double, NF) & fixed) const {
-    double f_ab = 1. - v[9];
-    QI_ARRAYN(double, TwoPoolModel::NV) two_pool_varying;
-    two_pool_varying << v[0] * f_ab, v[1], v[2], v[3], v[4], v[7], v[8] / f_ab;
-    Eigen::VectorXd m_ab   = two_pool.spgr_signal(two_pool_varying, fixed);
-    Eigen::VectorXd m_c    = SPGRSignal(v[0] * v[9], v[5], fixed[1], spgr);
-    Eigen::VectorXd signal = m_ab + m_c;
-    // std::cout << "SPGR\n" << m_ab.transpose() << "\n" << m_c.transpose() << "\n" <<
-    // signal.transpose() << std::endl;
-    if (scale_to_mean) {
-        signal /= signal.mean();
-    }
+    Eigen::ArrayXd signal(spgr.size());
+    spgr_signal(v, angles(fixed), signal);
     return signal;
 }
 
 Eigen::ArrayXd ThreePoolModel::ssfp_signal(const Eigen::ArrayXd &v,
                                            const QI_ARRAYN(double, NF) & fixed) const {
-    double f_ab = 1. - v[9];
-    QI_ARRAYN(double, TwoPoolModel::NV) two_pool_varying;
-    two_pool_varying << v[0] * f_ab, v[1], v[2], v[3], v[4], v[7], v[8] / f_ab;
-    Eigen::VectorXd m_ab   = two_pool.ssfp_signal(two_pool_varying, fixed);
-    Eigen::VectorXd m_c    = SSFP1(v[0] * v[9], v[5], v[6], fixed[0], fixed[1], ssfp);
-    Eigen::VectorXd signal = m_ab + m_c;
+    Eigen::ArrayXd signal(ssfp.size());
+    ssfp_signal(v, angles(fixed), signal);
+    return signal;
+}
+
+ThreePoolModel::Angles ThreePoolModel::angles(FixedArray const &fixed) const {
+    return {two_pool.angles(fixed), (2.0 * M_PI * fixed[0] - ssfp.PhaseInc).cos()};
+}
+
+void ThreePoolModel::spgr_signal(VaryingArray const &       v,
+                                 Angles const &             angles,
+                                 Eigen::Ref<Eigen::ArrayXd> out) const {
+    two_pool.spgr_signal(TwoPoolVarying(v), angles.two_pool, out);
+    auto const & sa   = angles.two_pool.spgr_sin;
+    auto const & ca   = angles.two_pool.spgr_cos;
+    double const E1_c = exp(-spgr.TR / v[5]);
+    out += v[0] * v[9] * (1. - E1_c) * sa / (1. - E1_c * ca);
     if (scale_to_mean) {
-        signal /= signal.mean();
+        out /= out.mean();
     }
-    return signal;
+}
+
+/*
+ *  The CSF signal is the magnitude of the single-pool SSFP signal, which simplifies to
+ *  |G / (1 - b cos(theta))| * sqrt(1 - 2 E2 cos(theta) + E2^2)
+ */
+void ThreePoolModel::ssfp_signal(VaryingArray const &       v,
+                                 Angles const &             angles,
+                                 Eigen::Ref<Eigen::ArrayXd> out) const {
+    two_pool.ssfp_signal(TwoPoolVarying(v), angles.two_pool, out);
+    auto const & sa   = angles.two_pool.ssfp_sin;
+    auto const & ca   = angles.two_pool.ssfp_cos;
+    auto const & ct   = angles.csf_phase_cos;
+    double const E1_c = exp(-ssfp.TR / v[5]);
+    double const E2_c = exp(-ssfp.TR / v[6]);
+    out += v[0] * v[9] *
+           ((1. - E1_c) * sa /
+            (1. - E1_c * ca - E2_c * E2_c * (E1_c - ca) - E2_c * (1. - E1_c) * (1. + ca) * ct))
+               .abs() *
+           (1. - 2. * E2_c * ct + E2_c * E2_c).sqrt();
+    if (scale_to_mean) {
+        out /= out.mean();
+    }
+}
+
+void ThreePoolModel::signal(VaryingArray const &       v,
+                            Angles const &             angles,
+                            Eigen::Ref<Eigen::ArrayXd> out) const {
+    spgr_signal(v, angles, out.head(spgr.size()));
+    ssfp_signal(v, angles, out.tail(ssfp.size()));
 }
 
 } // End namespace QI
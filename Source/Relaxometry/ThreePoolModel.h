@@ -37,6 +37,14 @@ struct ThreePoolModel : Model<double, double, 10, 2, 2> {
     QI_ARRAYN(double, NV) bounds_lo;
     QI_ARRAYN(double, NV) bounds_hi;
 
+    /*
+     *  See TwoPoolModel::Angles. The single-pool SSFP signal for CSF has its own phase.
+     */
+    struct Angles {
+        TwoPoolModel::Angles two_pool;
+        Eigen::ArrayXd       csf_phase_cos;
+    };
+
     ThreePoolModel(SPGRSequence const &s1, SSFPSequence const &s2, const bool scale);
     bool   valid(const QI_ARRAYN(double, NV) & params) const; // For SRC
     size_t num_outputs() const;
@@ -51,6 +59,20 @@ struct ThreePoolModel : Model<double, double, 10, 2, 2> {
     std::vector<Eigen::ArrayXd> signals(const Eigen::ArrayXd &varying,
                                         const QI_ARRAYN(double, NF) & fixed) const;
     Eigen::ArrayXd signal(const Eigen::ArrayXd &varying, const QI_ARRAYN(double, NF) & fixed) const;
+
+    /*
+     *  Versions of the above that do not allocate, see TwoPoolModel
+     */
+    Angles angles(FixedArray const &fixed) const;
+    void   spgr_signal(VaryingArray const &       varying,
+                       Angles const &             angles,
+                       Eigen::Ref<Eigen::ArrayXd> out) const;
+    void   ssfp_signal(VaryingArray const &       varying,
+                       Angles const &             angles,
+                       Eigen::Ref<Eigen::ArrayXd> out) const;
+    void   signal(VaryingArray const &       varying,
+                  Angles const &             angles,
+                  Eigen::Ref<Eigen::ArrayXd> out) const;
 };
 
 } // End namespace QI
@@ -15,62 +15,89 @@
 #include "Log.h"
 #include "TwoPoolModel.h"
 
-// There's a bug in matrix log that leads to duplicate symbol definitions if
-// this is included in the header file
-#include <unsupported/Eigen/MatrixFunctions>
+#include <Eigen/LU> // For the closed-form 2x2 inverse
+#include <cmath>
 
 using namespace std::literals;
 
 namespace {
-Eigen::MatrixXd SSFP2(const Eigen::ArrayXd &varying,
-                      const QI_ARRAYN(double, 2) & fixed,
-                      QI::SSFPSequence const &ssfp) {
-    const double &PD    = varying[0];
-    const double &T1_a  = varying[1];
-    const double &T2_a  = varying[2];
-    const double &T1_b  = varying[3];
-    const double &T2_b  = varying[4];
-    const double &tau_a = varying[5];
-    const double &f_a   = varying[6];
-    const double &f0    = fixed[0];
-    const double &B1    = fixed[1];
-    const double &TR    = ssfp.TR;
-    const double  E1_a  = exp(-TR / T1_a);
-    const double  E1_b  = exp(-TR / T1_b);
-    const double  E2_a  = exp(-TR / T2_a);
-    const double  E2_b  = exp(-TR / T2_b);
+/*
+ *  The exchange and relaxation matrix for the longitudinal magnetization of both pools is
+ *  exp(-TR * A). For a 2x2 matrix M with mean eigenvalue m the exponential is
+ *  exp(m) * (cosh(d) I + sinh(d) / d (M - m I)), where d is half the difference between the
+ *  eigenvalues. With exchange d is real, as the off-diagonal elements have the same sign. The
+ *  hyperbolic functions are expanded so that a large d, from a small pool with fast exchange,
+ *  does not overflow.
+ */
+Eigen::Matrix2d Exp2(Eigen::Matrix2d const &M) {
+    double const          m  = M.trace() / 2;
+    double const          h  = (M(0, 0) - M(1, 1)) / 2;
+    double const          d  = std::sqrt(h * h + M(0, 1) * M(1, 0));
+    double const          ep = std::exp(m + d);
+    double const          em = std::exp(m - d);
+    double const          ch = (ep + em) / 2;
+    double const          sh = (d > 1e-8) ? (ep - em) / (2 * d) : std::exp(m) * (1. + d * d / 6.);
+    Eigen::Matrix2d const I  = Eigen::Matrix2d::Identity();
+    return ch * I + sh * (M - m * I);
+}
+
+/*
+ *  The steady-state of the two pools, with unknowns x, y (the transverse components of both
+ *  pools) and z (the longitudinal components), is a 6x6 system made of 2x2 blocks:
+ *
+ *  (ca I - c A) x + s A y + sa z = 0
+ *  -s A x + (I - c A) y          = 0
+ *  -sa x + (ca I - B) z          = r
+ *
+ *  where A and B are the transverse and longitudinal relaxation and exchange matrices, c and s
+ *  the cosine and sine of the phase, and ca and sa of the flip-angle. Eliminating y gives
+ *  P x + sa z = 0 with P = ca I - c A + s^2 A (I - c A)^-1 A, and then multiplying that by
+ *  Q = ca I - B and substituting z gives (Q P + sa^2 I) x = -sa r. The determinant of this is
+ *  the determinant of the full system, so it only needs 2x2 inverses. Eliminating z first would
+ *  need Q to be invertible, which it is not if cos(a) is an eigenvalue of B.
+ */
+void SSFP2(QI::TwoPoolModel::VaryingArray const &varying,
+           QI::TwoPoolModel::Angles const &      angles,
+           double const                          TR,
+           Eigen::Ref<Eigen::ArrayXd>            out) {
+    double const &PD    = varying[0];
+    double const &T1_a  = varying[1];
+    double const &T2_a  = varying[2];
+    double const &T1_b  = varying[3];
+    double const &T2_b  = varying[4];
+    double const &tau_a = varying[5];
+    double const &f_a   = varying[6];
+    double const  E1_a  = exp(-TR / T1_a);
+    double const  E1_b  = exp(-TR / T1_b);
+    double const  E2_a  = exp(-TR / T2_a);
+    double const  E2_b  = exp(-TR / T2_b);
     double        f_b, k_ab, k_ba;
     QI::CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
-    const double         E_ab  = exp(-TR * k_ab / f_b);
-    const double         K1    = E_ab * f_b + f_a;
-    const double         K2    = E_ab * f_a + f_b;
-    const double         K3    = f_a * (1 - E_ab);
-    const double         K4    = f_b * (1 - E_ab);
-    const Eigen::ArrayXd alpha = B1 * ssfp.FA;
-    const Eigen::ArrayXd theta = ssfp.PhaseInc + 2. * M_PI * f0 * TR;
-
-    Eigen::MatrixXd M(4, ssfp.size());
-    Eigen::Matrix6d LHS;
-    Eigen::Vector6d RHS;
-    RHS << 0, 0, 0, 0, -E1_b * K3 * f_b + f_a * (-E1_a * K1 + 1),
-        -E1_a * K4 * f_a + f_b * (-E1_b * K2 + 1);
-
-    for (int i = 0; i < ssfp.size(); i++) {
-        const double ca  = cos(alpha[i]);
-        const double sa  = sin(alpha[i]);
-        const double cta = cos(theta[i]);
-        const double ctb = cos(theta[i]);
-        const double sta = sin(theta[i]);
-        const double stb = sin(theta[i]);
-
-        LHS << -E2_a * K1 * cta + ca, -E2_b * K3 * cta, E2_a * K1 * sta, E2_b * K3 * sta, sa, 0,
-            -E2_a * K4 * ctb, -E2_b * K2 * ctb + ca, E2_a * K4 * stb, E2_b * K2 * stb, 0, sa,
-            -E2_a * K1 * sta, -E2_b * K3 * sta, -E2_a * K1 * cta + 1, -E2_b * K3 * cta, 0, 0,
-            -E2_a * K4 * stb, -E2_b * K2 * stb, -E2_a * K4 * ctb, -E2_b * K2 * ctb + 1, 0, 0, -sa,
-            0, 0, 0, -E1_a * K1 + ca, -E1_b * K3, 0, -sa, 0, 0, -E1_a * K4, -E1_b * K2 + ca;
-        M.col(i).noalias() = PD * (LHS.partialPivLu().solve(RHS)).head(4);
+    double const E_ab = exp(-TR * k_ab / f_b);
+    double const K1   = E_ab * f_b + f_a;
+    double const K2   = E_ab * f_a + f_b;
+    double const K3   = f_a * (1 - E_ab);
+    double const K4   = f_b * (1 - E_ab);
+
+    Eigen::Matrix2d A, B;
+    Eigen::Vector2d r;
+    A << E2_a * K1, E2_b * K3, E2_a * K4, E2_b * K2;
+    B << E1_a * K1, E1_b * K3, E1_a * K4, E1_b * K2;
+    r << f_a * (1 - E1_a * K1) - E1_b * K3 * f_b, f_b * (1 - E1_b * K2) - E1_a * K4 * f_a;
+    Eigen::Matrix2d const I = Eigen::Matrix2d::Identity();
+
+    for (Eigen::Index i = 0; i < out.rows(); i++) {
+        double const          ca = angles.ssfp_cos[i];
+        double const          sa = angles.ssfp_sin[i];
+        double const          c  = angles.phase_cos[i];
+        double const          s  = angles.phase_sin[i];
+        Eigen::Matrix2d const YA = (I - c * A).inverse() * A; // y = s YA x
+        Eigen::Matrix2d const P  = ca * I - c * A + s * s * A * YA;
+        Eigen::Matrix2d const Q  = ca * I - B;
+        Eigen::Vector2d const x  = (Q * P + sa * sa * I).inverse() * (-sa * r);
+        Eigen::Vector2d const y  = s * YA * x;
+        out[i]                   = std::abs(PD) * std::sqrt(x.squaredNorm() + y.squaredNorm());
     }
-    return M;
 }
 } // namespace
 
@@ -115,49 +142,77 @@ std::vector<Eigen::ArrayXd> TwoPoolModel::signals(VaryingArray const &v,
 
 Eigen::ArrayXd TwoPoolModel::signal(const Eigen::ArrayXd &v,
                                     const QI_ARRAYN(double, NF) & f) const {
-    auto           sigs = signals(v, f);
     Eigen::ArrayXd sig(spgr.size() + ssfp.size());
-    sig.head(spgr.size()) = sigs[0];
-    sig.tail(ssfp.size()) = sigs[1];
+    signal(v, angles(f), sig);
     return sig;
 }
 
-Eigen::ArrayXd TwoPoolModel::spgr_signal(const Eigen::ArrayXd &varying,
-                                         const QI_ARRAYN(double, NF) & fixed) const {
-    const double &  PD    = varying[0];
-    const double &  T1_a  = varying[1];
-    const double &  T1_b  = varying[3];
-    const double &  tau_a = varying[5];
-    const double &  f_a   = varying[6];
-    const double &  B1    = fixed[1];
-    const double &  TR    = spgr.TR;
-    Eigen::Matrix2d A, eATR;
-    Eigen::Vector2d M0, Mobs;
-    Eigen::ArrayXd  signal(spgr.size());
-    double          k_ab, k_ba, f_b;
+TwoPoolModel::Angles TwoPoolModel::angles(FixedArray const &fixed) const {
+    double const &       f0    = fixed[0];
+    double const &       B1    = fixed[1];
+    Eigen::ArrayXd const phase = ssfp.PhaseInc + 2. * M_PI * f0 * ssfp.TR;
+    return {(B1 * spgr.FA).sin(),
+            (B1 * spgr.FA).cos(),
+            (B1 * ssfp.FA).sin(),
+            (B1 * ssfp.FA).cos(),
+            phase.sin(),
+            phase.cos()};
+}
+
+void TwoPoolModel::spgr_signal(VaryingArray const &       varying,
+                               Angles const &             angles,
+                               Eigen::Ref<Eigen::ArrayXd> out) const {
+    double const &PD    = varying[0];
+    double const &T1_a  = varying[1];
+    double const &T1_b  = varying[3];
+    double const &tau_a = varying[5];
+    double const &f_a   = varying[6];
+    double        k_ab, k_ba, f_b;
     CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
+    Eigen::Matrix2d A;
+    Eigen::Vector2d M0;
     M0 << f_a, f_b;
     A << ((1. / T1_a) + k_ab), -k_ba, -k_ab, ((1. / T1_b) + k_ba);
-    eATR                      = (-TR * A).exp();
-    const Eigen::Vector2d RHS = (Eigen::Matrix2d::Identity() - eATR) * M0;
-    for (int i = 0; i < spgr.size(); i++) {
-        const double a = spgr.FA[i] * B1;
-        Mobs = (Eigen::Matrix2d::Identity() - eATR * cos(a)).partialPivLu().solve(RHS * sin(a));
-        signal(i) = PD * Mobs.sum();
+    Eigen::Matrix2d const eATR = Exp2(-spgr.TR * A);
+    Eigen::Matrix2d const I    = Eigen::Matrix2d::Identity();
+    Eigen::Vector2d const RHS  = (I - eATR) * M0;
+    for (Eigen::Index i = 0; i < out.rows(); i++) {
+        Eigen::Vector2d const Mobs =
+            (I - eATR * angles.spgr_cos[i]).inverse() * (RHS * angles.spgr_sin[i]);
+        out[i] = PD * Mobs.sum();
     }
     if (scale_to_mean) {
-        signal /= signal.mean();
+        out /= out.mean();
     }
+}
+
+void TwoPoolModel::ssfp_signal(VaryingArray const &       varying,
+                               Angles const &             angles,
+                               Eigen::Ref<Eigen::ArrayXd> out) const {
+    SSFP2(varying, angles, ssfp.TR, out);
+    if (scale_to_mean) {
+        out /= out.mean();
+    }
+}
+
+void TwoPoolModel::signal(VaryingArray const &       varying,
+                          Angles const &             angles,
+                          Eigen::Ref<Eigen::ArrayXd> out) const {
+    spgr_signal(varying, angles, out.head(spgr.size()));
+    ssfp_signal(varying, angles, out.tail(ssfp.size()));
+}
+
+Eigen::ArrayXd TwoPoolModel::spgr_signal(const Eigen::ArrayXd &varying,
+                                         const QI_ARRAYN(double, NF) & fixed) const {
+    Eigen::ArrayXd signal(spgr.size());
+    spgr_signal(varying, angles(fixed), signal);
     return signal;
 }
 
 Eigen::ArrayXd TwoPoolModel::ssfp_signal(const Eigen::ArrayXd &varying,
                                          const QI_ARRAYN(double, NF) & fixed) const {
-    Eigen::MatrixXd M       = SSFP2(varying, fixed, ssfp);
-    QI_ARRAY(double) signal = M.array().square().colwise().sum().sqrt();
-    if (scale_to_mean) {
-        signal /= signal.mean();
-    }
+    Eigen::ArrayXd signal(ssfp.size());
+    ssfp_signal(varying, angles(fixed), signal);
     return signal;
 }
 
@@ -34,6 +34,14 @@ struct TwoPoolModel : Model<double, double, 7, 2, 2> {
     QI_ARRAYN(double, 7) bounds_lo;
     QI_ARRAYN(double, 7) bounds_hi;
 
+    /*
+     *  The sines and cosines of the flip angles and the SSFP phase only depend on the fixed
+     *  parameters, so for fitting they are calculated once per voxel instead of once per signal
+     */
+    struct Angles {
+        Eigen::ArrayXd spgr_sin, spgr_cos, ssfp_sin, ssfp_cos, phase_sin, phase_cos;
+    };
+
     TwoPoolModel(SPGRSequence const &s1, SSFPSequence const &s2, const bool scale);
     bool   valid(VaryingArray const &params) const; // For SRC
     size_t num_outputs() const;
@@ -47,6 +55,21 @@ struct TwoPoolModel : Model<double, double, 7, 2, 2> {
 
     std::vector<Eigen::ArrayXd> signals(VaryingArray const &varying, FixedArray const &fixed) const;
     Eigen::ArrayXd signal(const Eigen::ArrayXd &varying, const QI_ARRAYN(double, NF) & fixed) const;
+
+    /*
+     *  Versions of the above that do not allocate, for the inner loop of mcDESPOT. out must
+     *  already have the size of the sequence (or of both sequences for signal).
+     */
+    Angles angles(FixedArray const &fixed) const;
+    void   spgr_signal(VaryingArray const &       varying,
+                       Angles const &             angles,
+                       Eigen::Ref<Eigen::ArrayXd> out) const;
+    void   ssfp_signal(VaryingArray const &       varying,
+                       Angles const &             angles,
+                       Eigen::Ref<Eigen::ArrayXd> out) const;
+    void   signal(VaryingArray const &       varying,
+                  Angles const &             angles,
+                  Eigen::Ref<Eigen::ArrayXd> out) const;
 };
 
 } // End namespace QI
\ No newline at end of file
@@ -15,6 +15,7 @@
 // #define QI_DEBUG_BUILD 1
 
 #include "Args.h"
+#include "FitContext.h"
 #include "ImageIO.h"
 #include "Macro.h"
 #include "Model.h"
@@ -123,11 +124,12 @@ struct JSRModel : QI::Model<double, double, 4, 1, 2> {
     }
 };
 
-// Cost functors. These need to calculate the residuals
+// Cost functors. These need to calculate the residuals. The data and fixed parameters are held
+// in a per-thread FitContext so the Ceres problem can be re-used between voxels
 struct SPGRCost {
-    JSRModel const &     model;
-    JSRModel::FixedArray fixed;
-    QI_ARRAY(double) const data;
+    JSRModel const &            model;
+    JSRModel::FixedArray const &fixed;
+    QI_ARRAY(double) const &data;
 
     template <typename T> bool operator()(T const *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, JSRModel::NV) const> const varying(vin);
@@ -139,9 +141,9 @@ struct SPGRCost {
 };
 
 struct SSFPCost {
-    JSRModel const &     model;
-    JSRModel::FixedArray fixed;
-    QI_ARRAY(double) const data;
+    JSRModel const &            model;
+    JSRModel::FixedArray const &fixed;
+    QI_ARRAY(double) const &data;
 
     template <typename T> bool operator()(T const *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, JSRModel::NV) const> const varying(vin);
@@ -196,28 +198,31 @@ struct JSRFit {
             rmse         = 0.0;
             return {false, "Maximum data value was zero or less"};
         }
-        Eigen::ArrayXd const spgr_data = inputs[0] / scale;
-        Eigen::ArrayXd const ssfp_data = inputs[1] / scale;
-
         // Setup Ceres
-        ceres::Problem problem;
-        using AutoSPGRType = ceres::AutoDiffCostFunction<SPGRCost, ceres::DYNAMIC, ModelType::NV>;
-        using AutoSSFPType = ceres::AutoDiffCostFunction<SSFPCost, ceres::DYNAMIC, ModelType::NV>;
-        auto *spgr_cost =
-            new AutoSPGRType(new SPGRCost{model, fixed, spgr_data}, model.spgr.size());
-        auto *ssfp_cost =
-            new AutoSSFPType(new SSFPCost{model, fixed, ssfp_data}, model.ssfp.size());
-        ceres::LossFunction *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
-        // This is where the parameters and cost functions actually get added to Ceres
-        ModelType::VaryingArray varying;
-        problem.AddResidualBlock(spgr_cost, loss, varying.data());
-        problem.AddResidualBlock(ssfp_cost, loss, varying.data());
-
-        // Set up parameter bounds
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(varying.data(), i, model.bounds_lo[i]);
-            problem.SetParameterUpperBound(varying.data(), i, model.bounds_hi[i]);
-        }
+        auto &ctx     = QI::ThreadFitContext<JSRFit, ModelType, 2>();
+        auto &problem = ctx.Prepare(this, [&](auto &c) {
+            using AutoSPGRType =
+                ceres::AutoDiffCostFunction<SPGRCost, ceres::DYNAMIC, ModelType::NV>;
+            using AutoSSFPType =
+                ceres::AutoDiffCostFunction<SSFPCost, ceres::DYNAMIC, ModelType::NV>;
+            c.data[0].resize(model.spgr.size());
+            c.data[1].resize(model.ssfp.size());
+            auto *spgr_cost =
+                new AutoSPGRType(new SPGRCost{model, c.fixed, c.data[0]}, model.spgr.size());
+            auto *ssfp_cost =
+                new AutoSSFPType(new SSFPCost{model, c.fixed, c.data[1]}, model.ssfp.size());
+            ceres::LossFunction *loss = new ceres::HuberLoss(1.0); // Don't know if this helps
+            // This is where the parameters and cost functions actually get added to Ceres
+            c.problem->AddResidualBlock(spgr_cost, loss, c.varying.data());
+            c.problem->AddResidualBlock(ssfp_cost, loss, c.varying.data());
+        });
+        ctx.data[0]           = inputs[0] / scale;
+        ctx.data[1]           = inputs[1] / scale;
+        ctx.fixed             = fixed;
+        auto const &spgr_data = ctx.data[0];
+        auto const &ssfp_data = ctx.data[1];
+        auto &      varying   = ctx.varying;
+        ctx.SetBounds(model.bounds_lo, model.bounds_hi);
 
         ceres::Solver::Options options;
         ceres::Solver::Summary summary;
@@ -227,13 +232,17 @@ struct JSRFit {
         options.parameter_tolerance = 1e-5;
         options.logging_type        = ceres::SILENT;
 
-        // We need to do 2 starts for JSR in case off-resonance is very high
+        // We need to do 2 starts for JSR in case off-resonance is very high, unless we have a
+        // neighbour's solution to start from
+        auto &       warm      = QI::ThreadWarmStart<ModelType>();
+        int const    n_starts  = warm.use ? 1 : n_psi;
         double       best_cost = std::numeric_limits<double>::max();
         double const psi_step  = (n_psi % 2) ? 2 * M_PI / (n_psi - 1) : 2 * M_PI / (n_psi);
         double       psi       = (n_psi == 1) ? 0 : -M_PI;
-        for (int p = 0; p < n_psi; p++, psi += psi_step) {
+        for (int p = 0; p < n_starts; p++, psi += psi_step) {
             varying    = model.start;
             varying[3] = psi;
+            warm.Apply(varying);
             ceres::Solve(options, &problem, &summary);
             if (!summary.IsSolutionUsable()) {
                 return {false, summary.FullReport()};
@@ -244,6 +253,7 @@ struct JSRFit {
                 best_cost    = summary.final_cost;
             }
         }
+        warm.Save(best_varying);
         Eigen::ArrayXd const spgr_residual = (spgr_data - model.spgr_signal(best_varying, fixed));
         Eigen::ArrayXd const ssfp_residual = (ssfp_data - model.ssfp_signal(best_varying, fixed));
         if (residuals.size() > 0) {
@@ -296,6 +306,7 @@ int jsr_main(int argc, char **argv) {
     JSRFit   jsr_fit{model, npsi.Get()};
     auto     fit_filter =
         QI::ModelFitFilter<JSRFit>::New(&jsr_fit, verbose, covar, resids, subregion.Get());
+    QI_FIT_FILTER_ARGS(fit_filter);
     fit_filter->ReadInputs({spgr_path.Get(), ssfp_path.Get()}, {b1_path.Get()}, mask.Get());
     fit_filter->Update();
     fit_filter->WriteOutputs(prefix.Get() + "JSR_");
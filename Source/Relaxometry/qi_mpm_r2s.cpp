@@ -12,6 +12,7 @@
 #include <Eigen/Core>
 
 #include "Args.h"
+#include "FitContext.h"
 #include "ImageIO.h"
 #include "Model.h"
 #include "ModelFitFilter.h"
@@ -63,7 +64,7 @@ struct MPMModel : QI::Model<double, double, 4, 0, 3> {
 
 struct PDwCost {
     MPMModel const &model;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) const &data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, MPMModel::NV) const> const v(vin);
@@ -77,7 +78,7 @@ struct PDwCost {
 
 struct T1wCost {
     MPMModel const &model;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) const &data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, MPMModel::NV) const> const v(vin);
@@ -91,7 +92,7 @@ struct T1wCost {
 
 struct MTwCost {
     MPMModel const &model;
-    QI_ARRAY(double) const data;
+    QI_ARRAY(double) const &data;
 
     template <typename T> bool operator()(const T *const vin, T *rin) const {
         Eigen::Map<QI_ARRAYN(T, MPMModel::NV) const> const v(vin);
@@ -140,25 +141,34 @@ struct MPMFit {
             rmse = 0.0;
             return {false, "Maximum data value was zero or less"};
         }
-        Eigen::ArrayXd const pdw_data = inputs[0] / scale;
-        Eigen::ArrayXd const t1w_data = inputs[1] / scale;
-        Eigen::ArrayXd const mtw_data = inputs[2] / scale;
-        v << 20., 1., 1., 1.; // R2s, S_PDw, S_T1w, S_MTw
-        ceres::Problem problem;
-        using AutoPDwType = ceres::AutoDiffCostFunction<PDwCost, ceres::DYNAMIC, ModelType::NV>;
-        using AutoT1wType = ceres::AutoDiffCostFunction<T1wCost, ceres::DYNAMIC, ModelType::NV>;
-        using AutoMTwType = ceres::AutoDiffCostFunction<MTwCost, ceres::DYNAMIC, ModelType::NV>;
-        auto *pdw_cost    = new AutoPDwType(new PDwCost{model, pdw_data}, model.pdw_s.size());
-        auto *t1w_cost    = new AutoT1wType(new T1wCost{model, t1w_data}, model.t1w_s.size());
-        auto *mtw_cost    = new AutoMTwType(new MTwCost{model, mtw_data}, model.mtw_s.size());
-        ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
-        problem.AddResidualBlock(pdw_cost, loss, v.data());
-        problem.AddResidualBlock(t1w_cost, loss, v.data());
-        problem.AddResidualBlock(mtw_cost, loss, v.data());
-        for (int i = 0; i < ModelType::NV; i++) {
-            problem.SetParameterLowerBound(v.data(), i, model.lo[i]);
-            problem.SetParameterUpperBound(v.data(), i, model.hi[i]);
-        }
+        auto &ctx     = QI::ThreadFitContext<MPMFit, ModelType, 3>();
+        auto &problem = ctx.Prepare(this, [&](auto &c) {
+            using AutoPDwType =
+                ceres::AutoDiffCostFunction<PDwCost, ceres::DYNAMIC, ModelType::NV>;
+            using AutoT1wType =
+                ceres::AutoDiffCostFunction<T1wCost, ceres::DYNAMIC, ModelType::NV>;
+            using AutoMTwType =
+                ceres::AutoDiffCostFunction<MTwCost, ceres::DYNAMIC, ModelType::NV>;
+            c.data[0].resize(model.pdw_s.size());
+            c.data[1].resize(model.t1w_s.size());
+            c.data[2].resize(model.mtw_s.size());
+            auto *pdw_cost = new AutoPDwType(new PDwCost{model, c.data[0]}, model.pdw_s.size());
+            auto *t1w_cost = new AutoT1wType(new T1wCost{model, c.data[1]}, model.t1w_s.size());
+            auto *mtw_cost = new AutoMTwType(new MTwCost{model, c.data[2]}, model.mtw_s.size());
+            ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
+            c.problem->AddResidualBlock(pdw_cost, loss, c.varying.data());
+            c.problem->AddResidualBlock(t1w_cost, loss, c.varying.data());
+            c.problem->AddResidualBlock(mtw_cost, loss, c.varying.data());
+        });
+        ctx.data[0]          = inputs[0] / scale;
+        ctx.data[1]          = inputs[1] / scale;
+        ctx.data[2]          = inputs[2] / scale;
+        auto const &pdw_data = ctx.data[0];
+        auto const &t1w_data = ctx.data[1];
+        auto const &mtw_data = ctx.data[2];
+        ctx.varying << 20., 1., 1., 1.; // R2s, S_PDw, S_T1w, S_MTw
+        ctx.SetBounds(model.lo, model.hi);
+        QI::ThreadWarmStart<ModelType>().Apply(ctx.varying);
         ceres::Solver::Options options;
         ceres::Solver::Summary summary;
         options.max_num_iterations  = 50;
@@ -167,10 +177,12 @@ struct MPMFit {
         options.parameter_tolerance = 1e-4;
         options.logging_type        = ceres::SILENT;
         ceres::Solve(options, &problem, &summary);
+        v = ctx.varying;
         if (!summary.IsSolutionUsable()) {
             return {false, summary.FullReport()};
         }
         iterations = summary.iterations.size();
+        QI::ThreadWarmStart<ModelType>().Save(ctx.varying);
 
         Eigen::ArrayXd const pdw_resid = pdw_data - model.pdw_signal(v);
         Eigen::ArrayXd const t1w_resid = t1w_data - model.t1w_signal(v);
@@ -184,7 +196,8 @@ struct MPMFit {
             pdw_resid.square().sum() + t1w_resid.square().sum() + mtw_resid.square().sum();
         int const dsize = model.pdw_s.size() + model.t1w_s.size() + model.mtw_s.size();
         if (cov) {
-            QI::GetModelCovariance<MPMModel>(problem, v, var / (dsize - ModelType::NV), cov);
+            QI::GetModelCovariance<MPMModel>(
+                problem, ctx.varying, var / (dsize - ModelType::NV), cov);
         }
         rmse      = sqrt(var / dsize);
         v.tail(3) = v.tail(3) * scale; // Multiply signals/proton densities back up
@@ -219,6 +232,7 @@ int mpm_r2s_main(int argc, char **argv) {
     MPMFit   mpm_fit{model};
     auto     fit_filter =
         QI::ModelFitFilter<MPMFit>::New(&mpm_fit, verbose, covar, resids, subregion.Get());
+    QI_FIT_FILTER_ARGS(fit_filter);
     fit_filter->ReadInputs({pdw_path.Get(), t1w_path.Get(), mtw_path.Get()}, {}, mask.Get());
     fit_filter->Update();
     fit_filter->WriteOutputs(prefix.Get() + "MPM_");
@@ -128,6 +128,7 @@ int planet_main(int argc, char **argv) {
         PLANETFit fit{model};
         auto      fit_filter =
             QI::ModelFitFilter<PLANETFit>::New(&fit, verbose, false, false, subregion.Get());
+        QI_FIT_FILTER_ARGS(fit_filter);
         fit_filter->ReadInputs({G_path.Get(), a_path.Get(), b_path.Get()}, {B1.Get()}, mask.Get());
         fit_filter->SetBlocks(ssfp.size());
         fit_filter->Update();
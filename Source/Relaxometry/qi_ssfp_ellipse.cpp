@@ -211,6 +211,7 @@ int ssfp_ellipse_main(int argc, char **argv) {
         EllipseFit fit{model};
         auto       fit_filter =
             QI::ModelFitFilter<EllipseFit>::New(&fit, verbose, covar, resids, subregion.Get());
+        QI_FIT_FILTER_ARGS(fit_filter);
         fit_filter->ReadInputs({sequence_path.Get()}, {}, mask.Get());
         fit_filter->SetBlocks(fit_filter->GetInput(0)->GetNumberOfComponentsPerPixel() /
                               sequence.size());
@@ -214,6 +214,7 @@ int despot1hifi_main(int argc, char **argv) {
         HIFIFit hifi_fit{model};
         auto    fit_filter =
             QI::ModelFitFilter<HIFIFit>::New(&hifi_fit, verbose, covar, resids, subregion.Get());
+        QI_FIT_FILTER_ARGS(fit_filter);
         fit_filter->ReadInputs(
             {QI::CheckPos(spgr_path), QI::CheckPos(mprage_path)}, {}, mask.Get());
         fit_filter->Update();
@@ -17,6 +17,7 @@
 #include "Args.h"
 #include "FitFunction.h"
 #include "ImageIO.h"
+#include "LinearFits.h"
 #include "Model.h"
 #include "ModelFitFilter.h"
 #include "SSFPSequence.h"
@@ -59,6 +60,130 @@ struct DESPOT2 : QI::Model<double, double, 2, 2> {
 
 using DESPOT2Fit = QI::FitFunction<DESPOT2>;
 
+/*
+ *  The linear fits regress y = S / sin(a) against x = S / tan(a), see LinearFits.h, and then
+ *  convert the slope and intercept to PD and T2. T is either double for one voxel or an Eigen
+ *  array for a block, and E1 matches it.
+ */
+template <typename T>
+void DESPOT2Regression(DESPOT2 const &model,
+                       T const &      sw,
+                       T const &      sx,
+                       T const &      sy,
+                       T const &      sxx,
+                       T const &      sxy,
+                       T const &      E1,
+                       T &            PD,
+                       T &            T2) {
+    using std::log;
+    using std::sqrt;
+    T slope, inter;
+    QI::LineFit(sw, sx, sy, sxx, sxy, slope, inter);
+    T const ratio = (slope * E1 - 1.) / (slope - E1);
+    T       E2;
+    if (model.elliptical) {
+        T2 = 2. * model.sequence.TR / log(ratio);
+        E2 = 1. / sqrt(ratio);
+        PD = inter * (1. - E1 * E2 * E2) / (sqrt(E2) * (1. - E1));
+    } else {
+        T2 = model.sequence.TR / log(ratio);
+        E2 = 1. / ratio;
+        PD = inter * (1. - E1 * E2) / (sqrt(E2) * (1. - E1));
+    }
+}
+
+/*
+ *  The denominator of the signal equation, also needed for the WLLS weights, is
+ *  1 - E1 * F - (E1 - F) * cos(a), where F is E2 or E2^2 for the elliptical signal
+ */
+template <typename T> T DESPOT2F(DESPOT2 const &model, T const &E2) {
+    return model.elliptical ? T(E2 * E2) : E2;
+}
+
+/*
+ *  The flip angle tables for a block of voxels in the batched fits, which are reused for every
+ *  WLLS iteration and for the residuals. E1 is fixed for each voxel by the T1 map.
+ */
+struct DESPOT2Block : QI::FlipAngleTables {
+    Eigen::ArrayXd const E1;
+
+    DESPOT2Block(DESPOT2 const &model, QI::FitBatch<DESPOT2> const &batch) :
+        QI::FlipAngleTables(model.sequence.FA, batch.fixed.col(1), batch.inputs[0]),
+        E1{(-model.sequence.TR / batch.fixed.col(0)).exp()} {}
+
+    /*
+     *  Clamps the parameters and fills in the RMSE and residuals
+     */
+    void finish(DESPOT2 const &model, QI::FitBatch<DESPOT2> &batch) const {
+        batch.varying.col(0) =
+            QI::Clamp(batch.varying.col(0), model.bounds_lo[0], model.bounds_hi[0]);
+        batch.varying.col(1) =
+            QI::Clamp(batch.varying.col(1), model.bounds_lo[1], model.bounds_hi[1]);
+        auto const &         data = batch.inputs[0];
+        Eigen::ArrayXd const E2   = (-model.sequence.TR / batch.varying.col(1)).exp();
+        Eigen::ArrayXd const F    = DESPOT2F(model, E2);
+        Eigen::ArrayXd const M    = batch.varying.col(0) * E2.sqrt() * (1. - E1);
+        batch.rmse.setZero();
+        for (Eigen::Index j = 0; j < sin_a.cols(); j++) {
+            Eigen::ArrayXd const r =
+                data.col(j) - M * sin_a.col(j) / (1. - E1 * F - (E1 - F) * cos_a.col(j));
+            if (batch.residuals.size() > 0) {
+                batch.residuals[0].col(j) = r;
+            }
+            batch.rmse += r.square();
+        }
+        batch.rmse = (batch.rmse / sin_a.cols()).sqrt();
+    }
+};
+
+/*
+ *  The per-voxel fits below use the same regression with scalar sums, and are only used when
+ *  the batched versions are not
+ */
+void DESPOT2Sums(DESPOT2 const &             model,
+                 Eigen::ArrayXd const &      data,
+                 double const                B1,
+                 double const                E1,
+                 bool const                  weighted,
+                 double const                E2,
+                 Eigen::Array<double, 5, 1> &sums) {
+    double const F = DESPOT2F(model, E2);
+    sums.setZero();
+    for (Eigen::Index j = 0; j < data.rows(); j++) {
+        double const a = model.sequence.FA[j] * B1;
+        double const y = data[j] / sin(a);
+        double const x = y * cos(a);
+        double const g = (1. - E1 * E2) * sin(a) / (1. - E1 * F - (E1 - F) * cos(a));
+        double const w = weighted ? g * g : 1.;
+        sums += Eigen::Array<double, 5, 1>{w, w * x, w * y, w * x * x, w * x * y};
+    }
+}
+
+void DESPOT2Residuals(DESPOT2 const &              model,
+                      Eigen::ArrayXd const &       data,
+                      DESPOT2::FixedArray const &  fixed,
+                      DESPOT2::VaryingArray const &p,
+                      double &                     rmse,
+                      std::vector<Eigen::ArrayXd> &residuals) {
+    double const E1 = exp(-model.sequence.TR / fixed[0]);
+    double const E2 = exp(-model.sequence.TR / p[1]);
+    double const F  = DESPOT2F(model, E2);
+    double const M  = p[0] * sqrt(E2) * (1. - E1);
+    if (residuals.size() > 0) { // Residuals will only be allocated if the user asked for them
+        residuals[0].resize(data.rows());
+    }
+    double sum = 0;
+    for (Eigen::Index j = 0; j < data.rows(); j++) {
+        double const a = model.sequence.FA[j] * fixed[1];
+        double const r = data[j] - M * sin(a) / (1. - E1 * F - (E1 - F) * cos(a));
+        if (residuals.size() > 0) {
+            residuals[0][j] = r;
+        }
+        sum += r * r;
+    }
+    rmse = sqrt(sum / data.rows());
+}
+
 struct DESPOT2LLS : DESPOT2Fit {
     using DESPOT2Fit::DESPOT2Fit;
     QI::FitReturnType fit(const std::vector<QI_ARRAY(InputType)> &inputs,
@@ -68,38 +193,34 @@ struct DESPOT2LLS : DESPOT2Fit {
                           RMSErrorType &                    residual,
                           std::vector<QI_ARRAY(InputType)> &residuals,
                           FlagType &                        iterations) const override {
-        const Eigen::ArrayXd &data = inputs[0];
-        const double &        T1   = fixed[0];
-        const double &        B1   = fixed[1];
-        const double &        TR   = model.sequence.TR;
-        const double          E1   = exp(-TR / T1);
-        double                PD, T2, E2;
-        const Eigen::ArrayXd  angles = (model.sequence.FA * B1);
-
-        Eigen::VectorXd Y = data / sin(angles);
-        Eigen::MatrixXd X(Y.rows(), 2);
-        X.col(0) = data / tan(angles);
-        X.col(1).setOnes();
-        Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
-        if (model.elliptical) {
-            T2 = 2. * TR / log((b[0] * E1 - 1.) / (b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1 * E2 * E2) / (sqrt(E2) * (1. - E1));
-        } else {
-            T2 = TR / log((b[0] * E1 - 1.) / (b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1 * E2) / (sqrt(E2) * (1. - E1));
-        }
+        const Eigen::ArrayXd &     data = inputs[0];
+        double const               E1   = exp(-model.sequence.TR / fixed[0]);
+        Eigen::Array<double, 5, 1> s;
+        double                     PD, T2;
+        DESPOT2Sums(model, data, fixed[1], E1, false, 1., s);
+        DESPOT2Regression(model, s[0], s[1], s[2], s[3], s[4], E1, PD, T2);
         outputs << QI::Clamp(PD, model.bounds_lo[0], model.bounds_hi[0]),
             QI::Clamp(T2, model.bounds_lo[1], model.bounds_hi[1]);
-        Eigen::ArrayXd r = data - model.signal(outputs, fixed);
-        if (residuals.size() > 0) { // Residuals will only be allocated if the user asked for them
-            residuals[0] = r;
-        }
-        residual   = sqrt(r.square().sum() / r.rows());
+        DESPOT2Residuals(model, data, fixed, outputs, residual, residuals);
         iterations = 1;
         return {true, ""};
     }
+
+    /*
+     * The same regression for a whole block of voxels, with the sums accumulated column by column
+     * so that each step is a vectorised operation across the voxels
+     */
+    QI::FitReturnType fit_batch(QI::FitBatch<DESPOT2> &batch) const {
+        DESPOT2Block const block(model, batch);
+        Eigen::ArrayXd     sw, sx, sy, sxx, sxy, PD, T2;
+        block.sums(sw, sx, sy, sxx, sxy);
+        DESPOT2Regression(model, sw, sx, sy, sxx, sxy, block.E1, PD, T2);
+        batch.varying.col(0) = PD;
+        batch.varying.col(1) = T2;
+        block.finish(model, batch);
+        batch.flags.setOnes();
+        return {true, ""};
+    }
 };
 
 struct DESPOT2WLLS : DESPOT2Fit {
@@ -111,59 +232,60 @@ struct DESPOT2WLLS : DESPOT2Fit {
                           RMSErrorType &                    residual,
                           std::vector<QI_ARRAY(InputType)> &residuals,
                           FlagType &                        iterations) const override {
-        const Eigen::ArrayXd &data = inputs[0];
-        const double &        T1   = fixed[0];
-        const double &        B1   = fixed[1];
-        const double          TR   = model.sequence.TR;
-        const double          E1   = exp(-TR / T1);
-        double                PD, T2, E2;
-        const Eigen::ArrayXd  angles = (model.sequence.FA * B1);
-
-        Eigen::VectorXd Y = data / angles.sin();
-        Eigen::MatrixXd X(Y.rows(), 2);
-        X.col(0) = data / angles.tan();
-        X.col(1).setOnes();
-        Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
-        if (model.elliptical) {
-            T2 = 2. * TR / log((b[0] * E1 - 1.) / (b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1 * E2 * E2) / (sqrt(E2) * (1. - E1));
-        } else {
-            T2 = TR / log((b[0] * E1 - 1.) / (b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1 * E2) / (1. - E1);
-        }
-        Eigen::VectorXd W(model.sequence.size());
+        const Eigen::ArrayXd &     data = inputs[0];
+        double const               TR   = model.sequence.TR;
+        double const               E1   = exp(-TR / fixed[0]);
+        Eigen::Array<double, 5, 1> s;
+        Eigen::Array2d             out, newOut;
+        DESPOT2Sums(model, data, fixed[1], E1, false, 1., s);
+        DESPOT2Regression(model, s[0], s[1], s[2], s[3], s[4], E1, out[0], out[1]);
         for (iterations = 0; iterations < model.max_iterations; iterations++) {
-            if (model.elliptical) {
-                W = ((1. - E1 * E2) * angles.sin() /
-                     (1. - E1 * E2 * E2 - (E1 - E2 * E2) * angles.cos()))
-                        .square();
-            } else {
-                W = ((1. - E1 * E2) * angles.sin() / (1. - E1 * E2 - (E1 - E2) * angles.cos()))
-                        .square();
-            }
-            b = (X.transpose() * W.asDiagonal() * X)
-                    .partialPivLu()
-                    .solve(X.transpose() * W.asDiagonal() * Y);
-            if (model.elliptical) {
-                T2 = 2. * TR / log((b[0] * E1 - 1.) / (b[0] - E1));
-                E2 = exp(-TR / T2);
-                PD = b[1] * (1. - E1 * E2 * E2) / (sqrt(E2) * (1. - E1));
-            } else {
-                T2 = TR / log((b[0] * E1 - 1.) / (b[0] - E1));
-                E2 = exp(-TR / T2);
-                PD = b[1] * (1. - E1 * E2) / (1. - E1);
-            }
+            DESPOT2Sums(model, data, fixed[1], E1, true, exp(-TR / out[1]), s);
+            DESPOT2Regression(model, s[0], s[1], s[2], s[3], s[4], E1, newOut[0], newOut[1]);
+            if (newOut.isApprox(out))
+                break;
+            else
+                out = newOut;
         }
-        outputs[0] = QI::Clamp(PD, model.bounds_lo[0], model.bounds_hi[0]);
-        outputs[1] = QI::Clamp(T2, model.bounds_lo[1], model.bounds_hi[1]);
-        Eigen::Array2d v{PD, T2};
-        Eigen::ArrayXd r = data - model.signal(v, fixed);
-        if (residuals.size() > 0) { // Residuals will only be allocated if the user asked for them
-            residuals[0] = r;
+        outputs[0] = QI::Clamp(out[0], model.bounds_lo[0], model.bounds_hi[0]);
+        outputs[1] = QI::Clamp(out[1], model.bounds_lo[1], model.bounds_hi[1]);
+        DESPOT2Residuals(model, data, fixed, outputs, residual, residuals);
+        return {true, ""};
+    }
+
+    /*
+     * The iterations run in lock-step across the block. Voxels that have converged keep their
+     * parameters and iteration count, and the loop stops when all of them have converged.
+     */
+    QI::FitReturnType fit_batch(QI::FitBatch<DESPOT2> &batch) const {
+        DESPOT2Block const block(model, batch);
+        Eigen::ArrayXd     sw, sx, sy, sxx, sxy, PD, T2, newPD, newT2, E2, F;
+        block.sums(sw, sx, sy, sxx, sxy);
+        DESPOT2Regression(model, sw, sx, sy, sxx, sxy, block.E1, PD, T2);
+
+        QI::ActiveMask active = QI::ActiveMask::Ones(batch.capacity());
+        batch.flags.setConstant(model.max_iterations);
+        for (int it = 0; it < model.max_iterations && active.any(); it++) {
+            E2 = (-model.sequence.TR / T2).exp();
+            F  = DESPOT2F(model, E2);
+            block.sums(
+                [&](Eigen::Index const j) {
+                    auto const &E1 = block.E1;
+                    return ((1. - E1 * E2) * block.sin_a.col(j) /
+                            (1. - E1 * F - (E1 - F) * block.cos_a.col(j)))
+                        .square();
+                },
+                sw,
+                sx,
+                sy,
+                sxx,
+                sxy);
+            DESPOT2Regression(model, sw, sx, sy, sxx, sxy, block.E1, newPD, newT2);
+            QI::LockStep(it, newPD, newT2, PD, T2, active, batch.flags);
         }
-        residual = sqrt(r.square().sum() / r.rows());
+        batch.varying.col(0) = PD;
+        batch.varying.col(1) = T2;
+        block.finish(model, batch);
         return {true, ""};
     }
 };
@@ -259,29 +381,37 @@ int despot2_main(int argc, char **argv) {
                                           simulate.Get(),
                                           subregion.Get());
     } else {
-        DESPOT2Fit *d2 = nullptr;
+        if (gs_arg) {
+            QI::Log(verbose, "GS Mode selected");
+            model.elliptical = true;
+        }
+        // Instantiate the filter with the concrete fit type so it can detect fit_batch()
+        auto process = [&](auto const &d2) {
+            using FitType = std::remove_cv_t<std::remove_reference_t<decltype(d2)>>;
+            auto fit =
+                QI::ModelFitFilter<FitType>::New(&d2, verbose, covar, resids, subregion.Get());
+            QI_FIT_FILTER_ARGS(fit);
+            fit->ReadInputs(
+                {QI::CheckPos(ssfp_path)}, {QI::CheckPos(t1_path), B1.Get()}, mask.Get());
+            fit->Update();
+            fit->WriteOutputs(prefix.Get() + "D2_");
+        };
         switch (algorithm.Get()) {
         case 'l':
-            d2 = new DESPOT2LLS(model);
             QI::Log(verbose, "LLS algorithm selected.");
+            process(DESPOT2LLS{model});
             break;
         case 'w':
-            d2 = new DESPOT2WLLS(model);
             QI::Log(verbose, "WLLS algorithm selected.");
+            process(DESPOT2WLLS{model});
             break;
         case 'n':
-            d2 = new DESPOT2NLLS(model);
             QI::Log(verbose, "NLLS algorithm selected.");
+            process(DESPOT2NLLS{model});
             break;
+        default:
+            QI::Fail("Unknown algorithm type: {}", algorithm.Get());
         }
-        if (gs_arg) {
-            QI::Log(verbose, "GS Mode selected");
-            d2->model.elliptical = true;
-        }
-        auto fit = QI::ModelFitFilter<DESPOT2Fit>::New(d2, verbose, covar, resids, subregion.Get());
-        fit->ReadInputs({QI::CheckPos(ssfp_path)}, {QI::CheckPos(t1_path), B1.Get()}, mask.Get());
-        fit->Update();
-        fit->WriteOutputs(prefix.Get() + "D2_");
         QI::Log(verbose, "Finished.");
     }
     return EXIT_SUCCESS;
@@ -82,7 +82,19 @@ struct FMNLLS : FMFit {
             // Improve scaling by dividing the PD down to something sensible.
             // This gets scaled back up at the end.
             const double         scale = inputs[0].maxCoeff();
-            const Eigen::ArrayXd data  = inputs[0] / scale;
+            auto &ctx     = QI::ThreadFitContext<FMNLLS, FMModel>();
+            auto &problem = ctx.Prepare(this, [&](auto &c) {
+                using Cost     = QI::ContextCost<FMModel>;
+                using AutoCost = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, FMModel::NV>;
+                c.data[0].resize(model.sequence.size());
+                auto *cost = new Cost{model, c.fixed, c.data[0]};
+                c.problem->AddResidualBlock(
+                    new AutoCost(cost, model.sequence.size()), NULL, c.varying.data());
+            });
+            ctx.data[0]      = inputs[0] / scale;
+            ctx.fixed        = fixed;
+            auto const &data = ctx.data[0];
+            auto &      p    = ctx.varying;
 
             std::vector<double> f0_starts = {0, 0.4 / model.sequence.TR};
             if (this->asymmetric) {
@@ -91,14 +103,8 @@ struct FMNLLS : FMFit {
                 f0_starts.push_back(-0.4 / model.sequence.TR);
             }
 
-            double         best = std::numeric_limits<double>::infinity();
-            Eigen::Array3d p;
-            ceres::Problem problem;
-            using Cost      = QI::ModelCost<FMModel>;
-            using AutoCost  = ceres::AutoDiffCostFunction<Cost, ceres::DYNAMIC, FMModel::NV>;
-            auto *cost      = new Cost{model, fixed, data};
-            auto *auto_cost = new AutoCost(cost, model.sequence.size());
-            problem.AddResidualBlock(auto_cost, NULL, p.data());
+            double best = std::numeric_limits<double>::infinity();
+            // The T2 upper bound depends on T1, so has to be set for every voxel
             problem.SetParameterLowerBound(p.data(), 0, 1.);
             problem.SetParameterLowerBound(p.data(), 1, model.sequence.TR);
             problem.SetParameterUpperBound(p.data(), 1, T1);
@@ -193,6 +199,7 @@ int despot2fm_main(int argc, char **argv) {
         fm.asymmetric     = asym.Get();
         auto fit_filter =
             QI::ModelFitFilter<FMNLLS>::New(&fm, verbose, covar, resids, subregion.Get());
+        QI_FIT_FILTER_ARGS(fit_filter);
         fit_filter->ReadInputs(
             {QI::CheckPos(ssfp_path)}, {QI::CheckPos(t1_path), B1.Get()}, mask.Get());
         fit_filter->Update();
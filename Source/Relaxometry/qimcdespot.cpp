@@ -22,6 +22,7 @@
 #include "RegionContraction.h"
 #include "SPGRSequence.h"
 #include "SSFPSequence.h"
+#include "SignalLibrary.h"
 #include "SimulateModel.h"
 #include "ThreePoolModel.h"
 #include "TwoPoolModel.h"
@@ -31,13 +32,14 @@ template <typename Model> struct MCDSRCFunctor {
     const Eigen::ArrayXd data, weights;
     const QI_ARRAYN(double, Model::NF) fixed;
     const Model &model;
+    const typename Model::Angles angles; // Only depend on fixed, so shared by every sample
 
     MCDSRCFunctor(const Model &m,
                   const QI_ARRAYN(double, Model::NF) & f,
                   const Eigen::ArrayXd &d,
                   const Eigen::ArrayXd &w) :
         data(d),
-        weights(w), fixed(f), model(m) {
+        weights(w), fixed(f), model(m), angles(m.angles(f)) {
         assert(data.rows() == model.sequence.size());
     }
 
@@ -49,12 +51,30 @@ template <typename Model> struct MCDSRCFunctor {
     }
 
     Eigen::ArrayXd residuals(const QI_ARRAYN(double, Model::NV) & varying) const {
-        return data - model.signal(varying, fixed);
+        Eigen::ArrayXd signal(data.rows());
+        model.signal(varying, angles, signal);
+        return data - signal;
     }
 
     double operator()(const QI_ARRAYN(double, Model::NV) & varying) const {
         return (residuals(varying) * weights).square().sum();
     }
+
+    /*
+     * The same cost for a range of the samples from one contraction, see RegionContraction.h
+     */
+    void costs(Eigen::ArrayXXd const &samples,
+               Eigen::Index const     first,
+               Eigen::Index const     last,
+               Eigen::ArrayXd &       out) const {
+        QI_ARRAYN(double, Model::NV) varying;
+        Eigen::ArrayXd signal(data.rows());
+        for (Eigen::Index s = first; s < last; s++) {
+            varying = samples.col(s);
+            model.signal(varying, angles, signal);
+            out[s] = ((data - signal) * weights).square().sum();
+        }
+    }
 };
 
 template <typename Model> struct SRCFit {
@@ -80,7 +100,10 @@ template <typename Model> struct SRCFit {
 
     int    max_iterations = 5;
     size_t src_samples = 5000, src_retain = 50;
-    bool   src_gauss = true;
+    bool   src_gauss   = true;
+    int    src_threads = 1;
+
+    std::shared_ptr<QI::SignalLibrary<Model> const> library; // Optional
 
     QI::FitReturnType fit(const std::vector<Eigen::ArrayXd> &inputs,
                           typename Model::FixedArray const & fixed,
@@ -106,16 +129,35 @@ template <typename Model> struct SRCFit {
         weights.tail(model.ssfp.size()) = model.ssfp.weights(f0);
         using Functor                   = MCDSRCFunctor<Model>;
         Functor                        func(model, fixed, data, weights);
+        // With a start point from a neighbour or a coarser fit, search close to it
+        typename Model::VaryingArray lo = model.bounds_lo, hi = model.bounds_hi;
+        auto &                       warm         = QI::ThreadWarmStart<Model>();
+        int                          looked_up    = 0;
+        int                          contractions = max_iterations;
+        if (library && !warm.use) {
+            // The library lookup takes the place of the first contraction
+            library->Narrow(data, fixed, src_retain, lo, hi);
+            looked_up    = 1;
+            contractions = std::max(max_iterations - 1, 1);
+            // The thresholds are relative to the starting width, keep them the same in absolute
+            // terms as for the full bounds
+            typename Model::VaryingArray const full  = model.bounds_hi - model.bounds_lo;
+            typename Model::VaryingArray const width = hi - lo;
+            thresh = (width > 0).select((thresh * full / width).min(1.), thresh);
+        } else {
+            warm.Narrow(lo, hi, 0.1);
+        }
         QI::RegionContraction<Functor> rc(func,
-                                          model.bounds_lo,
-                                          model.bounds_hi,
+                                          lo,
+                                          hi,
                                           thresh,
                                           src_samples,
                                           src_retain,
-                                          max_iterations,
+                                          contractions,
                                           0.02,
                                           src_gauss,
                                           false);
+        rc.setThreads(src_threads);
         if (!rc.optimise(v)) {
             return {false, "Region contraction failed"};
         }
@@ -125,7 +167,8 @@ template <typename Model> struct SRCFit {
             residuals[0] = r.head(model.spgr.size());
             residuals[1] = r.tail(model.ssfp.size());
         }
-        iterations = rc.contractions();
+        iterations = rc.contractions() + looked_up;
+        warm.Save(v);
         return {true, ""};
     }
 };
@@ -151,6 +194,18 @@ int mcdespot_main(int argc, char **argv) {
         parser, "SRC", "Use flat prior (stochastic region contraction), not gaussian", {"SRC"});
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations, default 4", {'i', "its"}, 4);
     args::Flag           bounds(parser, "BOUNDS", "Specify bounds in input", {"bounds"});
+    args::ValueFlag<std::string> library(
+        parser,
+        "FILE",
+        "Start from a signal library in FILE, which is built if needed. Grid read from \"library\" "
+        "in JSON",
+        {"library"});
+    args::ValueFlag<int> src_threads(parser,
+                                     "N",
+                                     "Threads for each voxel's region contraction, only for "
+                                     "--subregion runs with few voxels (default 1)",
+                                     {"src-threads"},
+                                     1);
     QI::ParseArgs(parser, argc, argv, verbose, threads);
     QI::CheckPos(spgr_path);
     QI::CheckPos(ssfp_path);
@@ -173,16 +228,22 @@ int mcdespot_main(int argc, char **argv) {
         } else {
             using FitType = SRCFit<decltype(model)>;
             FitType src{model};
-            src.src_gauss = !use_src;
+            src.src_gauss   = !use_src;
+            src.src_threads = src_threads.Get();
             if (bounds) {
                 src.model.bounds_lo = QI::ArrayFromJSON<double>(input, "lower_bounds");
                 src.model.bounds_hi = QI::ArrayFromJSON<double>(input, "upper_bounds");
             }
             QI::Log(verbose, "Low bounds: {}", src.model.bounds_lo.transpose());
             QI::Log(verbose, "High bounds: {}", src.model.bounds_hi.transpose());
+            if (library) {
+                src.library = std::make_shared<QI::SignalLibrary<decltype(model)> const>(
+                    src.model, input.value("library", json::object()), library.Get(), verbose);
+            }
 
             auto fit_filter =
                 QI::ModelFitFilter<FitType>::New(&src, verbose, covar, resids, subregion.Get());
+            QI_FIT_FILTER_ARGS(fit_filter);
             fit_filter->ReadInputs(
                 {spgr_path.Get(), ssfp_path.Get()}, {f0.Get(), B1.Get()}, mask.Get());
             fit_filter->Update();
@@ -73,6 +73,41 @@ struct MultiEchoLogLin : MultiEchoFit {
         iterations = 1;
         return {true, ""};
     }
+
+    /*
+     * The same log-linear regression for a whole block of voxels. The echo times are shared, so
+     * only the sums involving the data need to be accumulated per voxel.
+     */
+    QI::FitReturnType fit_batch(QI::FitBatch<MultiEcho> &batch, const int /*Unused*/) const {
+        auto const &   data = batch.inputs[0];
+        auto const &   TE   = model.sequence.TE;
+        double const   N    = model.sequence.size();
+        double const   sx   = TE.sum();
+        double const   sxx  = TE.square().sum();
+        Eigen::ArrayXd sy   = Eigen::ArrayXd::Zero(batch.capacity());
+        Eigen::ArrayXd sxy  = sy;
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            Eigen::ArrayXd const y = data.col(j).log();
+            sy += y;
+            sxy += TE[j] * y;
+        }
+        double const det     = N * sxx - sx * sx;
+        batch.varying.col(0) = ((sxx * sy - sx * sxy) / det).exp();
+        batch.varying.col(1) = -det / (N * sxy - sx * sy);
+
+        batch.rmse.setZero();
+        for (Eigen::Index j = 0; j < model.sequence.size(); j++) {
+            Eigen::ArrayXd const r =
+                data.col(j) - batch.varying.col(0) * (-TE[j] / batch.varying.col(1)).exp();
+            if (batch.residuals.size() > 0) {
+                batch.residuals[0].col(j) = r;
+            }
+            batch.rmse += r.square();
+        }
+        batch.rmse = (batch.rmse / N).sqrt();
+        batch.flags.setOnes();
+        return {true, ""};
+    }
 };
 
 struct MultiEchoARLO : MultiEchoFit {
@@ -187,35 +222,39 @@ int multiecho_main(int argc, char **argv) {
         QI::SimulateModel<MultiEcho, false>(
             input, model, {}, {QI::CheckPos(input_path)}, mask.Get(), verbose, simulate.Get(), subregion.Get());
     } else {
-        MultiEchoFit *me = nullptr;
+        // Instantiate the filter with the concrete fit type so it can detect fit_batch()
+        auto process = [&](auto const &me) {
+            using FitType = std::remove_cv_t<std::remove_reference_t<decltype(me)>>;
+            auto fit =
+                QI::ModelFitFilter<FitType>::New(&me, verbose, covar, resids, subregion.Get());
+            QI_FIT_FILTER_ARGS(fit);
+            fit->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
+            const int nvols = fit->GetInput(0)->GetNumberOfComponentsPerPixel();
+            if (nvols % sequence.size() == 0) {
+                const int nblocks = nvols / sequence.size();
+                fit->SetBlocks(nblocks);
+            } else {
+                QI::Fail("Input size is not a multiple of the sequence size");
+            }
+            fit->Update();
+            fit->WriteOutputs(prefix.Get() + "ME_");
+        };
         switch (algorithm.Get()) {
         case 'l':
-            me = new MultiEchoLogLin(model);
             QI::Log(verbose, "LogLin algorithm selected.");
+            process(MultiEchoLogLin{model});
             break;
         case 'a':
-            me = new MultiEchoARLO(model);
             QI::Log(verbose, "ARLO algorithm selected.");
+            process(MultiEchoARLO{model});
             break;
         case 'n':
-            me = new MultiEchoNLLS(model);
             QI::Log(verbose, "Non-linear algorithm (Levenberg Marquardt) selected.");
+            process(MultiEchoNLLS{model});
             break;
         default:
             QI::Fail("Unknown algorithm type {}", algorithm.Get());
         }
-        auto fit =
-            QI::ModelFitFilter<MultiEchoFit>::New(me, verbose, covar, resids, subregion.Get());
-        fit->ReadInputs({QI::CheckPos(input_path)}, {}, mask.Get());
-        const int nvols = fit->GetInput(0)->GetNumberOfComponentsPerPixel();
-        if (nvols % sequence.size() == 0) {
-            const int nblocks = nvols / sequence.size();
-            fit->SetBlocks(nblocks);
-        } else {
-            QI::Fail("Input size is not a multiple of the sequence size");
-        }
-        fit->Update();
-        fit->WriteOutputs(prefix.Get() + "ME_");
         QI::Log(verbose, "Finished.");
     }
     return EXIT_SUCCESS;
@@ -0,0 +1,88 @@
+/*
+ *  qi_allocations.cpp
+ *
+ *  Copyright (c) 2019 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/*
+ *  Replacement allocation functions for AllocationCounter. With glibc, the malloc family can be
+ *  replaced by defining it in the executable, and the originals are still available under their
+ *  __libc_ names. operator new, Eigen and Ceres all end up here. Each call only costs a check of
+ *  a thread-local flag unless a counter is enabled on the calling thread.
+ */
+
+#include "AllocationCounter.h"
+
+#if defined(__GLIBC__)
+
+#include <cerrno>
+#include <cstddef>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void  __libc_free(void *ptr);
+}
+
+namespace {
+inline void Count() {
+    if (QI::detail::counting_allocations) {
+        QI::detail::thread_allocations++;
+    }
+}
+
+[[maybe_unused]] bool const installed = (QI::detail::allocation_hooks = true);
+} // namespace
+
+extern "C" {
+void *malloc(size_t size) {
+    Count();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    Count();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    Count();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    Count();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    Count();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    Count();
+    void *const p = __libc_memalign(alignment, size);
+    if (!p) {
+        return ENOMEM;
+    }
+    *ptr = p;
+    return 0;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+}
+
+#endif
@@ -1,4 +1,8 @@
+#include "Args.h"
+#include "FitContext.h"
+#include "ImageCache.h"
 #include "Log.h"
+#include "Util.h"
 
 #include "B1/Commands.h"
 #include "CoreProgs/Commands.h"
@@ -9,10 +13,109 @@
 #include "Stats/Commands.h"
 #include "Susceptibility/Commands.h"
 #include "Utils/Commands.h"
+#include "qi_serve.h"
 
+#include <algorithm>
+#include <cctype>
+#include <fstream>
 #include <functional>
+#include <map>
+#include <string>
+#include <vector>
 
-using MainFunc = std::function<int(int, char **)>;
+namespace {
+/*
+ * Split a command line on whitespace, keeping anything in single or double quotes together
+ */
+std::vector<std::string> SplitCommandLine(std::string const &line) {
+    std::vector<std::string> words;
+    std::string              word;
+    bool                     in_word = false;
+    char                     quote   = 0;
+    for (char const c : line) {
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else {
+                word += c;
+            }
+        } else if (c == '\'' || c == '"') {
+            quote   = c;
+            in_word = true;
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            if (in_word) {
+                words.push_back(word);
+                word.clear();
+                in_word = false;
+            }
+        } else {
+            word += c;
+            in_word = true;
+        }
+    }
+    if (quote) {
+        QI::Fail("Unterminated quote in command: {}", line);
+    }
+    if (in_word) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+/*
+ * Run a list of commands in this process. Images that one command reads or writes are kept in
+ * memory, so the commands that follow do not read them from disk again (see ImageCache.h).
+ */
+int pipeline_main(std::map<std::string, MainFunc> const &commands, int argc, char **argv) {
+    args::ArgumentParser parser(
+        "Runs a list of commands, one per line without the leading qi, in a single process. Lines "
+        "starting with # are ignored. Standard input is not available, so pass sequence "
+        "parameters with --json.\nhttp://github.com/spinicist/QUIT");
+    args::Positional<std::string> list_path(parser, "COMMANDS", "File containing the commands");
+    args::HelpFlag                help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag           verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> cache_mb(
+        parser, "CACHE", "Maximum size of the image cache in MB (default 8192)", {"cache"}, 8192);
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    std::ifstream list(QI::CheckPos(list_path));
+    if (!list) {
+        QI::Fail("Could not open command list: {}", list_path.Get());
+    }
+    QI::EnableImageCache(static_cast<size_t>(std::max(cache_mb.Get(), 0)) << 20);
+
+    std::string line;
+    int         line_number = 0;
+    while (std::getline(list, line)) {
+        line_number++;
+        auto words = SplitCommandLine(line);
+        if (words.empty() || words.front().front() == '#') {
+            continue;
+        }
+        auto const command = commands.find(words.front());
+        if (command == commands.end()) {
+            QI::Fail("Unknown command {} on line {}", words.front(), line_number);
+        }
+        if (command->first == "pipeline") {
+            QI::Fail("Pipelines cannot be nested, line {}", line_number);
+        }
+        std::vector<char *> command_argv;
+        for (auto &word : words) {
+            command_argv.push_back(word.data());
+        }
+        command_argv.push_back(nullptr);
+        QI::Info(verbose, "Running line {}: {}", line_number, line);
+        QI::InvalidateFitContexts();
+        auto const precision = QI::OutPrecision(); // Commands may change it with --precision
+        int const  status = command->second(static_cast<int>(words.size()), command_argv.data());
+        QI::SetOutPrecision(precision);
+        if (status != EXIT_SUCCESS) {
+            QI::Fail("Command on line {} failed with status {}", line_number, status);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+} // namespace
 
 int main(int argc, char **argv) {
 
@@ -44,6 +147,13 @@ int main(int argc, char **argv) {
     add_utils(commands);
 #endif
 
+    commands["pipeline"] = [&commands](int argc, char **argv) {
+        return pipeline_main(commands, argc, argv);
+    };
+    commands["serve"] = [&commands](int argc, char **argv) {
+        return serve_main(commands, argc, argv);
+    };
+
     auto print_command_list = [&commands]() {
         fmt::print("Available commands:\n");
         size_t max_width = 0;
@@ -0,0 +1,247 @@
+/*
+ *  qi_serve.cpp
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Args.h"
+#include "FitContext.h"
+#include "FitDictionary.h"
+#include "ImageCache.h"
+#include "JSON.h"
+#include "Log.h"
+#include "Util.h"
+#include "qi_serve.h"
+
+namespace {
+/*
+ * Sends everything the command writes to stdout or stderr to a temporary file instead, so it can
+ * be returned to the client
+ */
+class OutputCapture {
+  public:
+    OutputCapture() : m_file{std::tmpfile()} {
+        if (!m_file) {
+            QI::Fail("Could not create a file to capture command output");
+        }
+        Flush();
+        m_stdout = ::dup(STDOUT_FILENO);
+        m_stderr = ::dup(STDERR_FILENO);
+        ::dup2(fileno(m_file), STDOUT_FILENO);
+        ::dup2(fileno(m_file), STDERR_FILENO);
+    }
+
+    ~OutputCapture() {
+        Restore();
+        std::fclose(m_file);
+    }
+
+    std::string Finish() {
+        Restore();
+        std::string output;
+        std::rewind(m_file);
+        char   buffer[4096];
+        size_t n;
+        while ((n = std::fread(buffer, 1, sizeof(buffer), m_file)) > 0) {
+            output.append(buffer, n);
+        }
+        return output;
+    }
+
+  private:
+    static void Flush() {
+        std::cout.flush();
+        std::cerr.flush();
+        std::fflush(stdout);
+        std::fflush(stderr);
+    }
+
+    void Restore() {
+        if (m_stdout >= 0) {
+            Flush();
+            ::dup2(m_stdout, STDOUT_FILENO);
+            ::dup2(m_stderr, STDERR_FILENO);
+            ::close(m_stdout);
+            ::close(m_stderr);
+            m_stdout = m_stderr = -1;
+        }
+    }
+
+    std::FILE *m_file;
+    int        m_stdout = -1, m_stderr = -1;
+};
+
+std::string ReadRequest(int const client) {
+    std::string request;
+    char        buffer[4096];
+    ssize_t     n;
+    while ((n = ::read(client, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        request.append(buffer, n);
+    }
+    return request;
+}
+
+void SendResponse(int const client, json const &response) {
+    std::string const text = response.dump() + "\n";
+    size_t            sent = 0;
+    while (sent < text.size()) {
+        ssize_t const n = ::write(client, text.data() + sent, text.size() - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            QI::Warn("Client disconnected before the response was sent");
+            return;
+        }
+        sent += n;
+    }
+}
+
+json Failed(std::string const &message) {
+    return json{{"status", EXIT_FAILURE}, {"output", message + "\n"}};
+}
+
+/*
+ * Runs one command in the directory and with the standard input given by the client
+ */
+json RunRequest(std::map<std::string, MainFunc> const &commands, json const &request) {
+    auto words = request.at("args").get<std::vector<std::string>>();
+    if (words.empty()) {
+        return Failed("No command given");
+    }
+    auto const command = commands.find(words.front());
+    if (command == commands.end()) {
+        return Failed("Unknown command " + words.front());
+    }
+    if (command->first == "serve" || command->first == "pipeline") {
+        return Failed("Cannot run " + command->first + " inside qi serve");
+    }
+
+    char *const previous_dir = ::getcwd(nullptr, 0);
+    auto const  cwd          = request.value("cwd", std::string{});
+    if (!cwd.empty() && ::chdir(cwd.c_str()) != 0) {
+        std::free(previous_dir);
+        return Failed("Could not change to directory " + cwd);
+    }
+    std::vector<char *> argv;
+    for (auto &word : words) {
+        argv.push_back(word.data());
+    }
+    argv.push_back(nullptr);
+    std::istringstream input(request.value("stdin", std::string{}));
+    auto *const        cin_buffer = std::cin.rdbuf(input.rdbuf());
+
+    QI::InvalidateFitContexts();
+    auto const    precision = QI::OutPrecision(); // Commands may change it with --precision
+    int           status    = EXIT_FAILURE;
+    OutputCapture capture;
+    try {
+        status = command->second(static_cast<int>(words.size()), argv.data());
+    } catch (QI::CommandExit const &e) {
+        status = e.status;
+    } catch (std::exception const &e) {
+        fmt::print(stderr, "{}\n", e.what());
+    }
+    std::string const output = capture.Finish();
+
+    std::cin.rdbuf(cin_buffer);
+    std::cin.clear();
+    QI::SetOutPrecision(precision);
+    if (previous_dir) {
+        if (::chdir(previous_dir) != 0) {
+            QI::Warn("Could not return to directory {}", previous_dir);
+        }
+        std::free(previous_dir);
+    }
+    return json{{"status", status}, {"output", output}};
+}
+} // namespace
+
+int serve_main(std::map<std::string, MainFunc> const &commands, int argc, char **argv) {
+    args::ArgumentParser parser(
+        "Keeps a qi process running that accepts commands on a local Unix socket. Images and "
+        "dictionaries stay in memory between commands.\nhttp://github.com/spinicist/QUIT");
+    args::Positional<std::string> socket_path(parser, "SOCKET", "Path of the socket to create");
+    args::HelpFlag                help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag           verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> cache_mb(
+        parser, "CACHE", "Maximum size of the image cache in MB (default 8192)", {"cache"}, 8192);
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    std::string const path = QI::CheckPos(socket_path);
+    sockaddr_un       address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        QI::Fail("Socket path is too long: {}", path);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int const server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path.c_str()); // Left behind by a server that did not shut down cleanly
+    if (server < 0 || ::bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) ||
+        ::listen(server, SOMAXCONN)) {
+        QI::Fail("Could not listen on {}: {}", path, std::strerror(errno));
+    }
+    std::signal(SIGPIPE, SIG_IGN); // Clients that disconnect early should not stop the server
+
+    QI::EnableImageCache(static_cast<size_t>(std::max(cache_mb.Get(), 0)) << 20);
+    QI::KeepDictionaries() = true;
+    QI::ThrowOnExit()      = true;
+    QI::Info(verbose, "Listening on {}", path);
+
+    bool shutdown = false;
+    while (!shutdown) {
+        int const client = ::accept(server, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            QI::Warn("Could not accept connection: {}", std::strerror(errno));
+            continue;
+        }
+        json response;
+        try {
+            json const request = json::parse(ReadRequest(client));
+            if (request.value("shutdown", false)) {
+                shutdown = true;
+                response = json{{"status", EXIT_SUCCESS}, {"output", ""}};
+            } else {
+                QI::Info(verbose, "Running: {}", request.at("args").dump());
+                response = RunRequest(commands, request);
+                QI::Info(verbose, "Finished with status {}", response["status"].get<int>());
+            }
+        } catch (json::exception const &e) {
+            response = Failed(std::string("Invalid request: ") + e.what());
+        }
+        SendResponse(client, response);
+        ::close(client);
+    }
+    ::close(server);
+    ::unlink(path.c_str());
+    QI::ThrowOnExit() = false;
+    return EXIT_SUCCESS;
+}
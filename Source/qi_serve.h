@@ -0,0 +1,27 @@
+/*
+ *  qi_serve.h
+ *
+ *  Copyright (c) 2020 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+
+using MainFunc = std::function<int(int, char **)>;
+
+/*
+ * Listen on a Unix socket and run the commands that clients send, one at a time, in this process.
+ * Each request is a JSON object with the command line in "args", and optionally the working
+ * directory in "cwd" and the standard input in "stdin". The response is a JSON object with the
+ * exit "status" and everything the command printed in "output". {"shutdown": true} stops the
+ * server.
+ */
+int serve_main(std::map<std::string, MainFunc> const &commands, int argc, char **argv);